@@ -35,8 +35,16 @@ typedef struct {
     usb_dev_handle *usbdev;
 
     /* Буфер для вывода-ввода в режиме sync bitbang. */
-    unsigned char output [128];
+    unsigned char output [8192];
     int output_len;
+
+    /* Отложенные чтения из очереди транзакций OnCD. */
+    struct {
+        unsigned *result;
+        unsigned offset;
+        unsigned nbits;
+    } pending [64];
+    int npending;
 } bitbang_adapter_t;
 
 /*
@@ -62,6 +70,12 @@ typedef struct {
 #define NTRST           (1 << 4)
 #define NSYSRST         (1 << 6)
 
+/*
+ * Максимальное количество отсчётов одной транзакции OnCD:
+ * 3 шага TMS, 41 бит данных, шаг TMS и завершающий отсчёт.
+ */
+#define QUEUE_MAXSAMPLES        (2*3 + 2*41 + 2 + 1)
+
 /*
  * Identifiers of USB adapter.
  */
@@ -143,6 +157,17 @@ static void bitbang_step (bitbang_adapter_t *a, int tms)
     bitbang_write (a, 1, tms, 1);
 }
 
+/*
+ * FT232R: USB packets are 64 bytes, two of which in every
+ * received packet are modem and line status. Transmit FIFO
+ * of the chip (towards host) is 256 bytes.
+ * We keep at most MAX_OUTSTANDING bytes sent but not yet echoed,
+ * so the FIFO never overflows, while the chip always has
+ * the next portion of samples to clock out.
+ */
+#define PACKET_SIZE     64
+#define MAX_OUTSTANDING (256 - PACKET_SIZE)
+
 /*
  * Perform sync bitbang output/input transaction.
  * Befor call, an array a->output[] should be filled with data to send.
@@ -151,81 +176,92 @@ static void bitbang_step (bitbang_adapter_t *a, int tms)
  */
 static void bitbang_send_recv (bitbang_adapter_t *a)
 {
-    int bytes_to_write, bytes_written, n, txdone, rxdone;
-    int empty_rxfifo, bytes_to_read, bytes_read;
-    unsigned char reply [64];
+    int bytes_to_write, n, i, chunk, txdone, rxdone;
+    unsigned char reply [MAX_OUTSTANDING + PACKET_SIZE];
 
     bitbang_write (a, 0, 1, 1);
 
-    /* First two receive bytes contain modem and line status. */
-    empty_rxfifo = sizeof(reply) - 2;
-
     /* Indexes in data buffer. */
     txdone = 0;
     rxdone = 0;
     while (rxdone < a->output_len) {
-        /* Try to send as much as possible,
-         * but avoid overflow of receive buffer.
-         * Unfortunately, transfer sizes bigger that
-         * 64 bytes cause hang ups. */
-        bytes_to_write = 64;
-        if (bytes_to_write > a->output_len - txdone)
-            bytes_to_write = a->output_len - txdone;
-        if (bytes_to_write > empty_rxfifo)
-            bytes_to_write = empty_rxfifo;
-
-        /* Write data. */
-        bytes_written = 0;
-        while (bytes_written < bytes_to_write) {
-            if (debug_level)
-                fprintf (stderr, "usb bulk write %d bytes\n",
-                    bytes_to_write - bytes_written);
+        /* Post as many packets as the receive FIFO allows,
+         * before reading back echo of the previous ones.
+         * Transfer sizes bigger that 64 bytes cause hang ups,
+         * so every write is one USB packet. */
+        while (txdone < a->output_len &&
+               txdone - rxdone < MAX_OUTSTANDING) {
+            bytes_to_write = PACKET_SIZE;
+            if (bytes_to_write > a->output_len - txdone)
+                bytes_to_write = a->output_len - txdone;
+            if (bytes_to_write > MAX_OUTSTANDING - (txdone - rxdone))
+                bytes_to_write = MAX_OUTSTANDING - (txdone - rxdone);
 
+            if (debug_level)
+                fprintf (stderr, "usb bulk write %d bytes\n", bytes_to_write);
             n = usb_bulk_write (a->usbdev, IN_EP,
-                (char*) a->output + txdone + bytes_written,
-                bytes_to_write - bytes_written, 1000);
+                (char*) a->output + txdone, bytes_to_write, 1000);
             if (n < 0) {
                 fprintf (stderr, "usb bulk write failed\n");
                 exit (-1);
             }
-            /*if (n != bytes_to_write)
-                fprintf (stderr, "usb bulk written %d bytes of %d",
-                    n, bytes_to_write - bytes_written);*/
-            bytes_written += n;
+            txdone += n;
+            a->adapter.stats.bytes_out += n;
+        }
+
+        /* Get reply for the bytes in flight.
+         * The chip is busy with the rest meanwhile. */
+        n = txdone - rxdone;
+        n = (n + PACKET_SIZE - 3) / (PACKET_SIZE - 2) * PACKET_SIZE;
+        if (n > (int) sizeof (reply))
+            n = sizeof (reply) / PACKET_SIZE * PACKET_SIZE;
+        n = usb_bulk_read (a->usbdev, OUT_EP, (char*) reply, n, 2000);
+        if (n < 0) {
+            fprintf (stderr, "usb bulk read failed\n");
+            exit (-1);
         }
-        txdone += bytes_written;
-        empty_rxfifo -= bytes_written;
-
-        if (empty_rxfifo == 0 || txdone == a->output_len) {
-            /* Get reply. */
-            bytes_to_read = sizeof(reply) - empty_rxfifo - 2;
-            bytes_read = 0;
-            while (bytes_read < bytes_to_read) {
-                n = usb_bulk_read (a->usbdev, OUT_EP,
-                    (char*) reply,
-                    bytes_to_read - bytes_read + 2, 2000);
-                if (n < 0) {
-                    fprintf (stderr, "usb bulk read failed\n");
-                    exit (-1);
-                }
-                if (n != bytes_to_read + 2)
-                    fprintf (stderr, "usb bulk read %d bytes of %d\n",
-                        n, bytes_to_read - bytes_read + 2);
-                else if (debug_level)
-                    fprintf (stderr, "usb bulk read %d bytes\n", n);
-                if (n > 2) {
-                    /* Copy data. */
-                    memcpy (a->output + rxdone, reply + 2, n - 2);
-                    bytes_read += n;
-                    rxdone += n - 2;
-                }
+        if (debug_level)
+            fprintf (stderr, "usb bulk read %d bytes\n", n);
+        a->adapter.stats.round_trips++;
+        a->adapter.stats.bytes_in += n;
+        for (i=0; i<n; i+=PACKET_SIZE) {
+            chunk = n - i;
+            if (chunk > PACKET_SIZE)
+                chunk = PACKET_SIZE;
+            if (chunk <= 2)
+                continue;
+            if (rxdone + chunk - 2 > txdone) {
+                fprintf (stderr, "usb bulk read: unexpected %d bytes\n",
+                    rxdone + chunk - 2 - txdone);
+                exit (-1);
             }
-            empty_rxfifo = sizeof(reply) - 2;
+            /* Copy data. */
+            memcpy (a->output + rxdone, reply + i + 2, chunk - 2);
+            rxdone += chunk - 2;
         }
     }
     a->output_len = 0;
 }
 
+/*
+ * Отправка накопленных данных и выборка результатов
+ * отложенных чтений OnCD.
+ */
+static void bitbang_flush (bitbang_adapter_t *a)
+{
+    unsigned long long data;
+    int i;
+
+    bitbang_send_recv (a);
+    for (i=0; i<a->npending; i++) {
+        data = 0;
+        bitbang_read (a, a->pending[i].offset, a->pending[i].nbits,
+            (unsigned char*) &data);
+        *a->pending[i].result = data >> 9;
+    }
+    a->npending = 0;
+}
+
 static void bitbang_close (adapter_t *adapter)
 {
     bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
@@ -260,24 +296,23 @@ static int tap_instr (bitbang_adapter_t *a, int nbits, unsigned newinst)
         bitbang_write (a, 1, tms, tdi);
     }
     bitbang_step (a, 1);        /* goto Update-IR */
-    bitbang_send_recv (a);
+    bitbang_flush (a);
     bitbang_read (a, input_offset, nbits, (unsigned char*) &status);
     return status;
 }
 
 /*
- * Enter a bit stream in the selected DR.
+ * Add a bit stream for the selected DR to send buffer.
  *
  * Assumes TAP is on Run-Test/Idle or Update-DR/Update-IR states at entry.
  * On exit, stays at Update-DR/Update-IR.
  * Newdata is an array of bytes with the bit stream to send,
  * LSB first. The total number of bits to send is nbits.
- * The readout bit stream is stored in olddata[].
  * If newdata is NULL, zeros are sent in the data stream.
- * If olddata is NULL, readout bits are thrown away.
+ * Returns an offset of readout bit stream in send buffer.
  */
-static void tap_data (bitbang_adapter_t *a,
-    unsigned nbits, unsigned char *newdata, unsigned char *olddata)
+static unsigned tap_data_append (bitbang_adapter_t *a,
+    unsigned nbits, unsigned char *newdata)
 {
     unsigned databits = 0, input_offset, tms, tdi, n;
     unsigned char mask = 0;
@@ -300,7 +335,21 @@ static void tap_data (bitbang_adapter_t *a,
         bitbang_write (a, 1, tms, tdi);
     }
     bitbang_step (a, 1);            /* goto Update-DR */
-    bitbang_send_recv (a);
+    return input_offset;
+}
+
+/*
+ * Enter a bit stream in the selected DR.
+ * The readout bit stream is stored in olddata[].
+ * If olddata is NULL, readout bits are thrown away.
+ */
+static void tap_data (bitbang_adapter_t *a,
+    unsigned nbits, unsigned char *newdata, unsigned char *olddata)
+{
+    unsigned input_offset;
+
+    input_offset = tap_data_append (a, nbits, newdata);
+    bitbang_flush (a);
     if (olddata)
         bitbang_read (a, input_offset, nbits, olddata);
 }
@@ -368,6 +417,7 @@ static unsigned bitbang_oncd_read (adapter_t *adapter, int reg, int reglen)
     unsigned long long data;
     unsigned value;
 
+    a->adapter.stats.oncd_reads++;
     data = reg | IRd_READ;
     tap_data (a, 9 + reglen,
         (unsigned char*) &data, (unsigned char*) &data);
@@ -385,9 +435,9 @@ static unsigned bitbang_oncd_read (adapter_t *adapter, int reg, int reglen)
 }
 
 /*
- * Запись регистра OnCD.
+ * Постановка в очередь записи регистра OnCD.
  */
-static void bitbang_oncd_write (adapter_t *adapter,
+static void bitbang_oncd_queue_write (adapter_t *adapter,
     unsigned value, int reg, int reglen)
 {
     bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
@@ -409,10 +459,61 @@ static void bitbang_oncd_write (adapter_t *adapter,
             fprintf (stderr, "\n");
         }
     }
+    /* Проверяем, есть ли место в буфере. */
+    if (a->output_len + QUEUE_MAXSAMPLES > sizeof (a->output))
+        bitbang_flush (a);
+
+    a->adapter.stats.oncd_writes++;
     data = reg;
     if (reglen > 0)
         data |= (unsigned long long) value << 9;
-    tap_data (a, 9 + reglen, (unsigned char*) &data, 0);
+    tap_data_append (a, 9 + reglen, (unsigned char*) &data);
+}
+
+/*
+ * Постановка в очередь чтения регистра OnCD.
+ */
+static void bitbang_oncd_queue_read (adapter_t *adapter, int reg, int reglen,
+    unsigned *result)
+{
+    bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
+    unsigned long long data;
+    int n;
+
+    /* Проверяем, есть ли место в буфере. */
+    if (a->output_len + QUEUE_MAXSAMPLES > sizeof (a->output) ||
+        a->npending >= sizeof (a->pending) / sizeof (a->pending[0]))
+        bitbang_flush (a);
+
+    a->adapter.stats.oncd_reads++;
+    data = reg | IRd_READ;
+    n = a->npending++;
+    a->pending[n].result = result;
+    a->pending[n].nbits = 9 + reglen;
+    a->pending[n].offset = tap_data_append (a, 9 + reglen,
+        (unsigned char*) &data);
+}
+
+/*
+ * Выполнение накопленной очереди транзакций OnCD.
+ */
+static void bitbang_oncd_flush (adapter_t *adapter)
+{
+    bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
+
+    bitbang_flush (a);
+}
+
+/*
+ * Запись регистра OnCD.
+ */
+static void bitbang_oncd_write (adapter_t *adapter,
+    unsigned value, int reg, int reglen)
+{
+    bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
+
+    bitbang_oncd_queue_write (adapter, value, reg, reglen);
+    bitbang_flush (a);
 }
 
 /*
@@ -441,6 +542,113 @@ static void bitbang_stop_cpu (adapter_t *adapter)
     }
 }
 
+/*
+ * Постановка в очередь записи слова в память через OnCD.
+ */
+static void bitbang_mem_write (adapter_t *adapter, unsigned addr, unsigned data)
+{
+    bitbang_oncd_queue_write (adapter, addr, OnCD_OMAR, 32);
+    bitbang_oncd_queue_write (adapter, data, OnCD_OMDR, 32);
+    bitbang_oncd_queue_write (adapter, 0, OnCD_MEM, 0);
+}
+
+/*
+ * Отсылка накопленной очереди и проверка, что
+ * последнее обращение к памяти завершилось.
+ */
+static void bitbang_check_ready (adapter_t *adapter, const char *what)
+{
+    bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
+    unsigned oscr;
+
+    bitbang_oncd_queue_read (adapter, OnCD_OSCR, 32, &oscr);
+    bitbang_flush (a);
+    a->adapter.stats.rdym_polls++;
+    if (! (oscr & OSCR_RDYm)) {
+        fprintf (stderr, "Timeout %s, aborted. OSCR=%#x\n", what, oscr);
+        exit (1);
+    }
+}
+
+/*
+ * Разрешение доступа к памяти на запись.
+ */
+static void bitbang_write_start (adapter_t *adapter)
+{
+    unsigned oscr_new = (adapter->oscr & ~OSCR_RO) | OSCR_SlctMEM;
+    if (oscr_new != adapter->oscr) {
+        adapter->oscr = oscr_new;
+        bitbang_oncd_queue_write (adapter, adapter->oscr, OnCD_OSCR, 32);
+    }
+}
+
+static void bitbang_read_block (adapter_t *adapter,
+    unsigned nwords, unsigned addr, unsigned *data)
+{
+    bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
+
+    /* Allow memory access */
+    unsigned oscr_new = adapter->oscr | OSCR_SlctMEM | OSCR_RO;
+    if (oscr_new != adapter->oscr) {
+        adapter->oscr = oscr_new;
+        bitbang_oncd_queue_write (adapter, adapter->oscr, OnCD_OSCR, 32);
+    }
+
+    /* Весь поток отсчётов для многих слов формируется в одном
+     * буфере, принятые биты TDO разбираются при выталкивании
+     * очереди прямо в массив data. */
+    while (nwords-- > 0) {
+        bitbang_oncd_queue_write (adapter, addr, OnCD_OMAR, 32);
+        bitbang_oncd_queue_write (adapter, 0, OnCD_MEM, 0);
+        bitbang_oncd_queue_read (adapter, OnCD_OMDR, 32, data);
+        addr += 4;
+        data++;
+    }
+    bitbang_flush (a);
+}
+
+static void bitbang_write_block (adapter_t *adapter,
+    unsigned nwords, unsigned addr, unsigned *data)
+{
+    bitbang_write_start (adapter);
+    while (nwords-- > 0) {
+        bitbang_mem_write (adapter, addr, *data);
+        addr += 4;
+        data++;
+    }
+    bitbang_check_ready (adapter, "writing N words");
+}
+
+static void bitbang_write_nwords (adapter_t *adapter, unsigned nwords, va_list args)
+{
+    bitbang_write_start (adapter);
+    while (nwords-- > 0) {
+        unsigned addr = va_arg (args, unsigned);
+        unsigned data = va_arg (args, unsigned);
+        bitbang_mem_write (adapter, addr, data);
+    }
+    bitbang_check_ready (adapter, "writing words");
+}
+
+static void bitbang_program_block32 (adapter_t *adapter,
+    unsigned nwords, unsigned base, unsigned addr, unsigned *data,
+    unsigned addr_odd, unsigned addr_even,
+    unsigned cmd_aa, unsigned cmd_55, unsigned cmd_a0)
+{
+    bitbang_write_start (adapter);
+    while (nwords-- > 0) {
+        if (cmd_aa) {
+            bitbang_mem_write (adapter, base + addr_odd, cmd_aa);
+            bitbang_mem_write (adapter, base + addr_even, cmd_55);
+        }
+        bitbang_mem_write (adapter, base + addr_odd, cmd_a0);
+        bitbang_mem_write (adapter, addr, *data);
+        addr += 4;
+        data++;
+    }
+    bitbang_check_ready (adapter, "programming block32");
+}
+
 /*
  * Аппаратный сброс процессора.
  */
@@ -450,7 +658,7 @@ static void bitbang_reset_cpu (adapter_t *adapter)
     unsigned idle = NTRST | NSYSRST | TMS | TDI;
 
     /* Активируем /SYSRST на 5 микросекунд. */
-    bitbang_send_recv (a);
+    bitbang_flush (a);
     a->output [a->output_len++] = idle & ~NSYSRST;
     a->output [a->output_len++] = idle & ~NSYSRST;
     a->output [a->output_len++] = idle & ~NSYSRST;
@@ -465,26 +673,17 @@ static void bitbang_reset_cpu (adapter_t *adapter)
  * Возвращаем указатель на структуру данных, выделяемую динамически.
  * Если адаптер не обнаружен, возвращаем 0.
  */
-adapter_t *adapter_open_bitbang (void)
+adapter_t *adapter_open_bitbang (const char *id)
 {
     bitbang_adapter_t *a;
-    struct usb_bus *bus;
     struct usb_device *dev;
 
-    usb_init();
-    usb_find_busses();
-    usb_find_devices();
-    for (bus = usb_get_busses(); bus; bus = bus->next) {
-        for (dev = bus->devices; dev; dev = dev->next) {
-            if (dev->descriptor.idVendor == BITBANG_VID &&
-                dev->descriptor.idProduct == BITBANG_PID)
-                goto found;
-        }
+    dev = adapter_usb_find (BITBANG_VID, BITBANG_PID, id);
+    if (! dev) {
+        /*fprintf (stderr, "USB adapter not found: vid=%04x, pid=%04x\n",
+            BITBANG_VID, BITBANG_PID);*/
+        return 0;
     }
-    /*fprintf (stderr, "USB adapter not found: vid=%04x, pid=%04x\n",
-        BITBANG_VID, BITBANG_PID);*/
-    return 0;
-found:
     a = calloc (1, sizeof (*a));
     if (! a) {
         fprintf (stderr, "Out of memory\n");
@@ -496,7 +695,12 @@ found:
         free (a);
         return 0;
     }
-    usb_claim_interface (a->usbdev, 0);
+    if (usb_claim_interface (a->usbdev, 0) != 0) {
+        fprintf (stderr, "Bitbang: usb_claim_interface() failed\n");
+        usb_close (a->usbdev);
+        free (a);
+        return 0;
+    }
 
     /* Reset the ftdi device. */
     if (usb_control_msg (a->usbdev,
@@ -521,7 +725,10 @@ failed: usb_release_interface (a->usbdev, 0);
         goto failed;
     }
 
-    /* Ровно 500 нсек между выдачами. */
+    /* Ровно 500 нсек между выдачами.
+     * Таймер задержки минимальный: неполный последний пакет
+     * ответа приходит через 1 мсек, а полные пакеты идут
+     * потоком без ожидания. */
     unsigned divisor = 0;
     unsigned char latency_timer = 1;
     if (debug_level) {
@@ -572,6 +779,17 @@ failed: usb_release_interface (a->usbdev, 0);
     a->adapter.reset_cpu = bitbang_reset_cpu;
     a->adapter.oncd_read = bitbang_oncd_read;
     a->adapter.oncd_write = bitbang_oncd_write;
+
+    /* Расширенные возможности. */
+    a->adapter.block_words = 999999;
+    a->adapter.program_block_words = 999999;
+    a->adapter.read_block = bitbang_read_block;
+    a->adapter.write_block = bitbang_write_block;
+    a->adapter.write_nwords = bitbang_write_nwords;
+    a->adapter.program_block32 = bitbang_program_block32;
+    a->adapter.oncd_queue_write = bitbang_oncd_queue_write;
+    a->adapter.oncd_queue_read = bitbang_oncd_queue_read;
+    a->adapter.oncd_flush = bitbang_oncd_flush;
     return &a->adapter;
 }
 
@@ -670,7 +888,7 @@ usage:      printf ("Test for FT232R JTAG adapter.\n");
     default:
         goto usage;
     case 1:
-        adapter = adapter_open_bitbang ();
+        adapter = adapter_open_bitbang (0);
         if (! adapter) {
             fprintf (stderr, "No bitbang adapter found.\n");
             exit (1);
@@ -254,10 +254,14 @@ static void get_winnt_lpt_access()
 /*
  * Переключение направления порта данных LPT.
  */
+static int cur_mode = -1;
+
+/* Счётчики обменов открытого адаптера. */
+static adapter_stats_t lpt_no_stats, *lpt_stats = &lpt_no_stats;
+
 static void direction_reverse (int reverse)
 {
     int ctrl;
-    static int cur_mode = -1;
 
     /* Epp reliability is sensitive to setting the same mode twice.
      * So, just return if we are already in the requested mode. */
@@ -401,29 +405,61 @@ failed:         fprintf (stderr, _("No device on LPT port -- check cable!\n"));
 }
 
 /*
- * Обмен данными с блоком OnCD.
+ * Выдача данных в блок OnCD без ожидания статуса.
+ * Готовность адаптера к следующему циклу обеспечивается
+ * аппаратным квитированием EPP.
  */
-static void oncd_io (char *data, int len)
+static void oncd_send (char *data, int len)
 {
     int i;
-    time_t t0;
 
     putcmd (MCIF_PREWRITE);
     outb (len + 1, EPP_DATA);
     for (i = 0; i < (len + 7) / 8; i++)
         outb (data[i], EPP_DATA);
     putcmd (MCIF_WRITE_DR);
+    lpt_stats->bytes_out += 3 + (len + 7) / 8;
+}
+
+/*
+ * Приём данных от блока OnCD.
+ */
+static void oncd_receive (char *data, int len)
+{
+    int i;
+
+    putcmd (MCIF_PREREAD);
+    direction_reverse (1);
+    for (i = 0; i < (len + 7) / 8; i++)
+        data[i] = inb (EPP_DATA);
+    lpt_stats->round_trips++;
+    lpt_stats->bytes_in += (len + 7) / 8;
+}
+
+/*
+ * Ожидание конца сдвига: адаптер вернулся в Run-Test-Idle.
+ */
+static void wait_rti (const char *what)
+{
+    time_t t0;
+
     t0 = time (0);
     while (wait_status (MCIF_STATUS_RTI)) {
         if (time (0) > t0 + 1) {
-            fprintf (stderr, "oncd_io: timeout\n");
+            fprintf (stderr, "%s: timeout\n", what);
             exit (1);
         }
     }
-    putcmd (MCIF_PREREAD);
-    direction_reverse (1);
-    for (i = 0; i < (len + 7) / 8; i++)
-        data[i] = inb (EPP_DATA);
+}
+
+/*
+ * Обмен данными с блоком OnCD.
+ */
+static void oncd_io (char *data, int len)
+{
+    oncd_send (data, len);
+    wait_rti ("oncd_io");
+    oncd_receive (data, len);
 }
 
 /*
@@ -433,6 +469,7 @@ static unsigned lpt_oncd_read (adapter_t *adapter, int reg, int nbits)
 {
     unsigned data[2];
 
+    lpt_stats->oncd_reads++;
     data[0] = (reg | 0x40) << 24;
     data[1] = 0;
     oncd_io ((char*)data + 3, 8 + nbits);
@@ -447,11 +484,146 @@ static void lpt_oncd_write (adapter_t *adapter,
 {
     unsigned int data[2];
 
+    lpt_stats->oncd_writes++;
     data[0] = reg << 24;
     data[1] = val;
     oncd_io ((char*)data + 3, 8 + nbits);
 }
 
+/*
+ * Пакетная запись регистра OnCD: без чтения ответа и без
+ * опроса OSCR, порт остаётся в прямом направлении.
+ * Конца сдвига ждём: буфер DR в адаптере один, и следующая
+ * запись, выданная раньше, затёрла бы предыдущую.
+ */
+static void burst_write (unsigned val, int reg, int nbits)
+{
+    unsigned int data[2];
+
+    lpt_stats->oncd_writes++;
+    data[0] = reg << 24;
+    data[1] = val;
+    oncd_send ((char*)data + 3, 8 + nbits);
+    wait_rti ("burst_write");
+}
+
+/*
+ * Пакетная запись слова в память.
+ */
+static void burst_mem_write (unsigned addr, unsigned val)
+{
+    burst_write (addr, OnCD_OMAR, 32);
+    burst_write (val, OnCD_OMDR, 32);
+    burst_write (0, OnCD_MEM, 0);
+}
+
+/*
+ * Завершение пакетной передачи: ожидание готовности адаптера,
+ * проверка тайм-аута EPP и бита RDYm в регистре OSCR.
+ */
+static void burst_finish (adapter_t *adapter, const char *what)
+{
+    unsigned char status;
+    unsigned oscr;
+
+    wait_rti (what);
+    status = inb (SPP_STATUS);
+    if (status & EPP_STATUS_TMOUT) {
+        outb (status, SPP_STATUS);
+        fprintf (stderr, "%s: EPP timeout\n", what);
+        exit (1);
+    }
+    oscr = lpt_oncd_read (adapter, OnCD_OSCR, 32);
+    lpt_stats->rdym_polls++;
+    if (! (oscr & OSCR_RDYm)) {
+        fprintf (stderr, "Timeout %s, aborted. OSCR=%#x\n", what, oscr);
+        exit (1);
+    }
+}
+
+/*
+ * Разрешение доступа к памяти.
+ */
+static void lpt_mem_access (adapter_t *adapter, int read_only)
+{
+    unsigned oscr_new = adapter->oscr | OSCR_SlctMEM;
+
+    if (read_only)
+        oscr_new |= OSCR_RO;
+    else
+        oscr_new &= ~OSCR_RO;
+    if (oscr_new != adapter->oscr) {
+        adapter->oscr = oscr_new;
+        lpt_oncd_write (adapter, adapter->oscr, OnCD_OSCR, 32);
+    }
+}
+
+static void lpt_read_block (adapter_t *adapter,
+    unsigned nwords, unsigned addr, unsigned *data)
+{
+    unsigned buf[2];
+
+    lpt_mem_access (adapter, 1);
+
+    /* Адрес, запуск чтения и команда чтения OMDR выдаются
+     * одной пачкой в прямом направлении, затем, после
+     * окончания сдвига OMDR, ответ забирается в обратном.
+     * Опроса RDYm на каждое слово нет: процессор остановлен. */
+    while (nwords-- > 0) {
+        burst_write (addr, OnCD_OMAR, 32);
+        burst_write (0, OnCD_MEM, 0);
+        buf[0] = (OnCD_OMDR | 0x40) << 24;
+        buf[1] = 0;
+        lpt_stats->oncd_reads++;
+        oncd_send ((char*)buf + 3, 8 + 32);
+        wait_rti ("reading memory");
+        oncd_receive ((char*)buf + 3, 8 + 32);
+        *data++ = buf[1];
+        addr += 4;
+    }
+    burst_finish (adapter, "reading memory");
+}
+
+static void lpt_write_block (adapter_t *adapter,
+    unsigned nwords, unsigned addr, unsigned *data)
+{
+    lpt_mem_access (adapter, 0);
+    while (nwords-- > 0) {
+        burst_mem_write (addr, *data++);
+        addr += 4;
+    }
+    burst_finish (adapter, "writing N words");
+}
+
+static void lpt_write_nwords (adapter_t *adapter, unsigned nwords, va_list args)
+{
+    lpt_mem_access (adapter, 0);
+    while (nwords-- > 0) {
+        unsigned addr = va_arg (args, unsigned);
+        unsigned data = va_arg (args, unsigned);
+        burst_mem_write (addr, data);
+    }
+    burst_finish (adapter, "writing words");
+}
+
+static void lpt_program_block32 (adapter_t *adapter,
+    unsigned nwords, unsigned base, unsigned addr, unsigned *data,
+    unsigned addr_odd, unsigned addr_even,
+    unsigned cmd_aa, unsigned cmd_55, unsigned cmd_a0)
+{
+    lpt_mem_access (adapter, 0);
+    while (nwords-- > 0) {
+        if (cmd_aa) {
+            burst_mem_write (base + addr_odd, cmd_aa);
+            burst_mem_write (base + addr_even, cmd_55);
+        }
+        burst_mem_write (base + addr_odd, cmd_a0);
+        burst_mem_write (addr, *data++);
+        addr += 4;
+    }
+    burst_finish (adapter, "programming block32");
+}
+
 /*
  * Перевод кристалла в режим отладки путём манипуляций
  * регистрами данных JTAG.
@@ -523,10 +695,14 @@ static int lpt_cpu_stopped (adapter_t *adapter)
 /*
  * Close the device.
  */
+static int lpt_opened;
+
 static void lpt_close (adapter_t *adapter)
 {
     lpt_adapter_t *a = (lpt_adapter_t*) adapter;
 
+    lpt_opened = 0;
+    lpt_stats = &lpt_no_stats;
     free (a);
 }
 
@@ -540,6 +716,13 @@ adapter_t *adapter_open_lpt (void)
     lpt_adapter_t *a;
     unsigned char ctrl, status;
 
+    /* Порт LPT один на процесс: его состояние общее. */
+    if (lpt_opened) {
+        fprintf (stderr, "LPT adapter: already in use\n");
+        return 0;
+    }
+    cur_mode = -1;
+
     /*
      * Установка доступа к аппаратным портам ввода-вывода.
      */
@@ -632,5 +815,15 @@ adapter_t *adapter_open_lpt (void)
     a->adapter.reset_cpu = lpt_reset_cpu;
     a->adapter.oncd_read = lpt_oncd_read;
     a->adapter.oncd_write = lpt_oncd_write;
+
+    /* Расширенные возможности. */
+    a->adapter.block_words = 999999;
+    a->adapter.program_block_words = 999999;
+    a->adapter.read_block = lpt_read_block;
+    a->adapter.write_block = lpt_write_block;
+    a->adapter.write_nwords = lpt_write_nwords;
+    a->adapter.program_block32 = lpt_program_block32;
+    lpt_opened = 1;
+    lpt_stats = &a->adapter.stats;
     return &a->adapter;
 }
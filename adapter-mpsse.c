@@ -25,25 +25,47 @@
 #include "adapter.h"
 #include "oncd.h"
 
+/*
+ * Размер приёмного буфера: не меньше FIFO передатчика FT2232H (4 кбайта).
+ */
+#define INPUT_SIZE      4096
+
 typedef struct {
     /* Общая часть. */
     adapter_t adapter;
 
     /* Доступ к устройству через libusb. */
     usb_dev_handle *usbdev;
+    int max_packet;             /* размер пакета USB, байт */
+    int rx_fifo;                /* сколько данных можно принять за раз */
+    unsigned base_khz;          /* частота TCK при нулевом делителе, кГц */
 
     /* Буфер для посылаемого пакета MPSSE. */
-    unsigned char output [256*16];
+    unsigned char output [256*128];
     int bytes_to_write;
 
-    /* Буфер для принятых данных. */
-    unsigned char input [64];
+    /* Буфер для принятых данных, с запасом на чтение
+     * восьмибайтного слова в конце. */
+    unsigned char input [INPUT_SIZE + 8];
     int bytes_to_read;
     int bytes_per_word;
     unsigned long long fix_high_bit;
     unsigned long long high_byte_mask;
     unsigned long long high_bit_mask;
     unsigned high_byte_bits;
+
+    /* Отложенные чтения из очереди транзакций OnCD:
+     * куда поместить результат и как корректировать принятое слово. */
+    struct {
+        unsigned *result;
+        int offset;
+        int bytes_per_word;
+        unsigned long long fix_high_bit;
+        unsigned long long high_byte_mask;
+        unsigned long long high_bit_mask;
+        unsigned high_byte_bits;
+    } pending [INPUT_SIZE / 4];
+    int npending;
 } mpsse_adapter_t;
 
 /*
@@ -158,17 +180,22 @@ static void bulk_write (mpsse_adapter_t *a, unsigned char *output, int nbytes)
     if (bytes_written != nbytes)
         fprintf (stderr, "usb bulk written %d bytes of %d",
             bytes_written, nbytes);
+    a->adapter.stats.bytes_out += bytes_written;
 
 }
 
+static unsigned long long mpsse_fix_data (mpsse_adapter_t *a, unsigned long long word);
+
 /*
  * Если в выходном буфере есть накопленные данные -
  * отправка их устройству.
+ * Результаты отложенных чтений раскладываются по своим адресам.
  */
 static void mpsse_flush_output (mpsse_adapter_t *a)
 {
-    int bytes_read, n;
-    unsigned char reply [64];
+    int bytes_read, n, i, len, chunk;
+    unsigned char reply [INPUT_SIZE + 2*INPUT_SIZE/64];
+    unsigned long long word;
 
     if (a->bytes_to_write <= 0)
         return;
@@ -178,33 +205,42 @@ static void mpsse_flush_output (mpsse_adapter_t *a)
     if (a->bytes_to_read <= 0)
         return;
 
-    /* Получаем ответ. */
+    /* Получаем ответ. Каждый пакет USB начинается с двух
+     * байтов состояния модема, их отбрасываем. */
     bytes_read = 0;
     while (bytes_read < a->bytes_to_read) {
-        n = usb_bulk_read (a->usbdev, OUT_EP, (char*) reply,
-            a->bytes_to_read - bytes_read + 2, 2000);
+        n = a->bytes_to_read - bytes_read;
+        len = (n + a->max_packet - 3) / (a->max_packet - 2) * a->max_packet;
+        if (len > sizeof (reply))
+            len = sizeof (reply) / a->max_packet * a->max_packet;
+        n = usb_bulk_read (a->usbdev, OUT_EP, (char*) reply, len, 2000);
         if (n < 0) {
             fprintf (stderr, "usb bulk read failed\n");
             exit (-1);
         }
         if (debug_level > 1) {
-            if (n != a->bytes_to_read + 2)
-                fprintf (stderr, "usb bulk read %d bytes of %d\n",
-                    n, a->bytes_to_read - bytes_read + 2);
-            else {
-                int i;
-                fprintf (stderr, "usb bulk read %d bytes:", n);
-                for (i=0; i<n; i++)
-                    fprintf (stderr, "%c%02x", i ? '-' : ' ', reply[i]);
-                fprintf (stderr, "\n");
-            }
+            fprintf (stderr, "usb bulk read %d bytes of %d:", n, len);
+            for (i=0; i<n; i++)
+                fprintf (stderr, "%c%02x", i ? '-' : ' ', reply[i]);
+            fprintf (stderr, "\n");
         }
-        if (n > 2) {
+        for (i=0; i<n; i+=a->max_packet) {
+            chunk = n - i;
+            if (chunk > a->max_packet)
+                chunk = a->max_packet;
+            if (chunk <= 2)
+                continue;
+            if (bytes_read + chunk - 2 > INPUT_SIZE) {
+                fprintf (stderr, "mpsse: receive buffer overflow\n");
+                exit (-1);
+            }
             /* Copy data. */
-            memcpy (a->input + bytes_read, reply + 2, n - 2);
-            bytes_read += n - 2;
+            memcpy (a->input + bytes_read, reply + i + 2, chunk - 2);
+            bytes_read += chunk - 2;
         }
     }
+    a->adapter.stats.round_trips++;
+    a->adapter.stats.bytes_in += bytes_read;
     if (debug_level > 1) {
         int i;
         fprintf (stderr, "mpsse_flush_output received %d bytes:", a->bytes_to_read);
@@ -212,6 +248,30 @@ static void mpsse_flush_output (mpsse_adapter_t *a)
             fprintf (stderr, "%c%02x", i ? '-' : ' ', a->input[i]);
         fprintf (stderr, "\n");
     }
+    if (a->npending > 0) {
+        /* Параметры коррекции последнего слова нужны mpsse_recv(). */
+        int bytes_per_word = a->bytes_per_word;
+        unsigned long long fix_high_bit = a->fix_high_bit;
+        unsigned long long high_byte_mask = a->high_byte_mask;
+        unsigned long long high_bit_mask = a->high_bit_mask;
+        unsigned high_byte_bits = a->high_byte_bits;
+
+        for (i=0; i<a->npending; i++) {
+            a->bytes_per_word = a->pending[i].bytes_per_word;
+            a->fix_high_bit = a->pending[i].fix_high_bit;
+            a->high_byte_mask = a->pending[i].high_byte_mask;
+            a->high_bit_mask = a->pending[i].high_bit_mask;
+            a->high_byte_bits = a->pending[i].high_byte_bits;
+            memcpy (&word, a->input + a->pending[i].offset, sizeof (word));
+            *a->pending[i].result = mpsse_fix_data (a, word) >> 9;
+        }
+        a->bytes_per_word = bytes_per_word;
+        a->fix_high_bit = fix_high_bit;
+        a->high_byte_mask = high_byte_mask;
+        a->high_bit_mask = high_bit_mask;
+        a->high_byte_bits = high_byte_bits;
+        a->npending = 0;
+    }
     a->bytes_to_read = 0;
 }
 
@@ -350,12 +410,13 @@ static unsigned long long mpsse_fix_data (mpsse_adapter_t *a, unsigned long long
 static unsigned long long mpsse_recv (mpsse_adapter_t *a)
 {
     unsigned long long word;
+    int offset = a->bytes_to_read - a->bytes_per_word;
 
     /* Шлём пакет. */
     mpsse_flush_output (a);
 
-    /* Обрабатываем одно слово. */
-    memcpy (&word, a->input, sizeof (word));
+    /* Обрабатываем одно слово, последнее в пакете. */
+    memcpy (&word, a->input + offset, sizeof (word));
     return mpsse_fix_data (a, word);
 }
 
@@ -404,6 +465,30 @@ static void mpsse_speed (mpsse_adapter_t *a, int divisor)
     bulk_write (a, output, 3);
 }
 
+/*
+ * Установка частоты TCK: TCK = base_khz / (1 + divisor).
+ * Выбираем наименьший делитель, при котором частота не превышает
+ * заданную. Возвращаем установленную частоту в кГц.
+ */
+static unsigned mpsse_set_clock (adapter_t *adapter, unsigned khz)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    unsigned divisor;
+
+    if (khz == 0)
+        khz = 1;
+    divisor = (a->base_khz + khz - 1) / khz - 1;
+    if (divisor > 0xffff)
+        divisor = 0xffff;
+
+    mpsse_flush_output (a);
+    mpsse_speed (a, divisor);
+    if (debug_level)
+        fprintf (stderr, "MPSSE: divisor %u, TCK %u kHz\n",
+            divisor, a->base_khz / (divisor + 1));
+    return a->base_khz / (divisor + 1);
+}
+
 static void mpsse_close (adapter_t *adapter)
 {
     mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
@@ -444,6 +529,43 @@ static int mpsse_cpu_stopped (adapter_t *adapter)
     return ir & 4;
 }
 
+/*
+ * Постановка в очередь чтения регистра OnCD.
+ */
+static void mpsse_oncd_queue_read (adapter_t *adapter, int reg, int reglen,
+    unsigned *result)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    int n;
+
+    /* Проверяем, есть ли место в приёмном буфере. */
+    if (a->bytes_to_read + sizeof (unsigned long long) > a->rx_fifo ||
+        a->npending >= sizeof (a->pending) / sizeof (a->pending[0]))
+        mpsse_flush_output (a);
+
+    a->adapter.stats.oncd_reads++;
+    mpsse_send (a, 0, 0, 9 + reglen, reg | IRd_READ, 1);
+
+    n = a->npending++;
+    a->pending[n].result = result;
+    a->pending[n].offset = a->bytes_to_read - a->bytes_per_word;
+    a->pending[n].bytes_per_word = a->bytes_per_word;
+    a->pending[n].fix_high_bit = a->fix_high_bit;
+    a->pending[n].high_byte_mask = a->high_byte_mask;
+    a->pending[n].high_bit_mask = a->high_bit_mask;
+    a->pending[n].high_byte_bits = a->high_byte_bits;
+}
+
+/*
+ * Выполнение накопленной очереди транзакций OnCD.
+ */
+static void mpsse_oncd_flush (adapter_t *adapter)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+
+    mpsse_flush_output (a);
+}
+
 /*
  * Чтение регистра OnCD.
  */
@@ -452,8 +574,8 @@ static unsigned mpsse_oncd_read (adapter_t *adapter, int reg, int reglen)
     mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
     unsigned value;
 
-    mpsse_send (a, 0, 0, 9 + reglen, reg | IRd_READ, 1);
-    value = mpsse_recv (a) >> 9;
+    mpsse_oncd_queue_read (adapter, reg, reglen, &value);
+    mpsse_flush_output (a);
     if (debug_level > 1) {
         if (reg == OnCD_OSCR) {
             fprintf (stderr, "OnCD read %04x", value);
@@ -491,6 +613,7 @@ static void mpsse_oncd_write (adapter_t *adapter,
             fprintf (stderr, "\n");
         }
     }
+    a->adapter.stats.oncd_writes++;
     data = reg;
     if (reglen > 0)
         data |= (unsigned long long) value << 9;
@@ -528,7 +651,6 @@ static void mpsse_read_block (adapter_t *adapter,
     unsigned nwords, unsigned addr, unsigned *data)
 {
     mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
-    unsigned long long word;
 
     /* Allow memory access */
     unsigned oscr_new = adapter->oscr | OSCR_SlctMEM | OSCR_RO;
@@ -536,32 +658,18 @@ static void mpsse_read_block (adapter_t *adapter,
         adapter->oscr = oscr_new;
         mpsse_oncd_write (adapter, adapter->oscr, OnCD_OSCR, 32);
     }
-    mpsse_flush_output (a);
 
-    while (nwords > 0) {
-        unsigned i, n = nwords;
-        if (n > 10)
-            n = 10;
-        for (i=0; i<n; i++) {
-            mpsse_oncd_write (adapter, addr + i*4, OnCD_OMAR, 32);
-            mpsse_oncd_write (adapter, 0, OnCD_MEM, 0);
-            mpsse_send (a, 0, 0, 9 + 32, OnCD_OMDR | IRd_READ, 1);
-        }
-
-        /* Шлём пакет. */
-        mpsse_flush_output (a);
-
-        /* Обрабатываем слово за словом, со сдвигом 9 бит. */
-        for (i=0; i<n; i++) {
-            word = *(unsigned long long*) &a->input [i * a->bytes_per_word];
-            data[i] = mpsse_fix_data (a, word) >> 9;
-//fprintf (stderr, "addr = %08x, i = %d, bytes_per_word = %d, ", addr + i*4, i, a->bytes_per_word);
-//fprintf (stderr, "fixed = %08x\n", data[i]);
-        }
-        data += n;
-        addr += n*4;
-        nwords -= n;
+    /* Чтения ставятся в очередь. Пакет отсылается, когда
+     * ответ заполнит FIFO адаптера, слова раскладываются
+     * прямо в массив data. */
+    while (nwords-- > 0) {
+        mpsse_oncd_write (adapter, addr, OnCD_OMAR, 32);
+        mpsse_oncd_write (adapter, 0, OnCD_MEM, 0);
+        mpsse_oncd_queue_read (adapter, OnCD_OMDR, 32, data);
+        addr += 4;
+        data++;
     }
+    mpsse_flush_output (a);
 }
 
 static void mpsse_write_block (adapter_t *adapter,
@@ -614,13 +722,15 @@ static void mpsse_program_block32 (adapter_t *adapter,
     }
 
     while (nwords-- > 0) {
-        mpsse_oncd_write (adapter, base + addr_odd, OnCD_OMAR, 32);
-        mpsse_oncd_write (adapter, cmd_aa, OnCD_OMDR, 32);
-        mpsse_oncd_write (adapter, 0, OnCD_MEM, 0);
+        if (cmd_aa) {
+            mpsse_oncd_write (adapter, base + addr_odd, OnCD_OMAR, 32);
+            mpsse_oncd_write (adapter, cmd_aa, OnCD_OMDR, 32);
+            mpsse_oncd_write (adapter, 0, OnCD_MEM, 0);
 
-        mpsse_oncd_write (adapter, base + addr_even, OnCD_OMAR, 32);
-        mpsse_oncd_write (adapter, cmd_55, OnCD_OMDR, 32);
-        mpsse_oncd_write (adapter, 0, OnCD_MEM, 0);
+            mpsse_oncd_write (adapter, base + addr_even, OnCD_OMAR, 32);
+            mpsse_oncd_write (adapter, cmd_55, OnCD_OMDR, 32);
+            mpsse_oncd_write (adapter, 0, OnCD_MEM, 0);
+        }
 
         mpsse_oncd_write (adapter, base + addr_odd, OnCD_OMAR, 32);
         mpsse_oncd_write (adapter, cmd_a0, OnCD_OMDR, 32);
@@ -635,6 +745,85 @@ static void mpsse_program_block32 (adapter_t *adapter,
     }
 }
 
+/*
+ * Запись слова в память через OnCD.
+ */
+static void mpsse_mem_write (adapter_t *adapter, unsigned addr, unsigned data)
+{
+    mpsse_oncd_write (adapter, addr, OnCD_OMAR, 32);
+    mpsse_oncd_write (adapter, data, OnCD_OMDR, 32);
+    mpsse_oncd_write (adapter, 0, OnCD_MEM, 0);
+}
+
+/*
+ * Отсылка накопленного пакета и проверка, что
+ * последнее обращение к памяти завершилось.
+ */
+static void mpsse_check_ready (adapter_t *adapter, const char *what)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    unsigned oscr;
+
+    mpsse_oncd_queue_read (adapter, OnCD_OSCR, 32, &oscr);
+    mpsse_flush_output (a);
+    a->adapter.stats.rdym_polls++;
+    if (! (oscr & OSCR_RDYm)) {
+        fprintf (stderr, "Timeout %s, aborted. OSCR=%#x\n", what, oscr);
+        exit (1);
+    }
+}
+
+static void mpsse_program_block64 (adapter_t *adapter,
+    unsigned nwords, unsigned base, unsigned addr, unsigned *data,
+    unsigned addr_odd, unsigned addr_even,
+    unsigned cmd_aa, unsigned cmd_55, unsigned cmd_a0)
+{
+    /* Allow memory access */
+    unsigned oscr_new = (adapter->oscr & ~OSCR_RO) | OSCR_SlctMEM;
+    if (oscr_new != adapter->oscr) {
+        adapter->oscr = oscr_new;
+        mpsse_oncd_write (adapter, adapter->oscr, OnCD_OSCR, 32);
+    }
+
+    while (nwords-- > 0) {
+        /* Команды подаются в ту половину 64-разрядной шины,
+         * к которой относится адрес. */
+        if (cmd_aa) {
+            mpsse_mem_write (adapter, base + addr_odd + (addr & 4), cmd_aa);
+            mpsse_mem_write (adapter, base + addr_even + (addr & 4), cmd_55);
+        }
+        mpsse_mem_write (adapter, base + addr_odd + (addr & 4), cmd_a0);
+        mpsse_mem_write (adapter, addr, *data);
+        addr += 4;
+        data++;
+    }
+    mpsse_check_ready (adapter, "programming block64");
+}
+
+static void mpsse_program_block32_micron (adapter_t *adapter,
+    unsigned n_minus_1, unsigned addr, unsigned *data)
+{
+    unsigned block_addr = addr & 0xFFC00000;
+    unsigned i;
+
+    /* Allow memory access */
+    unsigned oscr_new = (adapter->oscr & ~OSCR_RO) | OSCR_SlctMEM;
+    if (oscr_new != adapter->oscr) {
+        adapter->oscr = oscr_new;
+        mpsse_oncd_write (adapter, adapter->oscr, OnCD_OSCR, 32);
+    }
+
+    /* Количество слов, данные и подтверждение записи буфера. */
+    mpsse_mem_write (adapter, block_addr, (n_minus_1 << 16) | n_minus_1);
+    for (i=0; i<=n_minus_1; i++) {
+        mpsse_mem_write (adapter, addr, *data);
+        addr += 4;
+        data++;
+    }
+    mpsse_mem_write (adapter, block_addr, 0x00d000d0);
+    mpsse_check_ready (adapter, "programming block32");
+}
+
 /*
  * Аппаратный сброс процессора.
  */
@@ -653,30 +842,21 @@ static void mpsse_reset_cpu (adapter_t *adapter)
  * Возвращаем указатель на структуру данных, выделяемую динамически.
  * Если адаптер не обнаружен, возвращаем 0.
  */
-adapter_t *adapter_open_mpsse (void)
+adapter_t *adapter_open_mpsse (const char *id)
 {
     mpsse_adapter_t *a;
-    struct usb_bus *bus;
     struct usb_device *dev;
     int jtag_adapter_version;
 
-    usb_init();
-    usb_find_busses();
-    usb_find_devices();
-    for (bus = usb_get_busses(); bus; bus = bus->next) {
-        for (dev = bus->devices; dev; dev = dev->next) {
-            if (dev->descriptor.idVendor == OLIMEX_VID &&
-                (dev->descriptor.idProduct == OLIMEX_ARM_USB_TINY ||
-                 dev->descriptor.idProduct == OLIMEX_ARM_USB_TINY_H)) {
-                jtag_adapter_version = dev->descriptor.idProduct;
-                goto found;
-            }
-        }
+    dev = adapter_usb_find (OLIMEX_VID, OLIMEX_ARM_USB_TINY, id);
+    if (! dev)
+        dev = adapter_usb_find (OLIMEX_VID, OLIMEX_ARM_USB_TINY_H, id);
+    if (! dev) {
+        /*fprintf (stderr, "USB adapter not found: vid=%04x, pid=%04x\n",
+            OLIMEX_VID, OLIMEX_PID);*/
+        return 0;
     }
-    /*fprintf (stderr, "USB adapter not found: vid=%04x, pid=%04x\n",
-        OLIMEX_VID, OLIMEX_PID);*/
-    return 0;
-found:
+    jtag_adapter_version = dev->descriptor.idProduct;
     /*fprintf (stderr, "found USB adapter: vid %04x, pid %04x, type %03x\n",
         dev->descriptor.idVendor, dev->descriptor.idProduct,
         dev->descriptor.bcdDevice);*/
@@ -691,7 +871,12 @@ found:
         free (a);
         return 0;
     }
-    usb_claim_interface (a->usbdev, 0);
+    if (usb_claim_interface (a->usbdev, 0) != 0) {
+        fprintf (stderr, "MPSSE adapter: usb_claim_interface() failed\n");
+        usb_close (a->usbdev);
+        free (a);
+        return 0;
+    }
 
     /* Reset the ftdi device. */
     if (usb_control_msg (a->usbdev,
@@ -719,6 +904,12 @@ failed: usb_release_interface (a->usbdev, 0);
     unsigned divisor = 3;
     unsigned char latency_timer = 1;
 
+    /* FT2232D: пакеты USB по 64 байта, FIFO передатчика 128 байт.
+     * FT2232H: пакеты по 512 байт, FIFO 4 кбайта. */
+    a->max_packet = 64;
+    a->rx_fifo = 120;
+    a->base_khz = 6000;
+
     if (jtag_adapter_version == OLIMEX_ARM_USB_TINY) {
 #ifdef _WIN32
         divisor = 2;
@@ -728,8 +919,13 @@ failed: usb_release_interface (a->usbdev, 0);
         latency_timer = 4;
 #endif
     } else if (jtag_adapter_version == OLIMEX_ARM_USB_TINY_H) {
-        divisor = 1;
+        /* Делитель частоты на 5 отключаем ниже: базовая частота
+         * 30 МГц, по умолчанию TCK остаётся прежним, 3 МГц. */
+        divisor = 9;
         latency_timer = 0;
+        a->max_packet = 512;
+        a->rx_fifo = INPUT_SIZE - 128;
+        a->base_khz = 30000;
     }
 
 
@@ -750,8 +946,13 @@ failed: usb_release_interface (a->usbdev, 0);
 
     mpsse_reset (a, 0, 0, 1);
 
+    if (a->base_khz == 30000) {
+        /* FT2232H: disable clock divide by 5. */
+        unsigned char disable_div5[] = "\x8a";
+        bulk_write (a, disable_div5, 1);
+    }
     if (debug_level) {
-        int baud = 6000000 / (divisor + 1);
+        int baud = a->base_khz * 1000 / (divisor + 1);
         fprintf (stderr, "MPSSE: speed %d samples/sec\n", baud);
     }
     mpsse_speed (a, divisor);
@@ -780,6 +981,12 @@ failed: usb_release_interface (a->usbdev, 0);
     a->adapter.write_block = mpsse_write_block;
     a->adapter.write_nwords = mpsse_write_nwords;
     a->adapter.program_block32 = mpsse_program_block32;
+    a->adapter.program_block64 = mpsse_program_block64;
+    a->adapter.program_block32_micron = mpsse_program_block32_micron;
+    a->adapter.oncd_queue_write = mpsse_oncd_write;
+    a->adapter.oncd_queue_read = mpsse_oncd_queue_read;
+    a->adapter.oncd_flush = mpsse_oncd_flush;
+    a->adapter.set_clock = mpsse_set_clock;
     return &a->adapter;
 }
 
@@ -858,7 +1065,7 @@ usage:  printf ("Test for FT232R JTAG adapter.\n");
     default:
         goto usage;
     case 1:
-        adapter = adapter_open_mpsse ();
+        adapter = adapter_open_mpsse (0);
         if (! adapter) {
             fprintf (stderr, "No mpsse adapter found.\n");
             exit (1);
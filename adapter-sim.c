@@ -0,0 +1,1010 @@
+/*
+ * Программная модель адаптера JTAG и процессора Мультикор:
+ * регистры OnCD, внутренняя и внешняя память, flash-память
+ * с набором команд AMD, SST или Micron.
+ * Позволяет проверять и сравнивать алгоритмы программирования
+ * без аппаратуры.
+ *
+ * Этот файл распространяется в надежде, что он окажется полезным, но
+ * БЕЗ КАКИХ БЫ ТО НИ БЫЛО ГАРАНТИЙНЫХ ОБЯЗАТЕЛЬСТВ; в том числе без косвенных
+ * гарантийных обязательств, связанных с ПОТРЕБИТЕЛЬСКИМИ СВОЙСТВАМИ и
+ * ПРИГОДНОСТЬЮ ДЛЯ ОПРЕДЕЛЕННЫХ ЦЕЛЕЙ.
+ *
+ * Вы вправе распространять и/или изменять этот файл в соответствии
+ * с условиями Генеральной Общественной Лицензии GNU (GPL) в том виде,
+ * как она была опубликована Фондом Свободного ПО; либо версии 2 Лицензии
+ * либо (по вашему желанию) любой более поздней версии. Подробности
+ * смотрите в прилагаемом файле 'COPYING.txt'.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "adapter.h"
+#include "oncd.h"
+
+#define SIM_IDCODE      0x40777001      /* MC12r2 */
+
+/* Карта памяти, физические адреса. */
+#define CRAM_BASE       0x18000000      /* внутренняя память */
+#define CRAM_SIZE       (64*1024)
+#define REGS_BASE       0x182F0000      /* системные регистры */
+#define REGS_SIZE       (64*1024)
+#define SRAM_BASE       0x00000000      /* внешняя статическая память */
+#define SRAM_SIZE       (8*1024*1024)
+#define FLASH_BASE      0x1FC00000      /* по умолчанию */
+
+/* Быстродействие модели процессора: команд за микросекунду. */
+#define CPU_SPEED       100
+#define CPU_MAX_STEPS   1000000
+
+/* Тип flash-памяти: две микросхемы x16 на 32-разрядной шине. */
+enum {
+    FLASH_AMD,                          /* AM29LV800B */
+    FLASH_SST,                          /* SST39VF6401B */
+    FLASH_MICRON,                       /* MT28F640 */
+    FLASH_S29GL,                        /* S29GL256P, запись через буфер */
+};
+
+/* Состояние автомата команд flash. */
+enum {
+    FS_READ,                            /* чтение массива */
+    FS_UNLOCK1,                         /* принят AA */
+    FS_UNLOCK2,                         /* принят 55 */
+    FS_PROGRAM,                         /* ожидается слово для записи */
+    FS_ERASE,                           /* принят 80 */
+    FS_ERASE_UNLOCK1,                   /* принят 80-AA */
+    FS_ERASE_UNLOCK2,                   /* принят 80-AA-55 */
+    FS_READ_ID,                         /* чтение идентификатора */
+    FS_BYPASS,                          /* режим unlock bypass */
+    FS_BYPASS_PROGRAM,                  /* принят A0 в режиме bypass */
+    FS_BYPASS_RESET,                    /* принят 90 в режиме bypass */
+    FS_STATUS,                          /* Micron: чтение статуса */
+    FS_ERASE_CONFIRM,                   /* Micron: ожидается D0 */
+    FS_WORD_PROGRAM,                    /* Micron: ожидается слово */
+    FS_BUFFER_COUNT,                    /* Micron: ожидается длина буфера */
+    FS_BUFFER_DATA,                     /* Micron: приём буфера */
+    FS_BUFFER_CONFIRM,                  /* Micron: ожидается D0 */
+    FS_CFI,                             /* чтение таблицы CFI */
+    FS_WB_COUNT,                        /* принят 25, ожидается длина */
+    FS_WB_DATA,                         /* приём буфера */
+    FS_WB_CONFIRM,                      /* ожидается 29 */
+};
+
+/*
+ * Банка flash-памяти на отдельном chip select.
+ */
+typedef struct {
+    unsigned base;
+    unsigned *mem;
+    int fstate;
+    unsigned buf_addr, buf_count;
+    unsigned long long busy_until;      /* окончание записи или стирания, мксек */
+    int busy_erase;
+    unsigned toggle;
+} sim_flash_t;
+
+#define MAX_BANKS       3
+
+typedef struct {
+    /* Общая часть. */
+    adapter_t adapter;
+
+    /* Регистры OnCD. */
+    unsigned oscr;
+    unsigned omar, omdr;
+    unsigned obcr, omlr0, omlr1, ombc, otc;
+    unsigned irdec, pcdec, pcexec, pcfetch;
+    int stopped;
+
+    /* Регистры процессора, доступные через REGF. */
+    unsigned regf [5][32];
+
+    /* Выполнение программы из CRAM: адрес текущей
+     * и следующей команды, время последнего запуска. */
+    unsigned pc, npc;
+    unsigned long long cpu_time;
+    int cpu_access;                     /* обращение к памяти от процессора */
+
+    /* Память. */
+    unsigned *cram;
+    unsigned *regs;
+    unsigned *sram;
+
+    /* Flash-память: одна или несколько одинаковых банок,
+     * каждая со своим автоматом команд. */
+    int flash_type;
+    unsigned flash_base;                /* адрес первой банки */
+    unsigned flash_bytes;               /* объём одной банки */
+    unsigned sector_bytes;
+    int nbanks;
+    sim_flash_t bank [MAX_BANKS];
+
+    /* Временные параметры, мксек. */
+    unsigned latency;                   /* на один обмен с адаптером */
+    unsigned program_us;                /* запись слова */
+    unsigned sector_us;                 /* стирание сектора */
+    unsigned chip_us;                   /* стирание микросхемы */
+
+    /* Без блочных операций: как у простых адаптеров. */
+    int no_block;
+
+} sim_adapter_t;
+
+static unsigned long long sim_now (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, 0);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static void sim_sleep_until (unsigned long long t)
+{
+    unsigned long long now = sim_now ();
+
+    if (t > now)
+        usleep (t - now);
+}
+
+/*
+ * Один обмен с адаптером: задержка на время передачи по USB.
+ */
+static void sim_cpu_run (sim_adapter_t *a);
+
+static void sim_transaction (sim_adapter_t *a)
+{
+    sim_cpu_run (a);
+    a->adapter.stats.round_trips++;
+    if (a->latency)
+        usleep (a->latency);
+}
+
+/*
+ * Блочная операция учитывается как пакет адаптера USB-JTAG:
+ * по 6 байт на команду, с чтением OSCR в конце.
+ */
+static void sim_block (sim_adapter_t *a, unsigned nwrites, unsigned nreads)
+{
+    a->adapter.stats.bytes_out += 6 * (nwrites + nreads + 1);
+    a->adapter.stats.bytes_in += 4 * (nreads + 1);
+    a->adapter.stats.oncd_writes += nwrites;
+    a->adapter.stats.oncd_reads += nreads + 1;
+    a->adapter.stats.rdym_polls++;
+    sim_transaction (a);
+}
+
+/*
+ * Значения, выдаваемые в режиме чтения идентификатора.
+ */
+static unsigned flash_read_id (sim_adapter_t *a, unsigned offset)
+{
+    switch (a->flash_type) {
+    default:
+    case FLASH_AMD:
+        return (offset & 4) ? 0x225b225b : 0x00010001;
+    case FLASH_SST:
+        return (offset & 4) ? 0x236d236d : 0x00BF00BF;
+    case FLASH_MICRON:
+        return (offset & 4) ? 0x00170017 : 0x002C002C;
+    case FLASH_S29GL:
+        return (offset & 4) ? 0x227E227E : 0x00010001;
+    }
+}
+
+/*
+ * Двоичный логарифм с округлением вверх, для таблицы CFI.
+ */
+static unsigned sim_log2 (unsigned x)
+{
+    unsigned n = 0;
+
+    while ((1u << n) < x)
+        n++;
+    return n;
+}
+
+/*
+ * Таблица CFI одной микросхемы x16: геометрия по параметрам
+ * модели, одна область одинаковых секторов.
+ * Типичные времена - из параметров модели, максимальные вдвое больше.
+ */
+static unsigned flash_read_cfi (sim_adapter_t *a, unsigned offset)
+{
+    unsigned nsectors = a->flash_bytes / a->sector_bytes;
+    unsigned sector = a->sector_bytes / 2;
+    int buffer = (a->flash_type == FLASH_MICRON ||
+                  a->flash_type == FLASH_S29GL);
+    unsigned cmdset, v;
+
+    switch (a->flash_type) {
+    default:
+    case FLASH_AMD:
+    case FLASH_S29GL:  cmdset = 0x0002; break;
+    case FLASH_SST:    cmdset = 0x0701; break;
+    case FLASH_MICRON: cmdset = 0x0001; break;
+    }
+    switch ((offset >> 2) & 0xff) {
+    case 0x10: v = 'Q'; break;
+    case 0x11: v = 'R'; break;
+    case 0x12: v = 'Y'; break;
+    case 0x13: v = cmdset & 0xff; break;
+    case 0x14: v = cmdset >> 8; break;
+    case 0x1B: v = 0x27; break;                 /* Vcc 2.7-3.6 В */
+    case 0x1C: v = 0x36; break;
+    case 0x1F: v = sim_log2 (a->program_us); break;
+    case 0x20: v = buffer ? sim_log2 (a->program_us) : 0; break;
+    case 0x21: v = sim_log2 (a->sector_us / 1000); break;
+    case 0x22: v = (a->flash_type == FLASH_MICRON) ? 0 :
+                   sim_log2 (a->chip_us / 1000); break;
+    case 0x23:
+    case 0x25:
+    case 0x26: v = 1; break;
+    case 0x24: v = buffer ? 1 : 0; break;
+    case 0x27: v = sim_log2 (a->flash_bytes / 2); break;
+    case 0x28: v = 0x01; break;                 /* x16 */
+    case 0x2A: v = buffer ? 5 : 0; break;
+    case 0x2C: v = 1; break;
+    case 0x2D: v = (nsectors - 1) & 0xff; break;
+    case 0x2E: v = (nsectors - 1) >> 8; break;
+    case 0x2F: v = (sector >> 8) & 0xff; break;
+    case 0x30: v = sector >> 16; break;
+    default:   v = 0; break;
+    }
+    return v | v << 16;
+}
+
+static int flash_busy (sim_adapter_t *a, sim_flash_t *f)
+{
+    if (! f->busy_until)
+        return 0;
+    if (sim_now () < f->busy_until)
+        return 1;
+    f->busy_until = 0;
+    f->busy_erase = 0;
+    return 0;
+}
+
+/*
+ * Запись занимает единицы микросекунд: контроллер памяти
+ * не примет следующее обращение, пока запись не закончится.
+ */
+static void flash_wait_program (sim_adapter_t *a, sim_flash_t *f)
+{
+    if (a->cpu_access)
+        return;
+    if (f->busy_until && ! f->busy_erase) {
+        sim_sleep_until (f->busy_until);
+        f->busy_until = 0;
+    }
+}
+
+static void flash_start (sim_adapter_t *a, sim_flash_t *f, unsigned usec, int erase)
+{
+    f->busy_until = sim_now () + usec;
+    f->busy_erase = erase;
+}
+
+static void flash_erase (sim_adapter_t *a, sim_flash_t *f, unsigned offset, unsigned nbytes)
+{
+    memset ((char*) f->mem + offset, 0xff, nbytes);
+}
+
+static unsigned flash_read (sim_adapter_t *a, sim_flash_t *f, unsigned offset)
+{
+    flash_wait_program (a, f);
+    if (a->flash_type == FLASH_MICRON) {
+        switch (f->fstate) {
+        case FS_READ_ID:
+            return flash_read_id (a, offset);
+        case FS_CFI:
+            return flash_read_cfi (a, offset);
+        case FS_STATUS:
+        case FS_ERASE_CONFIRM:
+        case FS_BUFFER_COUNT:
+        case FS_BUFFER_DATA:
+        case FS_BUFFER_CONFIRM:
+        case FS_WORD_PROGRAM:
+            /* Бит 7 каждой микросхемы: готовность. */
+            return flash_busy (a, f) ? 0 : 0x00800080;
+        }
+        return f->mem [offset/4];
+    }
+    if (flash_busy (a, f)) {
+        if (! f->busy_erase) {
+            /* Процессор читает во время записи: DQ7 инверсный. */
+            return f->mem [offset/4] ^ 0x00800080;
+        }
+        /* Идёт стирание: DQ7=0, DQ6 меняется при каждом чтении. */
+        f->toggle ^= 0x00400040;
+        return f->toggle;
+    }
+    if (f->fstate == FS_READ_ID)
+        return flash_read_id (a, offset);
+    if (f->fstate == FS_CFI)
+        return flash_read_cfi (a, offset);
+    return f->mem [offset/4];
+}
+
+/*
+ * Автомат команд AMD/SST.
+ */
+static void flash_write_amd (sim_adapter_t *a, sim_flash_t *f, unsigned offset, unsigned data)
+{
+    unsigned cmd = data & 0xff;
+    unsigned caddr = (offset >> 2) & 0x7ff;
+
+    if (flash_busy (a, f))
+        return;
+    if (cmd == 0xf0 && f->fstate != FS_PROGRAM &&
+        f->fstate != FS_BYPASS_PROGRAM && f->fstate != FS_BYPASS &&
+        f->fstate != FS_WB_COUNT && f->fstate != FS_WB_DATA) {
+        f->fstate = FS_READ;
+        return;
+    }
+    switch (f->fstate) {
+    case FS_READ:
+    case FS_READ_ID:
+        if (cmd == 0xaa && caddr == 0x555)
+            f->fstate = FS_UNLOCK1;
+        else if (cmd == 0x98 && caddr == 0x55)
+            f->fstate = FS_CFI;
+        break;
+    case FS_CFI:
+        if (cmd == 0xff)
+            f->fstate = FS_READ;
+        break;
+    case FS_UNLOCK1:
+        f->fstate = (cmd == 0x55 && caddr == 0x2aa) ? FS_UNLOCK2 : FS_READ;
+        break;
+    case FS_UNLOCK2:
+        f->fstate = FS_READ;
+        if (cmd == 0x25 && a->flash_type == FLASH_S29GL) {
+            /* Запись в буфер: команда по адресу сектора. */
+            f->fstate = FS_WB_COUNT;
+            break;
+        }
+        if (caddr != 0x555)
+            break;
+        switch (cmd) {
+        case 0x90: f->fstate = FS_READ_ID; break;
+        case 0xa0: f->fstate = FS_PROGRAM; break;
+        case 0x80: f->fstate = FS_ERASE;   break;
+        case 0x20: f->fstate = FS_BYPASS;  break;
+        }
+        break;
+    case FS_WB_COUNT:
+        f->buf_count = (data & 0xffff) + 1;
+        f->fstate = FS_WB_DATA;
+        break;
+    case FS_WB_DATA:
+        f->mem [offset/4] &= data;
+        if (--f->buf_count == 0)
+            f->fstate = FS_WB_CONFIRM;
+        break;
+    case FS_WB_CONFIRM:
+        f->fstate = FS_READ;
+        if (cmd == 0x29)
+            flash_start (a, f, a->program_us, 0);
+        break;
+    case FS_PROGRAM:
+        /* Запись может только сбрасывать биты. */
+        f->mem [offset/4] &= data;
+        flash_start (a, f, a->program_us, 0);
+        f->fstate = FS_READ;
+        break;
+    case FS_BYPASS:
+        if (cmd == 0xa0)
+            f->fstate = FS_BYPASS_PROGRAM;
+        else if (cmd == 0x90)
+            f->fstate = FS_BYPASS_RESET;
+        break;
+    case FS_BYPASS_RESET:
+        f->fstate = (cmd == 0x00) ? FS_READ : FS_BYPASS;
+        break;
+    case FS_BYPASS_PROGRAM:
+        f->mem [offset/4] &= data;
+        flash_start (a, f, a->program_us, 0);
+        f->fstate = FS_BYPASS;
+        break;
+    case FS_ERASE:
+        f->fstate = (cmd == 0xaa && caddr == 0x555) ? FS_ERASE_UNLOCK1 : FS_READ;
+        break;
+    case FS_ERASE_UNLOCK1:
+        f->fstate = (cmd == 0x55 && caddr == 0x2aa) ? FS_ERASE_UNLOCK2 : FS_READ;
+        break;
+    case FS_ERASE_UNLOCK2:
+        f->fstate = FS_READ;
+        if (cmd == 0x10 && caddr == 0x555) {
+            flash_erase (a, f, 0, a->flash_bytes);
+            flash_start (a, f, a->chip_us, 1);
+        } else if (cmd == 0x30) {
+            offset &= ~(a->sector_bytes - 1);
+            flash_erase (a, f, offset, a->sector_bytes);
+            flash_start (a, f, a->sector_us, 1);
+        }
+        break;
+    }
+}
+
+/*
+ * Автомат команд Micron (Intel).
+ */
+static void flash_write_micron (sim_adapter_t *a, sim_flash_t *f, unsigned offset, unsigned data)
+{
+    unsigned cmd = data & 0xff;
+
+    switch (f->fstate) {
+    case FS_WORD_PROGRAM:
+        f->mem [offset/4] &= data;
+        flash_start (a, f, a->program_us, 0);
+        f->fstate = FS_STATUS;
+        return;
+    case FS_BUFFER_COUNT:
+        f->buf_count = (data & 0xffff) + 1;
+        f->buf_addr = offset;
+        f->fstate = FS_BUFFER_DATA;
+        return;
+    case FS_BUFFER_DATA:
+        f->mem [offset/4] &= data;
+        if (--f->buf_count == 0)
+            f->fstate = FS_BUFFER_CONFIRM;
+        return;
+    case FS_BUFFER_CONFIRM:
+        f->fstate = FS_STATUS;
+        if (cmd == 0xd0)
+            flash_start (a, f, a->program_us, 0);
+        return;
+    case FS_ERASE_CONFIRM:
+        f->fstate = FS_STATUS;
+        if (cmd == 0xd0) {
+            offset &= ~(a->sector_bytes - 1);
+            flash_erase (a, f, offset, a->sector_bytes);
+            flash_start (a, f, a->sector_us, 1);
+        }
+        return;
+    }
+    if (flash_busy (a, f) && cmd != 0x70)
+        return;
+    switch (cmd) {
+    case 0xff: f->fstate = FS_READ;          break;
+    case 0x90: f->fstate = FS_READ_ID;       break;
+    case 0x98: f->fstate = FS_CFI;           break;
+    case 0x70:
+    case 0x50: f->fstate = FS_STATUS;        break;
+    case 0x20: f->fstate = FS_ERASE_CONFIRM; break;
+    case 0x10:
+    case 0x40: f->fstate = FS_WORD_PROGRAM;  break;
+    case 0xe8: f->fstate = FS_BUFFER_COUNT;  break;
+    }
+}
+
+/*
+ * Обращение к памяти по физическому адресу.
+ */
+static sim_flash_t *sim_flash_bank (sim_adapter_t *a, unsigned addr)
+{
+    int i;
+
+    for (i=0; i<a->nbanks; i++) {
+        if (addr >= a->bank[i].base &&
+            addr < a->bank[i].base + a->flash_bytes)
+            return &a->bank[i];
+    }
+    return 0;
+}
+
+static unsigned sim_mem_read (sim_adapter_t *a, unsigned addr)
+{
+    sim_flash_t *f;
+
+    addr &= ~3;
+    if (addr >= CRAM_BASE && addr < CRAM_BASE + CRAM_SIZE)
+        return a->cram [(addr - CRAM_BASE) / 4];
+    if (addr >= REGS_BASE && addr < REGS_BASE + REGS_SIZE)
+        return a->regs [(addr - REGS_BASE) / 4];
+    f = sim_flash_bank (a, addr);
+    if (f)
+        return flash_read (a, f, addr - f->base);
+    if (addr < SRAM_BASE + SRAM_SIZE)
+        return a->sram [(addr - SRAM_BASE) / 4];
+    return 0xffffffff;
+}
+
+static void sim_mem_write (sim_adapter_t *a, unsigned addr, unsigned data)
+{
+    sim_flash_t *f;
+
+    addr &= ~3;
+    f = sim_flash_bank (a, addr);
+    if (addr >= CRAM_BASE && addr < CRAM_BASE + CRAM_SIZE)
+        a->cram [(addr - CRAM_BASE) / 4] = data;
+    else if (addr >= REGS_BASE && addr < REGS_BASE + REGS_SIZE)
+        a->regs [(addr - REGS_BASE) / 4] = data;
+    else if (f) {
+        flash_wait_program (a, f);
+        if (a->flash_type == FLASH_MICRON)
+            flash_write_micron (a, f, addr - f->base, data);
+        else
+            flash_write_amd (a, f, addr - f->base, data);
+    } else if (addr < SRAM_BASE + SRAM_SIZE)
+        a->sram [(addr - SRAM_BASE) / 4] = data;
+}
+
+/*
+ * Выполнение одной команды процессора.
+ * Моделируется только подмножество MIPS32, достаточное для
+ * небольших программ в CRAM. Вне CRAM программа не выполняется.
+ */
+static int sim_cpu_step (sim_adapter_t *a)
+{
+    unsigned *r = a->regf [GROUP_RFCPU];
+    unsigned pc = a->pc & 0x1fffffff, instr, next, addr;
+    unsigned rs, rt, rd, uimm;
+    int simm;
+
+    if (pc < CRAM_BASE || pc >= CRAM_BASE + CRAM_SIZE)
+        return 0;
+    instr = a->cram [(pc - CRAM_BASE) / 4];
+    rs = (instr >> 21) & 31;
+    rt = (instr >> 16) & 31;
+    rd = (instr >> 11) & 31;
+    uimm = instr & 0xffff;
+    simm = (short) uimm;
+    next = a->npc + 4;
+    addr = (r[rs] + simm) & 0x1fffffff;
+
+    switch (instr >> 26) {
+    case 0:
+        switch (instr & 0x3f) {
+        case 0x00:      r[rd] = r[rt] << ((instr >> 6) & 31);   break; /* sll */
+        case 0x02:      r[rd] = r[rt] >> ((instr >> 6) & 31);   break; /* srl */
+        case 0x08:      next = r[rs];                           break; /* jr */
+        case 0x21:      r[rd] = r[rs] + r[rt];                  break; /* addu */
+        case 0x23:      r[rd] = r[rs] - r[rt];                  break; /* subu */
+        case 0x24:      r[rd] = r[rs] & r[rt];                  break; /* and */
+        case 0x25:      r[rd] = r[rs] | r[rt];                  break; /* or */
+        case 0x26:      r[rd] = r[rs] ^ r[rt];                  break; /* xor */
+        case 0x27:      r[rd] = ~(r[rs] | r[rt]);               break; /* nor */
+        case 0x2b:      r[rd] = r[rs] < r[rt];                  break; /* sltu */
+        default:        goto unknown;
+        }
+        break;
+    case 0x04:                                                  /* beq */
+        if (r[rs] == r[rt])
+            next = a->npc + (simm << 2);
+        break;
+    case 0x05:                                                  /* bne */
+        if (r[rs] != r[rt])
+            next = a->npc + (simm << 2);
+        break;
+    case 0x09:      r[rt] = r[rs] + simm;                       break; /* addiu */
+    case 0x0b:      r[rt] = r[rs] < (unsigned) simm;            break; /* sltiu */
+    case 0x0c:      r[rt] = r[rs] & uimm;                       break; /* andi */
+    case 0x0d:      r[rt] = r[rs] | uimm;                       break; /* ori */
+    case 0x0e:      r[rt] = r[rs] ^ uimm;                       break; /* xori */
+    case 0x0f:      r[rt] = uimm << 16;                         break; /* lui */
+    case 0x23:                                                  /* lw */
+        a->cpu_access = 1;
+        r[rt] = sim_mem_read (a, addr);
+        a->cpu_access = 0;
+        break;
+    case 0x2b:                                                  /* sw */
+        a->cpu_access = 1;
+        sim_mem_write (a, addr, r[rt]);
+        a->cpu_access = 0;
+        break;
+    default:
+unknown:
+        fprintf (stderr, "Simulator: unknown instruction %08x at %08x\n",
+            instr, a->pc);
+        a->pc = 0;
+        return 0;
+    }
+    r[0] = 0;
+    a->pc = a->npc;
+    a->npc = next;
+    return 1;
+}
+
+/*
+ * Процессор выполняет столько команд, сколько успел бы
+ * с момента предыдущего вызова.
+ */
+static void sim_cpu_run (sim_adapter_t *a)
+{
+    unsigned long long now, steps;
+
+    if (a->stopped)
+        return;
+    now = sim_now ();
+    steps = (now - a->cpu_time) * CPU_SPEED;
+    if (steps > CPU_MAX_STEPS)
+        steps = CPU_MAX_STEPS;
+    a->cpu_time = now;
+    while (steps-- > 0 && sim_cpu_step (a))
+        continue;
+}
+
+/*
+ * Регистры OnCD.
+ */
+static void sim_write_reg (sim_adapter_t *a, unsigned val, int reg)
+{
+    unsigned group, n;
+
+    a->adapter.stats.oncd_writes++;
+    a->adapter.stats.bytes_out += 6;
+
+    if (reg & OnCD_GO) {
+        if ((reg & 0x1f) == OnCD_GO) {
+            if (reg & IRd_RESUME) {
+                a->stopped = 0;
+                a->pc = a->pcdec;
+                a->npc = a->pc + 4;
+                a->cpu_time = sim_now ();
+            } else {
+                /* Один шаг конвейера. */
+                a->pcexec = a->pcdec;
+                a->pcdec = a->pcfetch;
+                a->pcfetch += 4;
+            }
+            return;
+        }
+    }
+    switch (reg & 0x1f) {
+    case OnCD_OSCR:
+        a->oscr = val & ~(OSCR_RDYm | OSCR_SO);
+        break;
+    case OnCD_OMBC:   a->ombc = val;    break;
+    case OnCD_OMLR0:  a->omlr0 = val;   break;
+    case OnCD_OMLR1:  a->omlr1 = val;   break;
+    case OnCD_OBCR:   a->obcr = val;    break;
+    case OnCD_IRdec:  a->irdec = val;   break;
+    case OnCD_OTC:    a->otc = val;     break;
+    case OnCD_PCfetch: a->pcfetch = val; break;
+    case OnCD_OMAR:   a->omar = val;    break;
+    case OnCD_OMDR:   a->omdr = val;    break;
+    case OnCD_MEM:
+        if (! (a->oscr & OSCR_SlctMEM))
+            break;
+        if (a->oscr & OSCR_RO)
+            a->omdr = sim_mem_read (a, a->omar);
+        else
+            sim_mem_write (a, a->omar, a->omdr);
+        break;
+    case OnCD_REGF:
+        group = a->irdec & 7;
+        n = (a->irdec >> 3) & 31;
+        if (group < 5)
+            a->regf [group][n] = val;
+        break;
+    }
+}
+
+static unsigned sim_read_reg (sim_adapter_t *a, int reg)
+{
+    unsigned group, n;
+
+    a->adapter.stats.oncd_reads++;
+    a->adapter.stats.bytes_out += 2;
+    a->adapter.stats.bytes_in += 4;
+
+    switch (reg & 0x1f) {
+    case OnCD_OSCR:
+        return a->oscr | OSCR_RDYm | (a->stopped ? OSCR_SO : 0);
+    case OnCD_OMBC:    return a->ombc;
+    case OnCD_OMLR0:   return a->omlr0;
+    case OnCD_OMLR1:   return a->omlr1;
+    case OnCD_OBCR:    return a->obcr;
+    case OnCD_IRdec:   return a->irdec;
+    case OnCD_OTC:     return a->otc;
+    case OnCD_PCdec:   return a->pcdec;
+    case OnCD_PCexec:  return a->pcexec;
+    case OnCD_PCfetch: return a->pcfetch;
+    case OnCD_OMAR:    return a->omar;
+    case OnCD_OMDR:    return a->omdr;
+    case OnCD_REGF:
+        group = a->irdec & 7;
+        n = (group < 2) ? (a->irdec >> 16) & 31 : (a->irdec >> 3) & 31;
+        return (group < 5) ? a->regf [group][n] : 0;
+    }
+    return 0;
+}
+
+static void sim_oncd_queue_write (adapter_t *adapter, unsigned val, int reg, int nbits)
+{
+    sim_write_reg ((sim_adapter_t*) adapter, val, reg);
+}
+
+static void sim_oncd_queue_read (adapter_t *adapter, int reg, int nbits,
+    unsigned *result)
+{
+    *result = sim_read_reg ((sim_adapter_t*) adapter, reg);
+}
+
+static void sim_oncd_flush (adapter_t *adapter)
+{
+    sim_transaction ((sim_adapter_t*) adapter);
+}
+
+static void sim_oncd_write (adapter_t *adapter, unsigned val, int reg, int nbits)
+{
+    sim_write_reg ((sim_adapter_t*) adapter, val, reg);
+    sim_transaction ((sim_adapter_t*) adapter);
+}
+
+static unsigned sim_oncd_read (adapter_t *adapter, int reg, int nbits)
+{
+    sim_transaction ((sim_adapter_t*) adapter);
+    return sim_read_reg ((sim_adapter_t*) adapter, reg);
+}
+
+static unsigned sim_get_idcode (adapter_t *adapter)
+{
+    sim_transaction ((sim_adapter_t*) adapter);
+    return SIM_IDCODE;
+}
+
+static int sim_cpu_stopped (adapter_t *adapter)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+
+    sim_transaction (a);
+    return a->stopped;
+}
+
+static void sim_stop_cpu (adapter_t *adapter)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+
+    sim_transaction (a);
+    if (! a->stopped) {
+        a->pcdec = a->pc;
+        a->pcfetch = a->npc;
+    }
+    a->stopped = 1;
+    a->oscr |= OSCR_SlctMEM | OSCR_RO;
+    a->adapter.oscr = a->oscr | OSCR_RDYm | OSCR_SO;
+}
+
+static void sim_reset_cpu (adapter_t *adapter)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+    int i;
+
+    sim_transaction (a);
+    a->stopped = 0;
+    a->oscr = 0;
+    a->pcfetch = 0xbfc00000;
+    a->pc = a->pcfetch;
+    a->npc = a->pc + 4;
+    for (i=0; i<a->nbanks; i++)
+        a->bank[i].fstate = FS_READ;
+}
+
+/*
+ * Блочные операции: один обмен на блок, как у адаптеров USB.
+ */
+static void sim_read_block (adapter_t *adapter,
+    unsigned nwords, unsigned addr, unsigned *data)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+
+    sim_block (a, 1, nwords);
+    while (nwords-- > 0) {
+        *data++ = sim_mem_read (a, addr);
+        addr += 4;
+    }
+}
+
+static void sim_write_block (adapter_t *adapter,
+    unsigned nwords, unsigned addr, unsigned *data)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+
+    sim_block (a, 1 + nwords, 0);
+    while (nwords-- > 0) {
+        sim_mem_write (a, addr, *data++);
+        addr += 4;
+    }
+}
+
+static void sim_write_nwords (adapter_t *adapter, unsigned nwords, va_list args)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+    unsigned addr, data;
+
+    sim_block (a, 2*nwords, 0);
+    while (nwords-- > 0) {
+        addr = va_arg (args, unsigned);
+        data = va_arg (args, unsigned);
+        sim_mem_write (a, addr, data);
+    }
+}
+
+static void sim_program_block32 (adapter_t *adapter,
+    unsigned nwords, unsigned base, unsigned addr, unsigned *data,
+    unsigned addr_odd, unsigned addr_even,
+    unsigned cmd_aa, unsigned cmd_55, unsigned cmd_a0)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+
+    sim_block (a, (cmd_aa ? 8 : 4) * nwords, 0);
+    while (nwords-- > 0) {
+        if (cmd_aa) {
+            sim_mem_write (a, base + addr_odd, cmd_aa);
+            sim_mem_write (a, base + addr_even, cmd_55);
+        }
+        sim_mem_write (a, base + addr_odd, cmd_a0);
+        sim_mem_write (a, addr, *data++);
+        addr += 4;
+    }
+}
+
+static void sim_program_block32_micron (adapter_t *adapter,
+    unsigned n_minus_1, unsigned addr, unsigned *data)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+    unsigned i;
+
+    sim_block (a, n_minus_1 + 5, 0);
+    sim_mem_write (a, addr, (n_minus_1 << 16) | n_minus_1);
+    for (i=0; i<=n_minus_1; i++)
+        sim_mem_write (a, addr + i*4, *data++);
+    sim_mem_write (a, addr, 0xd0d0d0d0);
+}
+
+static void sim_close (adapter_t *adapter)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+    int i;
+
+    free (a->cram);
+    free (a->regs);
+    free (a->sram);
+    for (i=0; i<a->nbanks; i++)
+        free (a->bank[i].mem);
+    free (a);
+}
+
+/*
+ * Разбор параметров модели вида "имя=значение,имя=значение".
+ */
+static void sim_configure (sim_adapter_t *a, const char *options)
+{
+    char name [32];
+    const char *p, *value;
+    unsigned len, v;
+
+    for (p=options; p && *p; ) {
+        len = strcspn (p, "=,");
+        if (len >= sizeof (name))
+            len = sizeof (name) - 1;
+        strncpy (name, p, len);
+        name [len] = 0;
+        value = (p[len] == '=') ? p + len + 1 : "";
+        v = strtoul (value, 0, 0);
+
+        if (strcmp (name, "flash") == 0) {
+            if (strncmp (value, "amd", 3) == 0)
+                a->flash_type = FLASH_AMD;
+            else if (strncmp (value, "sst", 3) == 0)
+                a->flash_type = FLASH_SST;
+            else if (strncmp (value, "micron", 6) == 0)
+                a->flash_type = FLASH_MICRON;
+            else if (strncmp (value, "s29gl", 5) == 0)
+                a->flash_type = FLASH_S29GL;
+            else
+                goto bad;
+        } else if (strcmp (name, "base") == 0)
+            a->flash_base = v;
+        else if (strcmp (name, "banks") == 0 && v >= 1 && v <= MAX_BANKS)
+            a->nbanks = v;
+        else if (strcmp (name, "latency") == 0)
+            a->latency = v;
+        else if (strcmp (name, "program") == 0)
+            a->program_us = v;
+        else if (strcmp (name, "sector") == 0)
+            a->sector_us = v * 1000;
+        else if (strcmp (name, "chip") == 0)
+            a->chip_us = v * 1000;
+        else if (strcmp (name, "block") == 0)
+            a->no_block = (v == 0);
+        else {
+bad:        fprintf (stderr, "Simulator: bad option `%s'\n", p);
+            exit (-1);
+        }
+        p = strchr (p, ',');
+        if (p)
+            p++;
+    }
+}
+
+/*
+ * Инициализация модели.
+ * Параметры: flash=amd|sst|micron|s29gl, base=адрес flash,
+ * banks=число одинаковых банок flash (следующие ниже base),
+ * latency=мксек на обмен, program=мксек на слово,
+ * sector=мсек и chip=мсек на стирание,
+ * block=0 - без блочных операций.
+ */
+adapter_t *adapter_open_sim (const char *options)
+{
+    sim_adapter_t *a;
+    int i;
+
+    a = calloc (1, sizeof (*a));
+    if (! a) {
+        fprintf (stderr, "Out of memory\n");
+        return 0;
+    }
+    a->flash_type = FLASH_AMD;
+    a->flash_base = FLASH_BASE;
+    a->nbanks = 1;
+    sim_configure (a, options);
+
+    switch (a->flash_type) {
+    case FLASH_AMD:
+        a->flash_bytes = 2*1024*1024;
+        a->sector_bytes = 128*1024;
+        break;
+    case FLASH_SST:
+        a->flash_bytes = 16*1024*1024;
+        a->sector_bytes = 128*1024;
+        break;
+    case FLASH_MICRON:
+        a->flash_bytes = 32*1024*1024;
+        a->sector_bytes = 256*1024;
+        break;
+    case FLASH_S29GL:
+        a->flash_bytes = 64*1024*1024;
+        a->sector_bytes = 256*1024;
+        break;
+    }
+    a->cram = calloc (1, CRAM_SIZE);
+    a->regs = calloc (1, REGS_SIZE);
+    a->sram = calloc (1, SRAM_SIZE);
+    if (! a->cram || ! a->regs || ! a->sram) {
+        fprintf (stderr, "Out of memory\n");
+        exit (-1);
+    }
+    for (i=0; i<a->nbanks; i++) {
+        /* Следующие банки - ниже первой, как boot и param на pkbi. */
+        a->bank[i].base = a->flash_base - i * a->flash_bytes;
+        a->bank[i].mem = malloc (a->flash_bytes);
+        if (! a->bank[i].mem) {
+            fprintf (stderr, "Out of memory\n");
+            exit (-1);
+        }
+        memset (a->bank[i].mem, 0xff, a->flash_bytes);
+    }
+    a->pcfetch = 0xbfc00000;
+
+    /* Обязательные функции. */
+    a->adapter.name = "Simulator";
+    a->adapter.close = sim_close;
+    a->adapter.get_idcode = sim_get_idcode;
+    a->adapter.cpu_stopped = sim_cpu_stopped;
+    a->adapter.stop_cpu = sim_stop_cpu;
+    a->adapter.reset_cpu = sim_reset_cpu;
+    a->adapter.oncd_read = sim_oncd_read;
+    a->adapter.oncd_write = sim_oncd_write;
+
+    /* Расширенные возможности. */
+    if (! a->no_block) {
+        a->adapter.block_words = 999999;
+        a->adapter.program_block_words = 999999;
+        a->adapter.read_block = sim_read_block;
+        a->adapter.write_block = sim_write_block;
+        a->adapter.write_nwords = sim_write_nwords;
+        a->adapter.program_block32 = sim_program_block32;
+        a->adapter.program_block32_micron = sim_program_block32_micron;
+    }
+    a->adapter.oncd_queue_write = sim_oncd_queue_write;
+    a->adapter.oncd_queue_read = sim_oncd_queue_read;
+    a->adapter.oncd_flush = sim_oncd_flush;
+    return &a->adapter;
+}
@@ -0,0 +1,913 @@
+/*
+ * Учёт времени вызовов адаптера JTAG, запись обменов с адаптером
+ * в файл и воспроизведение записи.
+ *
+ * Обёртка над адаптером ведёт гистограммы длительности по каждой
+ * функции интерфейса adapter_t. Запись в файл выполняется на том же
+ * уровне: для каждого
+ * вызова сохраняются время начала и длительность, параметры
+ * и переданные или полученные данные. Адаптер "replay" отвечает
+ * на вызовы по записи, с той же длительностью, что и у исходного
+ * адаптера. Так можно получить протокол медленного сеанса у заказчика
+ * и воспроизвести его без аппаратуры.
+ *
+ * Формат файла: заголовок trace_header_t, затем записи trace_rec_t,
+ * за каждой следуют nparams слов параметров и ndata слов данных.
+ * Все слова 32-битные, в порядке байтов машины, где велась запись.
+ *
+ * Этот файл распространяется в надежде, что он окажется полезным, но
+ * БЕЗ КАКИХ БЫ ТО НИ БЫЛО ГАРАНТИЙНЫХ ОБЯЗАТЕЛЬСТВ; в том числе без косвенных
+ * гарантийных обязательств, связанных с ПОТРЕБИТЕЛЬСКИМИ СВОЙСТВАМИ и
+ * ПРИГОДНОСТЬЮ ДЛЯ ОПРЕДЕЛЕННЫХ ЦЕЛЕЙ.
+ *
+ * Вы вправе распространять и/или изменять этот файл в соответствии
+ * с условиями Генеральной Общественной Лицензии GNU (GPL) в том виде,
+ * как она была опубликована Фондом Свободного ПО; либо версии 2 Лицензии
+ * либо (по вашему желанию) любой более поздней версии. Подробности
+ * смотрите в прилагаемом файле 'COPYING.txt'.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "adapter.h"
+
+#define TRACE_MAGIC     "MCTRACE1"
+
+/*
+ * Коды операций.
+ */
+enum {
+    TRACE_IDCODE = 1,
+    TRACE_CPU_STOPPED,
+    TRACE_STOP_CPU,
+    TRACE_RESET_CPU,
+    TRACE_ONCD_WRITE,
+    TRACE_ONCD_READ,
+    TRACE_STEP_CPU,
+    TRACE_RUN_CPU,
+    TRACE_READ_BLOCK,
+    TRACE_WRITE_BLOCK,
+    TRACE_WRITE_NWORDS,
+    TRACE_PROGRAM_BLOCK32,
+    TRACE_PROGRAM_BLOCK32_UNPROTECT,
+    TRACE_PROGRAM_BLOCK32_PROTECT,
+    TRACE_PROGRAM_BLOCK64,
+    TRACE_PROGRAM_BLOCK32_MICRON,
+    TRACE_QUEUE_WRITE,
+    TRACE_QUEUE_READ,
+    TRACE_FLUSH,
+    TRACE_SET_CLOCK,
+    TRACE_NOPS
+};
+
+static const char *op_name [TRACE_NOPS] = {
+    "", "get_idcode", "cpu_stopped", "stop_cpu", "reset_cpu",
+    "oncd_write", "oncd_read", "step_cpu", "run_cpu",
+    "read_block", "write_block", "write_nwords",
+    "program_block32", "program_block32_unprotect",
+    "program_block32_protect", "program_block64",
+    "program_block32_micron", "oncd_queue_write", "oncd_queue_read",
+    "oncd_flush", "set_clock",
+};
+
+/*
+ * Гистограмма длительности: интервал i содержит вызовы
+ * длительностью от 2^i до 2^(i+1) мксек, интервал 0 - короче 2 мксек.
+ */
+#define HIST_NBUCKETS   24
+
+typedef struct {
+    unsigned long calls;
+    unsigned long long total_us;
+    unsigned max_us;
+    unsigned long hist [HIST_NBUCKETS];
+} op_stats_t;
+
+/*
+ * Набор необязательных функций адаптера.
+ * Воспроизведение должно вызываться теми же порциями,
+ * что и при записи, поэтому набор сохраняется в заголовке.
+ */
+#define CAP_STEP_CPU                    0x0001
+#define CAP_RUN_CPU                     0x0002
+#define CAP_READ_BLOCK                  0x0004
+#define CAP_WRITE_BLOCK                 0x0008
+#define CAP_WRITE_NWORDS                0x0010
+#define CAP_PROGRAM_BLOCK32             0x0020
+#define CAP_PROGRAM_BLOCK32_UNPROTECT   0x0040
+#define CAP_PROGRAM_BLOCK32_PROTECT     0x0080
+#define CAP_PROGRAM_BLOCK64             0x0100
+#define CAP_PROGRAM_BLOCK32_MICRON      0x0200
+#define CAP_QUEUE                       0x0400
+#define CAP_SET_CLOCK                   0x0800
+
+typedef struct {
+    char magic [8];
+    unsigned block_words;
+    unsigned program_block_words;
+    unsigned caps;
+    char name [32];
+} trace_header_t;
+
+typedef struct {
+    unsigned op;
+    unsigned start;                     /* мксек от начала записи */
+    unsigned usec;                      /* длительность вызова */
+    unsigned nparams;
+    unsigned ndata;
+    unsigned oscr;                      /* OSCR адаптера после вызова */
+} trace_rec_t;
+
+typedef struct {
+    /* Общая часть. */
+    adapter_t adapter;
+
+    /* Реальный адаптер. */
+    adapter_t *inner;
+
+    FILE *fd;
+    const char *filename;
+    unsigned long long t0;
+    unsigned long long call_start;
+
+    /* Адреса результатов чтения, ожидающих oncd_flush(). */
+    unsigned **queued;
+    unsigned nqueued, queue_size;
+
+    /* Буфер данных. */
+    unsigned *data;
+    unsigned data_size;
+
+    unsigned long nrecords;
+
+    /* Статистика по функциям адаптера. */
+    op_stats_t ops [TRACE_NOPS];
+} trace_adapter_t;
+
+static unsigned long long trace_now (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, 0);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static void trace_grow_data (trace_adapter_t *a, unsigned nwords)
+{
+    if (nwords <= a->data_size)
+        return;
+    a->data = realloc (a->data, nwords * sizeof (unsigned));
+    if (! a->data) {
+        fprintf (stderr, "Out of memory\n");
+        exit (-1);
+    }
+    a->data_size = nwords;
+}
+
+static void trace_push_queued (trace_adapter_t *a, unsigned *result)
+{
+    if (a->nqueued >= a->queue_size) {
+        a->queue_size = a->queue_size ? a->queue_size * 2 : 64;
+        a->queued = realloc (a->queued, a->queue_size * sizeof (unsigned*));
+        if (! a->queued) {
+            fprintf (stderr, "Out of memory\n");
+            exit (-1);
+        }
+    }
+    a->queued [a->nqueued++] = result;
+}
+
+/*
+ * Перед вызовом реального адаптера передаём ему копию OSCR,
+ * после вызова забираем обратно: target.c и адаптеры
+ * совместно используют это поле как кэш регистра.
+ */
+static adapter_t *rec_begin (trace_adapter_t *a)
+{
+    a->inner->oscr = a->adapter.oscr;
+    a->call_start = trace_now ();
+    return a->inner;
+}
+
+static void rec_end (trace_adapter_t *a, unsigned op,
+    unsigned nparams, const unsigned *params,
+    unsigned ndata, const unsigned *data)
+{
+    trace_rec_t rec;
+    unsigned long long now = trace_now ();
+    op_stats_t *st = &a->ops[op];
+    unsigned usec, i;
+
+    a->adapter.oscr = a->inner->oscr;
+
+    usec = now - a->call_start;
+    st->calls++;
+    st->total_us += usec;
+    if (usec > st->max_us)
+        st->max_us = usec;
+    for (i=0; i<HIST_NBUCKETS-1 && usec >= 2u<<i; i++)
+        continue;
+    st->hist[i]++;
+    if (! a->fd)
+        return;
+
+    rec.op = op;
+    rec.start = a->call_start - a->t0;
+    rec.usec = usec;
+    rec.nparams = nparams;
+    rec.ndata = ndata;
+    rec.oscr = a->adapter.oscr;
+    if (fwrite (&rec, sizeof (rec), 1, a->fd) != 1 ||
+        (nparams && fwrite (params, sizeof (unsigned), nparams, a->fd) != nparams) ||
+        (ndata && fwrite (data, sizeof (unsigned), ndata, a->fd) != ndata)) {
+        perror (a->filename);
+        exit (-1);
+    }
+    a->nrecords++;
+}
+
+static unsigned rec_get_idcode (adapter_t *adapter)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+    unsigned idcode = inner->get_idcode (inner);
+
+    rec_end (a, TRACE_IDCODE, 0, 0, 1, &idcode);
+    return idcode;
+}
+
+static int rec_cpu_stopped (adapter_t *adapter)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+    unsigned stopped = inner->cpu_stopped (inner);
+
+    rec_end (a, TRACE_CPU_STOPPED, 0, 0, 1, &stopped);
+    return stopped;
+}
+
+static void rec_stop_cpu (adapter_t *adapter)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+
+    inner->stop_cpu (inner);
+    rec_end (a, TRACE_STOP_CPU, 0, 0, 0, 0);
+}
+
+static void rec_reset_cpu (adapter_t *adapter)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+
+    inner->reset_cpu (inner);
+    rec_end (a, TRACE_RESET_CPU, 0, 0, 0, 0);
+}
+
+static void rec_step_cpu (adapter_t *adapter)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+
+    inner->step_cpu (inner);
+    rec_end (a, TRACE_STEP_CPU, 0, 0, 0, 0);
+}
+
+static void rec_run_cpu (adapter_t *adapter)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+
+    inner->run_cpu (inner);
+    rec_end (a, TRACE_RUN_CPU, 0, 0, 0, 0);
+}
+
+static void rec_oncd_write (adapter_t *adapter, unsigned val, int reg, int nbits)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+    unsigned params [3] = { val, reg, nbits };
+
+    inner->oncd_write (inner, val, reg, nbits);
+    rec_end (a, TRACE_ONCD_WRITE, 3, params, 0, 0);
+}
+
+static unsigned rec_oncd_read (adapter_t *adapter, int reg, int nbits)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+    unsigned params [2] = { reg, nbits };
+    unsigned val = inner->oncd_read (inner, reg, nbits);
+
+    rec_end (a, TRACE_ONCD_READ, 2, params, 1, &val);
+    return val;
+}
+
+static void rec_oncd_queue_write (adapter_t *adapter, unsigned val, int reg, int nbits)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+    unsigned params [3] = { val, reg, nbits };
+
+    inner->oncd_queue_write (inner, val, reg, nbits);
+    rec_end (a, TRACE_QUEUE_WRITE, 3, params, 0, 0);
+}
+
+static void rec_oncd_queue_read (adapter_t *adapter, int reg, int nbits,
+    unsigned *result)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+    unsigned params [2] = { reg, nbits };
+
+    inner->oncd_queue_read (inner, reg, nbits, result);
+    trace_push_queued (a, result);
+    rec_end (a, TRACE_QUEUE_READ, 2, params, 0, 0);
+}
+
+/*
+ * Результаты чтений из очереди сохраняются в записи flush.
+ */
+static void rec_oncd_flush (adapter_t *adapter)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+    unsigned i;
+
+    inner->oncd_flush (inner);
+    trace_grow_data (a, a->nqueued);
+    for (i=0; i<a->nqueued; i++)
+        a->data[i] = *a->queued[i];
+
+    /* Поле oscr могло быть в очереди чтения. */
+    a->inner->oscr = a->adapter.oscr;
+    rec_end (a, TRACE_FLUSH, 0, 0, a->nqueued, a->data);
+    a->nqueued = 0;
+}
+
+static void rec_read_block (adapter_t *adapter,
+    unsigned nwords, unsigned addr, unsigned *data)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+    unsigned params [2] = { nwords, addr };
+
+    inner->read_block (inner, nwords, addr, data);
+    rec_end (a, TRACE_READ_BLOCK, 2, params, nwords, data);
+}
+
+static void rec_write_block (adapter_t *adapter,
+    unsigned nwords, unsigned addr, unsigned *data)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+    unsigned params [2] = { nwords, addr };
+
+    inner->write_block (inner, nwords, addr, data);
+    rec_end (a, TRACE_WRITE_BLOCK, 2, params, nwords, data);
+}
+
+static void rec_write_nwords (adapter_t *adapter, unsigned nwords, va_list args)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner;
+    va_list copy;
+    unsigned i;
+
+    trace_grow_data (a, nwords * 2);
+    va_copy (copy, args);
+    for (i=0; i<nwords*2; i++)
+        a->data[i] = va_arg (copy, unsigned);
+    va_end (copy);
+
+    inner = rec_begin (a);
+    inner->write_nwords (inner, nwords, args);
+    rec_end (a, TRACE_WRITE_NWORDS, 1, &nwords, nwords*2, a->data);
+}
+
+/*
+ * Четыре варианта записи блока во flash отличаются только кодом операции.
+ */
+#define REC_PROGRAM_BLOCK(func, field, op) \
+static void func (adapter_t *adapter, \
+    unsigned nwords, unsigned base, unsigned addr, unsigned *data, \
+    unsigned addr_odd, unsigned addr_even, \
+    unsigned cmd_aa, unsigned cmd_55, unsigned cmd_a0) \
+{ \
+    trace_adapter_t *a = (trace_adapter_t*) adapter; \
+    adapter_t *inner = rec_begin (a); \
+    unsigned params [8] = { nwords, base, addr, addr_odd, addr_even, \
+                            cmd_aa, cmd_55, cmd_a0 }; \
+    \
+    inner->field (inner, nwords, base, addr, data, \
+        addr_odd, addr_even, cmd_aa, cmd_55, cmd_a0); \
+    rec_end (a, op, 8, params, nwords, data); \
+}
+
+REC_PROGRAM_BLOCK (rec_program_block32, program_block32,
+    TRACE_PROGRAM_BLOCK32)
+REC_PROGRAM_BLOCK (rec_program_block32_unprotect, program_block32_unprotect,
+    TRACE_PROGRAM_BLOCK32_UNPROTECT)
+REC_PROGRAM_BLOCK (rec_program_block32_protect, program_block32_protect,
+    TRACE_PROGRAM_BLOCK32_PROTECT)
+REC_PROGRAM_BLOCK (rec_program_block64, program_block64,
+    TRACE_PROGRAM_BLOCK64)
+
+static void rec_program_block32_micron (adapter_t *adapter,
+    unsigned n_minus_1, unsigned addr, unsigned *data)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+    unsigned params [2] = { n_minus_1, addr };
+
+    inner->program_block32_micron (inner, n_minus_1, addr, data);
+    rec_end (a, TRACE_PROGRAM_BLOCK32_MICRON, 2, params, n_minus_1 + 1, data);
+}
+
+static unsigned rec_set_clock (adapter_t *adapter, unsigned khz)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_t *inner = rec_begin (a);
+    unsigned result = inner->set_clock (inner, khz);
+
+    rec_end (a, TRACE_SET_CLOCK, 1, &khz, 1, &result);
+    return result;
+}
+
+static void rec_close (adapter_t *adapter)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+
+    a->inner->oscr = a->adapter.oscr;
+    a->inner->close (a->inner);
+    if (a->fd) {
+        if (debug_level)
+            fprintf (stderr, "%s: %lu records\n", a->filename, a->nrecords);
+        fclose (a->fd);
+    }
+    free (a->queued);
+    free (a->data);
+    free (a);
+}
+
+/*
+ * Печать статистики: счётчики адаптера и время по функциям.
+ */
+void adapter_report (adapter_t *adapter,
+    void (*print) (void *arg, const char *line), void *arg)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+    adapter_stats_t *s = &a->inner->stats;
+    op_stats_t *st;
+    char line [256];
+    int op, i, n;
+
+    snprintf (line, sizeof (line), "Adapter: %s", a->inner->name);
+    print (arg, line);
+    snprintf (line, sizeof (line),
+        "  round trips: %lu, bytes out: %llu, bytes in: %llu",
+        s->round_trips, s->bytes_out, s->bytes_in);
+    print (arg, line);
+    snprintf (line, sizeof (line),
+        "  OnCD reads: %lu, OnCD writes: %lu, RDYm polls: %lu",
+        s->oncd_reads, s->oncd_writes,
+        s->rdym_polls + a->adapter.stats.rdym_polls);
+    print (arg, line);
+    snprintf (line, sizeof (line), "  %-26s %8s %10s %8s %8s",
+        "function", "calls", "total ms", "avg us", "max us");
+    print (arg, line);
+    for (op=1; op<TRACE_NOPS; op++) {
+        st = &a->ops[op];
+        if (! st->calls)
+            continue;
+        snprintf (line, sizeof (line), "  %-26s %8lu %10.1f %8.1f %8u",
+            op_name[op], st->calls, st->total_us / 1000.0,
+            (double) st->total_us / st->calls, st->max_us);
+        print (arg, line);
+
+        /* Гистограмма: верхняя граница интервала в мксек и число вызовов. */
+        n = snprintf (line, sizeof (line), "    <us:calls");
+        for (i=0; i<HIST_NBUCKETS; i++) {
+            if (! st->hist[i])
+                continue;
+            if (n > 60) {
+                print (arg, line);
+                n = snprintf (line, sizeof (line), "             ");
+            }
+            n += snprintf (line + n, sizeof (line) - n, " %u:%lu",
+                2u << i, st->hist[i]);
+        }
+        print (arg, line);
+    }
+}
+
+/*
+ * Обёртка над адаптером: учитывает время каждого вызова,
+ * а если задано имя файла - записывает обмены в файл.
+ * Все вызовы передаются реальному адаптеру.
+ */
+adapter_t *adapter_monitor (adapter_t *inner, const char *filename)
+{
+    trace_adapter_t *a;
+    trace_header_t hdr;
+
+    a = calloc (1, sizeof (*a));
+    if (! a) {
+        fprintf (stderr, "Out of memory\n");
+        exit (-1);
+    }
+    a->inner = inner;
+    a->filename = filename;
+    if (filename) {
+        a->fd = fopen (filename, "wb");
+        if (! a->fd) {
+            perror (filename);
+            exit (-1);
+        }
+    }
+
+    memset (&hdr, 0, sizeof (hdr));
+    memcpy (hdr.magic, TRACE_MAGIC, sizeof (hdr.magic));
+    hdr.block_words = inner->block_words;
+    hdr.program_block_words = inner->program_block_words;
+    strncpy (hdr.name, inner->name, sizeof (hdr.name) - 1);
+
+    a->adapter.name = inner->name;
+    a->adapter.oscr = inner->oscr;
+    a->adapter.block_words = inner->block_words;
+    a->adapter.program_block_words = inner->program_block_words;
+
+    /* Обязательные функции. */
+    a->adapter.close = rec_close;
+    a->adapter.get_idcode = rec_get_idcode;
+    a->adapter.cpu_stopped = rec_cpu_stopped;
+    a->adapter.stop_cpu = rec_stop_cpu;
+    a->adapter.reset_cpu = rec_reset_cpu;
+    a->adapter.oncd_read = rec_oncd_read;
+    a->adapter.oncd_write = rec_oncd_write;
+
+    /* Расширенные возможности: только те, что есть у адаптера. */
+    if (inner->step_cpu) {
+        a->adapter.step_cpu = rec_step_cpu;
+        hdr.caps |= CAP_STEP_CPU;
+    }
+    if (inner->run_cpu) {
+        a->adapter.run_cpu = rec_run_cpu;
+        hdr.caps |= CAP_RUN_CPU;
+    }
+    if (inner->read_block) {
+        a->adapter.read_block = rec_read_block;
+        hdr.caps |= CAP_READ_BLOCK;
+    }
+    if (inner->write_block) {
+        a->adapter.write_block = rec_write_block;
+        hdr.caps |= CAP_WRITE_BLOCK;
+    }
+    if (inner->write_nwords) {
+        a->adapter.write_nwords = rec_write_nwords;
+        hdr.caps |= CAP_WRITE_NWORDS;
+    }
+    if (inner->program_block32) {
+        a->adapter.program_block32 = rec_program_block32;
+        hdr.caps |= CAP_PROGRAM_BLOCK32;
+    }
+    if (inner->program_block32_unprotect) {
+        a->adapter.program_block32_unprotect = rec_program_block32_unprotect;
+        hdr.caps |= CAP_PROGRAM_BLOCK32_UNPROTECT;
+    }
+    if (inner->program_block32_protect) {
+        a->adapter.program_block32_protect = rec_program_block32_protect;
+        hdr.caps |= CAP_PROGRAM_BLOCK32_PROTECT;
+    }
+    if (inner->program_block64) {
+        a->adapter.program_block64 = rec_program_block64;
+        hdr.caps |= CAP_PROGRAM_BLOCK64;
+    }
+    if (inner->program_block32_micron) {
+        a->adapter.program_block32_micron = rec_program_block32_micron;
+        hdr.caps |= CAP_PROGRAM_BLOCK32_MICRON;
+    }
+    if (inner->oncd_queue_write && inner->oncd_queue_read && inner->oncd_flush) {
+        a->adapter.oncd_queue_write = rec_oncd_queue_write;
+        a->adapter.oncd_queue_read = rec_oncd_queue_read;
+        a->adapter.oncd_flush = rec_oncd_flush;
+        hdr.caps |= CAP_QUEUE;
+    }
+    if (inner->set_clock) {
+        a->adapter.set_clock = rec_set_clock;
+        hdr.caps |= CAP_SET_CLOCK;
+    }
+    if (a->fd && fwrite (&hdr, sizeof (hdr), 1, a->fd) != 1) {
+        perror (filename);
+        exit (-1);
+    }
+    a->t0 = trace_now ();
+    return &a->adapter;
+}
+
+/*
+ * Воспроизведение.
+ * Читаем очередную запись и проверяем, что вызов совпадает
+ * с записанным. Восстанавливаем OSCR адаптера. Выдерживаем ту же длительность, что и при записи.
+ * Возвращает количество слов данных, данные помещаются в a->data.
+ */
+static unsigned replay_next (trace_adapter_t *a, unsigned op,
+    unsigned nparams, const unsigned *params)
+{
+    trace_rec_t rec;
+    unsigned i, p;
+    unsigned long long deadline, now;
+
+    if (fread (&rec, sizeof (rec), 1, a->fd) != 1) {
+        fprintf (stderr, "%s: unexpected end of recording after %lu records\n",
+            a->filename, a->nrecords);
+        exit (-1);
+    }
+    if (rec.op != op) {
+        fprintf (stderr, "%s: record %lu: operation %u, expected %u\n",
+            a->filename, a->nrecords, rec.op, op);
+        exit (-1);
+    }
+    for (i=0; i<rec.nparams; i++) {
+        if (fread (&p, sizeof (p), 1, a->fd) != 1)
+            break;
+        if (debug_level > 1 && i < nparams && p != params[i])
+            fprintf (stderr, "%s: record %lu: parameter %u = %08x, expected %08x\n",
+                a->filename, a->nrecords, i, params[i], p);
+    }
+    trace_grow_data (a, rec.ndata);
+    if (rec.ndata && fread (a->data, sizeof (unsigned), rec.ndata, a->fd) != rec.ndata) {
+        fprintf (stderr, "%s: truncated record %lu\n", a->filename, a->nrecords);
+        exit (-1);
+    }
+    a->nrecords++;
+    a->adapter.oscr = rec.oscr;
+
+    deadline = a->call_start + rec.usec;
+    now = trace_now ();
+    if (deadline > now)
+        usleep (deadline - now);
+    return rec.ndata;
+}
+
+/*
+ * Время отсчитывается от входа в функцию адаптера,
+ * чтобы задержка не накапливалась с временем обработки.
+ */
+static trace_adapter_t *replay_begin (adapter_t *adapter)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+
+    a->call_start = trace_now ();
+    return a;
+}
+
+static unsigned replay_get_idcode (adapter_t *adapter)
+{
+    trace_adapter_t *a = replay_begin (adapter);
+
+    replay_next (a, TRACE_IDCODE, 0, 0);
+    return a->data[0];
+}
+
+static int replay_cpu_stopped (adapter_t *adapter)
+{
+    trace_adapter_t *a = replay_begin (adapter);
+
+    replay_next (a, TRACE_CPU_STOPPED, 0, 0);
+    return a->data[0];
+}
+
+static void replay_stop_cpu (adapter_t *adapter)
+{
+    replay_next (replay_begin (adapter), TRACE_STOP_CPU, 0, 0);
+}
+
+static void replay_reset_cpu (adapter_t *adapter)
+{
+    replay_next (replay_begin (adapter), TRACE_RESET_CPU, 0, 0);
+}
+
+static void replay_step_cpu (adapter_t *adapter)
+{
+    replay_next (replay_begin (adapter), TRACE_STEP_CPU, 0, 0);
+}
+
+static void replay_run_cpu (adapter_t *adapter)
+{
+    replay_next (replay_begin (adapter), TRACE_RUN_CPU, 0, 0);
+}
+
+static void replay_oncd_write (adapter_t *adapter, unsigned val, int reg, int nbits)
+{
+    trace_adapter_t *a = replay_begin (adapter);
+    unsigned params [3] = { val, reg, nbits };
+
+    replay_next (a, TRACE_ONCD_WRITE, 3, params);
+}
+
+static unsigned replay_oncd_read (adapter_t *adapter, int reg, int nbits)
+{
+    trace_adapter_t *a = replay_begin (adapter);
+    unsigned params [2] = { reg, nbits };
+
+    replay_next (a, TRACE_ONCD_READ, 2, params);
+    return a->data[0];
+}
+
+static void replay_oncd_queue_write (adapter_t *adapter, unsigned val, int reg, int nbits)
+{
+    trace_adapter_t *a = replay_begin (adapter);
+    unsigned params [3] = { val, reg, nbits };
+
+    replay_next (a, TRACE_QUEUE_WRITE, 3, params);
+}
+
+static void replay_oncd_queue_read (adapter_t *adapter, int reg, int nbits,
+    unsigned *result)
+{
+    trace_adapter_t *a = replay_begin (adapter);
+    unsigned params [2] = { reg, nbits };
+
+    replay_next (a, TRACE_QUEUE_READ, 2, params);
+    trace_push_queued (a, result);
+}
+
+static void replay_oncd_flush (adapter_t *adapter)
+{
+    trace_adapter_t *a = replay_begin (adapter);
+    unsigned i, n;
+
+    n = replay_next (a, TRACE_FLUSH, 0, 0);
+    if (n != a->nqueued) {
+        fprintf (stderr, "%s: record %lu: %u queued reads, expected %u\n",
+            a->filename, a->nrecords, a->nqueued, n);
+        exit (-1);
+    }
+    for (i=0; i<n; i++)
+        *a->queued[i] = a->data[i];
+    a->nqueued = 0;
+}
+
+static void replay_read_block (adapter_t *adapter,
+    unsigned nwords, unsigned addr, unsigned *data)
+{
+    trace_adapter_t *a = replay_begin (adapter);
+    unsigned params [2] = { nwords, addr };
+
+    if (replay_next (a, TRACE_READ_BLOCK, 2, params) < nwords) {
+        fprintf (stderr, "%s: record %lu: short block\n",
+            a->filename, a->nrecords);
+        exit (-1);
+    }
+    memcpy (data, a->data, nwords * sizeof (unsigned));
+}
+
+static void replay_write_block (adapter_t *adapter,
+    unsigned nwords, unsigned addr, unsigned *data)
+{
+    trace_adapter_t *a = replay_begin (adapter);
+    unsigned params [2] = { nwords, addr };
+
+    replay_next (a, TRACE_WRITE_BLOCK, 2, params);
+}
+
+static void replay_write_nwords (adapter_t *adapter, unsigned nwords, va_list args)
+{
+    trace_adapter_t *a = replay_begin (adapter);
+
+    replay_next (a, TRACE_WRITE_NWORDS, 1, &nwords);
+}
+
+#define REPLAY_PROGRAM_BLOCK(func, op) \
+static void func (adapter_t *adapter, \
+    unsigned nwords, unsigned base, unsigned addr, unsigned *data, \
+    unsigned addr_odd, unsigned addr_even, \
+    unsigned cmd_aa, unsigned cmd_55, unsigned cmd_a0) \
+{ \
+    trace_adapter_t *a = replay_begin (adapter); \
+    unsigned params [8] = { nwords, base, addr, addr_odd, addr_even, \
+                            cmd_aa, cmd_55, cmd_a0 }; \
+    \
+    replay_next (a, op, 8, params); \
+}
+
+REPLAY_PROGRAM_BLOCK (replay_program_block32, TRACE_PROGRAM_BLOCK32)
+REPLAY_PROGRAM_BLOCK (replay_program_block32_unprotect, TRACE_PROGRAM_BLOCK32_UNPROTECT)
+REPLAY_PROGRAM_BLOCK (replay_program_block32_protect, TRACE_PROGRAM_BLOCK32_PROTECT)
+REPLAY_PROGRAM_BLOCK (replay_program_block64, TRACE_PROGRAM_BLOCK64)
+
+static void replay_program_block32_micron (adapter_t *adapter,
+    unsigned n_minus_1, unsigned addr, unsigned *data)
+{
+    trace_adapter_t *a = replay_begin (adapter);
+    unsigned params [2] = { n_minus_1, addr };
+
+    replay_next (a, TRACE_PROGRAM_BLOCK32_MICRON, 2, params);
+}
+
+static unsigned replay_set_clock (adapter_t *adapter, unsigned khz)
+{
+    trace_adapter_t *a = replay_begin (adapter);
+
+    replay_next (a, TRACE_SET_CLOCK, 1, &khz);
+    return a->data[0];
+}
+
+static void replay_close (adapter_t *adapter)
+{
+    trace_adapter_t *a = (trace_adapter_t*) adapter;
+
+    if (debug_level)
+        fprintf (stderr, "%s: %lu records replayed\n", a->filename, a->nrecords);
+    fclose (a->fd);
+    free (a->queued);
+    free (a->data);
+    free ((char*) a->adapter.name);
+    free (a);
+}
+
+/*
+ * Адаптер, отвечающий на вызовы по записи из файла.
+ */
+adapter_t *adapter_open_replay (const char *filename)
+{
+    trace_adapter_t *a;
+    trace_header_t hdr;
+    char *name;
+
+    if (! filename) {
+        fprintf (stderr, "Replay: file name required, use -a replay:filename\n");
+        exit (-1);
+    }
+    a = calloc (1, sizeof (*a));
+    if (! a) {
+        fprintf (stderr, "Out of memory\n");
+        exit (-1);
+    }
+    a->filename = filename;
+    a->fd = fopen (filename, "rb");
+    if (! a->fd) {
+        perror (filename);
+        free (a);
+        return 0;
+    }
+    if (fread (&hdr, sizeof (hdr), 1, a->fd) != 1 ||
+        memcmp (hdr.magic, TRACE_MAGIC, sizeof (hdr.magic)) != 0) {
+        fprintf (stderr, "%s: not an adapter recording\n", filename);
+        exit (-1);
+    }
+    hdr.name [sizeof (hdr.name) - 1] = 0;
+    name = malloc (strlen (hdr.name) + 16);
+    if (! name) {
+        fprintf (stderr, "Out of memory\n");
+        exit (-1);
+    }
+    sprintf (name, "%s (replay)", hdr.name);
+
+    a->adapter.name = name;
+    a->adapter.block_words = hdr.block_words;
+    a->adapter.program_block_words = hdr.program_block_words;
+
+    /* Обязательные функции. */
+    a->adapter.close = replay_close;
+    a->adapter.get_idcode = replay_get_idcode;
+    a->adapter.cpu_stopped = replay_cpu_stopped;
+    a->adapter.stop_cpu = replay_stop_cpu;
+    a->adapter.reset_cpu = replay_reset_cpu;
+    a->adapter.oncd_read = replay_oncd_read;
+    a->adapter.oncd_write = replay_oncd_write;
+
+    /* Расширенные возможности: те же, что у записанного адаптера. */
+    if (hdr.caps & CAP_STEP_CPU)
+        a->adapter.step_cpu = replay_step_cpu;
+    if (hdr.caps & CAP_RUN_CPU)
+        a->adapter.run_cpu = replay_run_cpu;
+    if (hdr.caps & CAP_READ_BLOCK)
+        a->adapter.read_block = replay_read_block;
+    if (hdr.caps & CAP_WRITE_BLOCK)
+        a->adapter.write_block = replay_write_block;
+    if (hdr.caps & CAP_WRITE_NWORDS)
+        a->adapter.write_nwords = replay_write_nwords;
+    if (hdr.caps & CAP_PROGRAM_BLOCK32)
+        a->adapter.program_block32 = replay_program_block32;
+    if (hdr.caps & CAP_PROGRAM_BLOCK32_UNPROTECT)
+        a->adapter.program_block32_unprotect = replay_program_block32_unprotect;
+    if (hdr.caps & CAP_PROGRAM_BLOCK32_PROTECT)
+        a->adapter.program_block32_protect = replay_program_block32_protect;
+    if (hdr.caps & CAP_PROGRAM_BLOCK64)
+        a->adapter.program_block64 = replay_program_block64;
+    if (hdr.caps & CAP_PROGRAM_BLOCK32_MICRON)
+        a->adapter.program_block32_micron = replay_program_block32_micron;
+    if (hdr.caps & CAP_QUEUE) {
+        a->adapter.oncd_queue_write = replay_oncd_queue_write;
+        a->adapter.oncd_queue_read = replay_oncd_queue_read;
+        a->adapter.oncd_flush = replay_oncd_flush;
+    }
+    if (hdr.caps & CAP_SET_CLOCK)
+        a->adapter.set_clock = replay_set_clock;
+    return &a->adapter;
+}
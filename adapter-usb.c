@@ -34,12 +34,33 @@
 #include "oncd.h"
 #include "localize.h"
 
+/* Максимальное количество команд в одном пакете. */
+#define PKT_MAXCMD              40
+
 typedef struct {
     /* Общая часть. */
     adapter_t adapter;
 
     /* Доступ к устройству через libusb. */
     usb_dev_handle *usbdev;
+
+    /* Очередь транзакций OnCD. */
+    unsigned char queue [6*PKT_MAXCMD];
+    unsigned queue_len;                 /* длина пакета в байтах */
+    unsigned queue_ncmd;                /* количество команд в пакете */
+    unsigned queue_nreads;              /* количество чтений */
+    unsigned queue_reply_len;           /* длина ответа в байтах */
+    unsigned *queue_result [PKT_MAXCMD];
+    unsigned char queue_nbytes [PKT_MAXCMD];
+
+    /* Пакет, ответ на который ещё не получен. */
+    const char *pending;
+
+    /* Текущая частота JTAG, кГц. */
+    unsigned clock_khz;
+
+    /* Режим обращения к памяти: блочный или неблочный. */
+    int h_wr, h_rd, h_end;
 } usb_adapter_t;
 
 /* Endpoints for USB-JTAG adapter. */
@@ -101,10 +122,6 @@ typedef struct {
 #define H_SNGLEND   0x0b        /* конец неблочной операции */
 #define H_IDCODE    0x03        /* запрос idcode */
 
-int h_wr = H_BLKWR;
-int h_rd = H_BLKRD;
-int h_end = H_BLKEND;
-
 #if 0
 /*
  * Отладочная печать байтового массива.
@@ -124,7 +141,7 @@ static void print_pkt (unsigned char *pkt, unsigned len)
 /*
  * Записать через USB массив данных.
  */
-static void bulk_write (usb_dev_handle *usbdev,
+static void bulk_write (usb_adapter_t *a,
     const unsigned char *wb, unsigned wlen)
 {
     if (debug_level) {
@@ -134,48 +151,52 @@ static void bulk_write (usb_dev_handle *usbdev,
             fprintf (stderr, "-%02x", wb[i]);
         fprintf (stderr, "\n");
     }
-    int transferred = usb_bulk_write (usbdev, BULK_WRITE_ENDPOINT,
+    int transferred = usb_bulk_write (a->usbdev, BULK_WRITE_ENDPOINT,
         (char*) wb, wlen, 1000);
     if (transferred != wlen) {
         fprintf (stderr, "Bulk write failed: %d bytes to endpoint %#x.\n",
             wlen, BULK_WRITE_ENDPOINT);
         _exit (-1);
     }
+    a->adapter.stats.bytes_out += wlen;
 };
 
 /*
  * Записать команду в Ctrl Pipe.
  */
-static void bulk_cmd (usb_dev_handle *usbdev,
+static void bulk_cmd (usb_adapter_t *a,
     unsigned char cmd)
 {
     if (debug_level)
         fprintf (stderr, "Bulk cmd: %02x\n", cmd);
 
-    int transferred = usb_bulk_write (usbdev, BULK_CONTROL_ENDPOINT,
+    int transferred = usb_bulk_write (a->usbdev, BULK_CONTROL_ENDPOINT,
         (char*) &cmd, 1, 1000);
     if (transferred != 1) {
         fprintf (stderr, "Bulk cmd failed: command to endpoint %#x.\n",
             BULK_CONTROL_ENDPOINT);
         _exit (-1);
     }
+    a->adapter.stats.bytes_out++;
 };
 
 /*
  * Прочитать из USB массив данных.
  */
-static unsigned bulk_read (usb_dev_handle *usbdev,
+static unsigned bulk_read (usb_adapter_t *a,
     unsigned char *rb, unsigned rlen)
 {
     int transferred;
 
-    transferred = usb_bulk_read (usbdev, BULK_READ_ENDPOINT,
+    transferred = usb_bulk_read (a->usbdev, BULK_READ_ENDPOINT,
         (char*) rb, rlen, 1000);
     if (transferred != rlen) {
         fprintf (stderr, "Bulk read failed: %d/%d bytes from endpoint %#x.\n",
             transferred, rlen, BULK_READ_ENDPOINT);
         _exit (-1);
     }
+    a->adapter.stats.round_trips++;
+    a->adapter.stats.bytes_in += transferred;
     if (debug_level) {
         if (transferred) {
             unsigned i;
@@ -193,7 +214,7 @@ static unsigned bulk_read (usb_dev_handle *usbdev,
 /*
  * Записать и прочитать из USB массив данных.
  */
-static unsigned bulk_write_read (usb_dev_handle *usbdev,
+static unsigned bulk_write_read (usb_adapter_t *a,
     const unsigned char *wb, unsigned wlen,
     unsigned char *rb, unsigned rlen)
 {
@@ -205,20 +226,23 @@ static unsigned bulk_write_read (usb_dev_handle *usbdev,
         fprintf (stderr, " --> ");
         fflush (stderr);
     }
-    int transferred = usb_bulk_write (usbdev, BULK_WRITE_ENDPOINT,
+    int transferred = usb_bulk_write (a->usbdev, BULK_WRITE_ENDPOINT,
         (char*) wb, wlen, 1000);
     if (transferred != wlen) {
         fprintf (stderr, "Bulk write(-read) failed: %d bytes to endpoint %#x.\n",
             wlen, BULK_WRITE_ENDPOINT);
         _exit (-1);
     }
-    transferred = usb_bulk_read (usbdev, BULK_READ_ENDPOINT,
+    a->adapter.stats.bytes_out += wlen;
+    transferred = usb_bulk_read (a->usbdev, BULK_READ_ENDPOINT,
         (char*) rb, rlen, 2000);
     if (transferred != rlen) {
         fprintf (stderr, "Bulk (write-)read failed: %d/%d bytes from endpoint %#x.\n",
             transferred, rlen, BULK_READ_ENDPOINT);
         _exit (-1);
     }
+    a->adapter.stats.round_trips++;
+    a->adapter.stats.bytes_in += transferred;
     if (debug_level) {
         if (transferred) {
             unsigned i;
@@ -232,6 +256,44 @@ static unsigned bulk_write_read (usb_dev_handle *usbdev,
     return transferred;
 }
 
+/*
+ * Получение отложенного ответа на предыдущий блочный пакет:
+ * значение OSCR после выполнения пакета.
+ */
+static void usb_wait_reply (usb_adapter_t *a)
+{
+    unsigned oscr;
+    const char *what = a->pending;
+
+    if (! what)
+        return;
+    a->pending = 0;
+    if (bulk_read (a, (unsigned char*) &oscr, 4) != 4) {
+        fprintf (stderr, "Failed %s.\n", what);
+        exit (-1);
+    }
+    a->adapter.stats.rdym_polls++;
+    if (! (oscr & OSCR_RDYm)) {
+        fprintf (stderr, "Timeout %s, aborted. OSCR=%#x\n", what, oscr);
+        exit (1);
+    }
+}
+
+/*
+ * Посылка блочного пакета, завершающегося чтением OSCR.
+ * Ответ не ждём: пока адаптер выполняет этот пакет,
+ * формируется следующий. Ответ на предыдущий пакет
+ * забираем после отправки текущего, так что в работе
+ * у адаптера одновременно находятся два пакета.
+ */
+static void usb_submit (usb_adapter_t *a,
+    const unsigned char *pkt, unsigned len, const char *what)
+{
+    bulk_write (a, pkt, len);
+    usb_wait_reply (a);
+    a->pending = what;
+}
+
 /*
  * Чтение регистра IDCODE.
  */
@@ -251,12 +313,14 @@ static unsigned usb_get_idcode (adapter_t *adapter)
         0x03,
     };
 
+    usb_wait_reply (a);
+
     if (debug_level)
 		fprintf(stderr, "try to get idcode\n");
 
 	rb[0]	=	0;
 	rb[1]	=	0;
-	bulk_write_read(a->usbdev, pkt_idcode1, 2, rb, 2);
+	bulk_write_read(a, pkt_idcode1, 2, rb, 2);
 
 	if (debug_level)
 		fprintf(stderr, "read: %x %x\n", rb[0], rb[1]);
@@ -265,7 +329,7 @@ static unsigned usb_get_idcode (adapter_t *adapter)
 	rb[1]	=	0;
 	rb[2]	=	0;
 	rb[3]	=	0;
-	bulk_write_read(a->usbdev, pkt_idcode2, 8, rb, 4);
+	bulk_write_read(a, pkt_idcode2, 8, rb, 4);
 
 	if (debug_level)
 	fprintf(stderr, "read: %x %x %x %x\n", rb[0], rb[1], rb[2], rb[3]);
@@ -290,9 +354,10 @@ static void usb_reset_cpu (adapter_t *adapter)
 {
     usb_adapter_t *a = (usb_adapter_t*) adapter;
 
-    bulk_cmd (a->usbdev, ADAPTER_ACTIVE_RESET);
+    usb_wait_reply (a);
+    bulk_cmd (a, ADAPTER_ACTIVE_RESET);
     mdelay (10);
-    bulk_cmd (a->usbdev, ADAPTER_DEACTIVE_RESET);
+    bulk_cmd (a, ADAPTER_DEACTIVE_RESET);
     mdelay (100);
 }
 
@@ -308,7 +373,9 @@ static int usb_cpu_stopped (adapter_t *adapter)
         IR_DEBUG_ENABLE,
     };
 
-    if (bulk_write_read (a->usbdev, pkt_debug_enable, 2, rb, 2) != 2) {
+    usb_wait_reply (a);
+
+    if (bulk_write_read (a, pkt_debug_enable, 2, rb, 2) != 2) {
         fprintf (stderr, "Failed debug enable.\n");
         exit (-1);
     }
@@ -327,7 +394,9 @@ static void usb_step_cpu (adapter_t *adapter)
         OnCD_GO | IRd_STEP_1CLK | IRd_FLUSH_PIPE
     };
 
-    bulk_write (a->usbdev, pkt_step, 4);
+    usb_wait_reply (a);
+
+    bulk_write (a, pkt_step, 4);
 }
 
 /*
@@ -341,15 +410,21 @@ static void usb_run_cpu (adapter_t *adapter)
         OnCD_GO | IRd_RESUME
     };
 
-    bulk_write (a->usbdev, pkt_run, 4);
+    usb_wait_reply (a);
+
+    bulk_write (a, pkt_run, 4);
 }
 
 /*
  * Заполнение пакета для блочного или неблочного обращения.
  */
-static unsigned char *fill_pkt (unsigned char *ptr, unsigned cmd,
-    unsigned reg, unsigned data)
+static unsigned char *fill_pkt (usb_adapter_t *a, unsigned char *ptr,
+    unsigned cmd, unsigned reg, unsigned data)
 {
+    if ((reg & IRd_READ) && (reg & 0x1f) != OnCD_GO)
+        a->adapter.stats.oncd_reads++;
+    else
+        a->adapter.stats.oncd_writes++;
     *ptr++ = cmd;
     *ptr++ = reg;
     *(unsigned*) ptr = data;
@@ -357,55 +432,134 @@ static unsigned char *fill_pkt (unsigned char *ptr, unsigned cmd,
 }
 
 /*
- * Чтение регистра OnCD.
+ * Выполнение накопленной очереди транзакций OnCD:
+ * весь пакет посылается одной операцией записи,
+ * ответ раскладывается по адресам результатов.
  */
-static unsigned usb_oncd_read (adapter_t *adapter, int reg, int nbits)
+static void usb_oncd_flush (adapter_t *adapter)
 {
     usb_adapter_t *a = (usb_adapter_t*) adapter;
-    unsigned char pkt[6];
-    unsigned val = 0;
+    unsigned char reply [4*PKT_MAXCMD];
+    unsigned i, n, val;
+    int transferred;
 
-    if (nbits < 32) {
-        fill_pkt (pkt, nbits==16 ? HDR(H_16) : HDR(H_12), reg | IRd_READ, 0);
-        if (bulk_write_read (a->usbdev, pkt, 4, (unsigned char*) &val, 2) != 2) {
-            fprintf (stderr, "Failed to read %d-bit register.\n", nbits);
+    if (a->queue_len == 0)
+        return;
+
+    usb_wait_reply (a);
+
+    bulk_write (a, a->queue, a->queue_len);
+
+    /* Ответ может прийти несколькими порциями. */
+    for (n = 0; n < a->queue_reply_len; n += transferred) {
+        transferred = usb_bulk_read (a->usbdev, BULK_READ_ENDPOINT,
+            (char*) reply + n, a->queue_reply_len - n, 2000);
+        if (transferred <= 0) {
+            fprintf (stderr, "Failed to read OnCD queue: %d/%d bytes.\n",
+                n, a->queue_reply_len);
             exit (-1);
         }
+    }
+    if (n > 0) {
+        a->adapter.stats.round_trips++;
+        a->adapter.stats.bytes_in += n;
+    }
+    if (debug_level && n > 0) {
+        fprintf (stderr, "Bulk read: %02x", *reply);
+        for (i=1; i<n; ++i)
+            fprintf (stderr, "-%02x", reply[i]);
+        fprintf (stderr, "\n");
+    }
+    n = 0;
+    for (i=0; i<a->queue_nreads; i++) {
+        val = 0;
+        memcpy (&val, reply + n, a->queue_nbytes[i]);
+        *a->queue_result[i] = val;
+        n += a->queue_nbytes[i];
+    }
+    a->queue_len = 0;
+    a->queue_ncmd = 0;
+    a->queue_nreads = 0;
+    a->queue_reply_len = 0;
+}
+
+/*
+ * Постановка в очередь чтения регистра OnCD.
+ */
+static void usb_oncd_queue_read (adapter_t *adapter, int reg, int nbits,
+    unsigned *result)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+
+    if (a->queue_ncmd >= PKT_MAXCMD)
+        usb_oncd_flush (adapter);
+
+    if (nbits < 32) {
+        fill_pkt (a, a->queue + a->queue_len,
+            nbits==16 ? HDR(H_16) : HDR(H_12), reg | IRd_READ, 0);
+        a->queue_len += 4;
+        a->queue_nbytes [a->queue_nreads] = 2;
     } else {
-        fill_pkt (pkt, HDR(H_32), reg | IRd_READ, 0);
-        if (bulk_write_read (a->usbdev, pkt, 6, (unsigned char*) &val, 4) != 4) {
-            fprintf (stderr, "Failed to read register.\n");
-            exit (-1);
-        }
+        fill_pkt (a, a->queue + a->queue_len, HDR(H_32), reg | IRd_READ, 0);
+        a->queue_len += 6;
+        a->queue_nbytes [a->queue_nreads] = 4;
     }
-//fprintf (stderr, "OnCD read %d -> %08x\n", reg, val);
-    return val;
+    a->queue_result [a->queue_nreads] = result;
+    a->queue_reply_len += a->queue_nbytes [a->queue_nreads];
+    a->queue_nreads++;
+    a->queue_ncmd++;
 }
 
 /*
- * Запись регистра OnCD.
+ * Постановка в очередь записи регистра OnCD.
  */
-static void usb_oncd_write (adapter_t *adapter,
+static void usb_oncd_queue_write (adapter_t *adapter,
     unsigned val, int reg, int nbits)
 {
     usb_adapter_t *a = (usb_adapter_t*) adapter;
-    unsigned char pkt[6];
+
+    if (a->queue_ncmd >= PKT_MAXCMD)
+        usb_oncd_flush (adapter);
 
 //fprintf (stderr, "OnCD write %d := %08x\n", reg, val);
     switch (nbits) {
     default:
-        fill_pkt (pkt, HDR (H_32), reg, val);
-        bulk_write (a->usbdev, pkt, 6);
+        fill_pkt (a, a->queue + a->queue_len, HDR (H_32), reg, val);
+        a->queue_len += 6;
         break;
     case 16:
-        fill_pkt (pkt, HDR (H_16), reg, val);
-        bulk_write (a->usbdev, pkt, 4);
+        fill_pkt (a, a->queue + a->queue_len, HDR (H_16), reg, val);
+        a->queue_len += 4;
         break;
     case 12:
-        fill_pkt (pkt, HDR (H_12), reg, val);
-        bulk_write (a->usbdev, pkt, 4);
+        fill_pkt (a, a->queue + a->queue_len, HDR (H_12), reg, val);
+        a->queue_len += 4;
         break;
     }
+    a->queue_ncmd++;
+}
+
+/*
+ * Чтение регистра OnCD.
+ */
+static unsigned usb_oncd_read (adapter_t *adapter, int reg, int nbits)
+{
+    unsigned val = 0;
+
+    usb_oncd_queue_read (adapter, reg, nbits, &val);
+    usb_oncd_flush (adapter);
+//fprintf (stderr, "OnCD read %d -> %08x\n", reg, val);
+    return val;
+}
+
+/*
+ * Запись регистра OnCD.
+ */
+static void usb_oncd_write (adapter_t *adapter,
+    unsigned val, int reg, int nbits)
+{
+    usb_oncd_queue_write (adapter, val, reg, nbits);
+    usb_oncd_flush (adapter);
 }
 
 static void usb_write_block (adapter_t *adapter,
@@ -413,46 +567,32 @@ static void usb_write_block (adapter_t *adapter,
 {
     usb_adapter_t *a = (usb_adapter_t*) adapter;
     unsigned char pkt [6 + 6*nwords + 6], *ptr = pkt;
-    unsigned oscr, i;
+    unsigned i;
 
-    ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, addr);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, addr);
     for (i=1; i<nwords; i++)
-        ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMDR, *data++);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, *data);
-    ptr = fill_pkt (ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMDR, *data++);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, *data);
+    ptr = fill_pkt (a, ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
 
-    if (bulk_write_read (a->usbdev, pkt, ptr - pkt, (unsigned char*) &oscr, 4) != 4) {
-        fprintf (stderr, "Failed to write 4 words.\n");
-        exit (-1);
-    }
-    if (! (oscr & OSCR_RDYm)) {
-        fprintf (stderr, "Timeout writing N words, aborted. OSCR=%#x\n", oscr);
-        exit (1);
-    }
+    usb_submit (a, pkt, ptr - pkt, "writing N words");
 }
 
 static void usb_write_nwords (adapter_t *adapter, unsigned nwords, va_list args)
 {
     usb_adapter_t *a = (usb_adapter_t*) adapter;
     unsigned char pkt [6*2*nwords + 6], *ptr = pkt;
-    unsigned i, oscr, data, addr;
+    unsigned i, data, addr;
 
     for (i=0; i<nwords; i++) {
         addr = va_arg (args, unsigned);
         data = va_arg (args, unsigned);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, addr);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, data);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, addr);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, data);
     }
-    ptr = fill_pkt (ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
+    ptr = fill_pkt (a, ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
 
-    if (bulk_write_read (a->usbdev, pkt, ptr - pkt, (unsigned char*) &oscr, 4) != 4) {
-        fprintf (stderr, "Failed to write %d words.\n", nwords);
-        exit (-1);
-    }
-    if (! (oscr & OSCR_RDYm)) {
-        fprintf (stderr, "Timeout writing %d words, aborted. OSCR=%#x\n", nwords, oscr);
-        exit (1);
-    }
+    usb_submit (a, pkt, ptr - pkt, "writing words");
 }
 
 static void usb_read_block (adapter_t *adapter,
@@ -463,30 +603,33 @@ static void usb_read_block (adapter_t *adapter,
     unsigned char pkt [6 + 6*nwords + 6], *ptr = pkt;
     unsigned oscr, i;
 
-	if (h_rd == H_BLKRD) {
+    usb_wait_reply (a);
+
+	if (a->h_rd == H_BLKRD) {
 		/* Блочное чтение. */
-		ptr = fill_pkt (ptr, HDR (H_32 | h_rd), OnCD_OMAR, addr);
+		ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_rd), OnCD_OMAR, addr);
 		for (i=1; i<nwords; i++)
-			ptr = fill_pkt (ptr, HDR (H_32 | h_rd), OnCD_OMDR | IRd_READ, 0);
-		ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR | IRd_READ, 0);
+			ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_rd), OnCD_OMDR | IRd_READ, 0);
+		ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR | IRd_READ, 0);
 	} else {
 		/* Неблочное чтение. */
-		ptr = fill_pkt (ptr, HDR (H_32 | H_TRST | h_rd), OnCD_OMAR, addr);
+		ptr = fill_pkt (a, ptr, HDR (H_32 | H_TRST | a->h_rd), OnCD_OMAR, addr);
 		for (i=1; i<nwords; i++)
-			ptr = fill_pkt (ptr, HDR (H_32 | H_TRST | h_rd), OnCD_OMDR | IRd_READ, 0);
-		ptr = fill_pkt (ptr, HDR (H_32 | H_TRST | h_end), OnCD_OMDR | IRd_READ, 0);
+			ptr = fill_pkt (a, ptr, HDR (H_32 | H_TRST | a->h_rd), OnCD_OMDR | IRd_READ, 0);
+		ptr = fill_pkt (a, ptr, HDR (H_32 | H_TRST | a->h_end), OnCD_OMDR | IRd_READ, 0);
 	}
-    ptr = fill_pkt (ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
+    ptr = fill_pkt (a, ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
 
-    if (bulk_write_read (a->usbdev, pkt, ptr - pkt,
+    if (bulk_write_read (a, pkt, ptr - pkt,
         (unsigned char*) data, 4*nwords) != 4*nwords) {
         fprintf (stderr, "Empty data reading memory, aborted.\n");
         exit (1);
     }
-    if (bulk_read (a->usbdev, (unsigned char*) &oscr, 4) != 4) {
+    if (bulk_read (a, (unsigned char*) &oscr, 4) != 4) {
         fprintf (stderr, "Failed to read N words.\n");
         exit (-1);
     }
+    a->adapter.stats.rdym_polls++;
     if (! (oscr & OSCR_RDYm)) {
         fprintf (stderr, "Timeout reading memory, aborted. OSCR=%#x\n", oscr);
         exit (1);
@@ -507,32 +650,27 @@ static void usb_program_block32 (adapter_t *adapter,
 {
     usb_adapter_t *a = (usb_adapter_t*) adapter;
     unsigned char pkt [6*(8+1)*nwords + 6], *ptr = pkt;
-    unsigned oscr, i;
+    unsigned i;
 //printf ("usb_program_block32 (nwords = %d, base = %x, addr = %x, cmd_aa = %08x, cmd_55 = %08x, cmd_a0 = %08x)\n", nwords, base, addr, cmd_aa, cmd_55, cmd_a0);
     for (i=0; i<nwords; i++) {
-        ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_odd);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, cmd_aa);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_even);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, cmd_55);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_odd);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, cmd_a0);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, addr);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, *data);
+        if (cmd_aa) {
+            ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_odd);
+            ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, cmd_aa);
+            ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_even);
+            ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, cmd_55);
+        }
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_odd);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, cmd_a0);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, addr);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, *data);
         /* delay */
-        ptr = fill_pkt (ptr, HDR (H_32), OnCD_OMDR, 0);
+        ptr = fill_pkt (a, ptr, HDR (H_32), OnCD_OMDR, 0);
         addr += 4;
         data++;
     }
-    ptr = fill_pkt (ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
+    ptr = fill_pkt (a, ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
 
-    if (bulk_write_read (a->usbdev, pkt, ptr - pkt, (unsigned char*) &oscr, 4) != 4) {
-        fprintf (stderr, "Failed to program block32.\n");
-        exit (-1);
-    }
-    if (! (oscr & OSCR_RDYm)) {
-        fprintf (stderr, "Timeout programming block32, aborted. OSCR=%#x\n", oscr);
-        exit (1);
-    }
+    usb_submit (a, pkt, ptr - pkt, "programming block32");
 }
 
 static void usb_program_block32_unprotect (adapter_t *adapter,
@@ -544,25 +682,28 @@ static void usb_program_block32_unprotect (adapter_t *adapter,
     unsigned char pkt [6*18 + 6*2*nwords + 6], *ptr = pkt;
     unsigned oscr, i;
 
+    usb_wait_reply (a);
+
     mdelay (10);
 //printf ("usb_program_block32_unprotect (nwords = %d, base = %x, addr = %x)\n", nwords, base, addr);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_odd);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, cmd_aa);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_even);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, cmd_55);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_odd);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, 0x80808080);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_odd);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, cmd_aa);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_even);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, cmd_55);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_odd);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, 0x20202020);
-    ptr = fill_pkt (ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
-    if (bulk_write_read (a->usbdev, pkt, ptr - pkt, (unsigned char*) &oscr, 4) != 4) {
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_odd);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, cmd_aa);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_even);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, cmd_55);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_odd);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, 0x80808080);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_odd);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, cmd_aa);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_even);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, cmd_55);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_odd);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, 0x20202020);
+    ptr = fill_pkt (a, ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
+    if (bulk_write_read (a, pkt, ptr - pkt, (unsigned char*) &oscr, 4) != 4) {
         fprintf (stderr, "Failed to program block32 Atmel.\n");
         exit (-1);
     }
+    a->adapter.stats.rdym_polls++;
     if (! (oscr & OSCR_RDYm)) {
         fprintf (stderr, "Timeout programming block32 Atmel, aborted. OSCR=%#x\n", oscr);
         exit (1);
@@ -571,17 +712,18 @@ static void usb_program_block32_unprotect (adapter_t *adapter,
 
     ptr = pkt;
     for (i=0; i<nwords; i++) {
-        ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, addr);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, *data);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, addr);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, *data);
         addr += 4;
         data++;
     }
-    ptr = fill_pkt (ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
+    ptr = fill_pkt (a, ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
 
-    if (bulk_write_read (a->usbdev, pkt, ptr - pkt, (unsigned char*) &oscr, 4) != 4) {
+    if (bulk_write_read (a, pkt, ptr - pkt, (unsigned char*) &oscr, 4) != 4) {
         fprintf (stderr, "Failed to program block32 Atmel.\n");
         exit (-1);
     }
+    a->adapter.stats.rdym_polls++;
     if (! (oscr & OSCR_RDYm)) {
         fprintf (stderr, "Timeout programming block32 Atmel, aborted. OSCR=%#x\n", oscr);
         exit (1);
@@ -598,19 +740,22 @@ static void usb_program_block32_protect (adapter_t *adapter,
     unsigned char pkt [6*18 + 6*2*nwords + 6], *ptr = pkt;
     unsigned oscr, i;
 
+    usb_wait_reply (a);
+
     mdelay (10);
 //printf ("usb_program_block32_protect (nwords = %d, base = %x, addr = %x)\n", nwords, base, addr);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_odd);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, cmd_aa);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_even);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, cmd_55);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_odd);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, cmd_a0);
-    ptr = fill_pkt (ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
-    if (bulk_write_read (a->usbdev, pkt, ptr - pkt, (unsigned char*) &oscr, 4) != 4) {
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_odd);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, cmd_aa);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_even);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, cmd_55);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_odd);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, cmd_a0);
+    ptr = fill_pkt (a, ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
+    if (bulk_write_read (a, pkt, ptr - pkt, (unsigned char*) &oscr, 4) != 4) {
         fprintf (stderr, "Failed to program block32 Atmel.\n");
         exit (-1);
     }
+    a->adapter.stats.rdym_polls++;
     if (! (oscr & OSCR_RDYm)) {
         fprintf (stderr, "Timeout programming block32 Atmel, aborted. OSCR=%#x\n", oscr);
         exit (1);
@@ -619,17 +764,18 @@ static void usb_program_block32_protect (adapter_t *adapter,
 
     ptr = pkt;
     for (i=0; i<nwords; i++) {
-        ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, addr);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, *data);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, addr);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, *data);
         addr += 4;
         data++;
     }
-    ptr = fill_pkt (ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
+    ptr = fill_pkt (a, ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
 
-    if (bulk_write_read (a->usbdev, pkt, ptr - pkt, (unsigned char*) &oscr, 4) != 4) {
+    if (bulk_write_read (a, pkt, ptr - pkt, (unsigned char*) &oscr, 4) != 4) {
         fprintf (stderr, "Failed to program block32 Atmel.\n");
         exit (-1);
     }
+    a->adapter.stats.rdym_polls++;
     if (! (oscr & OSCR_RDYm)) {
         fprintf (stderr, "Timeout programming block32 Atmel, aborted. OSCR=%#x\n", oscr);
         exit (1);
@@ -644,30 +790,25 @@ static void usb_program_block64 (adapter_t *adapter,
 {
     usb_adapter_t *a = (usb_adapter_t*) adapter;
     unsigned char pkt [6*8*nwords + 6], *ptr = pkt;
-    unsigned oscr, i;
+    unsigned i;
 //printf ("usb_program_block64 (nwords = %d, base = %x, cmd_a0 = %08x,  addr = %x)\n", nwords, base, cmd_a0, addr);
     for (i=0; i<nwords; i++) {
-        ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_odd + (addr & 4));
-        ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, cmd_aa);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_even + (addr & 4));
-        ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, cmd_55);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, base + addr_odd + (addr & 4));
-        ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, cmd_a0);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, addr);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, *data);
+        if (cmd_aa) {
+            ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_odd + (addr & 4));
+            ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, cmd_aa);
+            ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_even + (addr & 4));
+            ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, cmd_55);
+        }
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, base + addr_odd + (addr & 4));
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, cmd_a0);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, addr);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, *data);
         addr += 4;
         data++;
     }
-    ptr = fill_pkt (ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
+    ptr = fill_pkt (a, ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
 
-    if (bulk_write_read (a->usbdev, pkt, ptr - pkt, (unsigned char*) &oscr, 4) != 4) {
-        fprintf (stderr, "Failed to program block32.\n");
-        exit (-1);
-    }
-    if (! (oscr & OSCR_RDYm)) {
-        fprintf (stderr, "Timeout programming block32, aborted. OSCR=%#x\n", oscr);
-        exit (1);
-    }
+    usb_submit (a, pkt, ptr - pkt, "programming block64");
 }
 
 static void usb_program_block32_micron (adapter_t *adapter,
@@ -675,29 +816,22 @@ static void usb_program_block32_micron (adapter_t *adapter,
 {
     usb_adapter_t *a = (usb_adapter_t*) adapter;
     unsigned char pkt [6*(8+1)*(n_minus_1 + 2) + 6], *ptr = pkt;
-    unsigned oscr, i;
+    unsigned i;
     unsigned block_addr = addr & 0xFFC00000;
 
-    ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, block_addr);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, (n_minus_1 << 16) | n_minus_1);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, block_addr);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, (n_minus_1 << 16) | n_minus_1);
     for (i=0; i<=n_minus_1; i++) {
-        ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, addr);
-        ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, *data);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, addr);
+        ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, *data);
         addr += 4;
         data++;
     }
-    ptr = fill_pkt (ptr, HDR (H_32 | h_wr), OnCD_OMAR, block_addr);
-    ptr = fill_pkt (ptr, HDR (H_32 | h_end), OnCD_OMDR, 0x00d000d0);
-    ptr = fill_pkt (ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_wr), OnCD_OMAR, block_addr);
+    ptr = fill_pkt (a, ptr, HDR (H_32 | a->h_end), OnCD_OMDR, 0x00d000d0);
+    ptr = fill_pkt (a, ptr, HDR (H_32), OnCD_OSCR | IRd_READ, 0);
 
-    if (bulk_write_read (a->usbdev, pkt, ptr - pkt, (unsigned char*) &oscr, 4) != 4) {
-        fprintf (stderr, "Failed to program block32.\n");
-        exit (-1);
-    }
-    if (! (oscr & OSCR_RDYm)) {
-        fprintf (stderr, "Timeout programming block32, aborted. OSCR=%#x\n", oscr);
-        exit (1);
-    }
+    usb_submit (a, pkt, ptr - pkt, "programming block32");
 }
 
 
@@ -728,13 +862,17 @@ static void usb_stop_cpu (adapter_t *adapter)
         IR_DEBUG_ENABLE
     };
 
+    usb_wait_reply (a);
 
     retry	=	0;
-    bulk_write(a->usbdev, pkt_debug_request, 2);
+    bulk_write (a, pkt_debug_request, 2);
 	rb[0]	=	0;
 	rb[1]	=	0;
 
     transferred = usb_bulk_read (a->usbdev, BULK_READ_ENDPOINT, (char*)rb, 2, 1000);
+    a->adapter.stats.round_trips++;
+    if (transferred > 0)
+        a->adapter.stats.bytes_in += transferred;
     if (debug_level) {
         if (transferred) {
             unsigned i;
@@ -752,7 +890,7 @@ static void usb_stop_cpu (adapter_t *adapter)
 
 		rb[0]	=	0;
 		rb[1]	=	0;
-		bulk_write_read(a->usbdev, pkt_debug_request1, 2, rb, 2);
+		bulk_write_read(a, pkt_debug_request1, 2, rb, 2);
 		if (debug_level)
 			fprintf(stderr, "read: %x %x\n", rb[0], rb[1]);
 		mdelay (40);
@@ -763,7 +901,7 @@ static void usb_stop_cpu (adapter_t *adapter)
 	for (retry=0; ; retry++) {
 	    mdelay (40);
 
-	    if (bulk_write_read (a->usbdev, pkt_debug_enable, 2, rb, 2) != 2) {
+	    if (bulk_write_read (a, pkt_debug_enable, 2, rb, 2) != 2) {
             fprintf (stderr, "Failed debug enable.\n");
             exit (-1);
         }
@@ -784,6 +922,29 @@ static void usb_stop_cpu (adapter_t *adapter)
     }
 }
 
+/*
+ * Установка частоты JTAG. Адаптер умеет только 12, 24 и 48 МГц:
+ * выбираем ближайшую снизу. Возвращаем установленную частоту в кГц.
+ */
+static unsigned usb_set_clock (adapter_t *adapter, unsigned khz)
+{
+    usb_adapter_t *a = (usb_adapter_t*) adapter;
+
+    usb_wait_reply (a);
+    if (khz >= 48000) {
+        bulk_cmd (a, ADAPTER_PLL_48MHZ);
+        a->clock_khz = 48000;
+    } else if (khz >= 24000) {
+        bulk_cmd (a, ADAPTER_PLL_24MHZ);
+        a->clock_khz = 24000;
+    } else {
+        bulk_cmd (a, ADAPTER_PLL_12MHZ);
+        a->clock_khz = 12000;
+    }
+    mdelay (1);
+    return a->clock_khz;
+}
+
 /*
  * Завершение работы с адаптером и освобождение памяти.
  */
@@ -791,6 +952,7 @@ static void usb_close_adapter (adapter_t *adapter)
 {
     usb_adapter_t *a = (usb_adapter_t*) adapter;
 
+    usb_wait_reply (a);
     usb_release_interface (a->usbdev, 0);
     usb_close (a->usbdev);
     free (a);
@@ -801,7 +963,7 @@ static void usb_close_adapter (adapter_t *adapter)
  * Возвращаем указатель на структуру данных, выделяемую динамически.
  * Если адаптер не обнаружен, возвращаем 0.
  */
-adapter_t *adapter_open_usb (int need_reset, int disable_block_op)
+adapter_t *adapter_open_usb (int need_reset, int disable_block_op, const char *id)
 {
     static const unsigned char pkt_reset[8] = {
         /* Посылаем команду чтения MEM, но с активным TRST. */
@@ -809,34 +971,28 @@ adapter_t *adapter_open_usb (int need_reset, int disable_block_op)
         OnCD_MEM | IRd_READ,
     };
     usb_adapter_t *a;
-    struct usb_bus *bus;
     struct usb_device *dev;
     unsigned char rb [2];
 
-    if (disable_block_op) {
-		h_wr = H_SNGLWR;
-		h_rd = H_SNGLRD;
-		h_end = H_SNGLEND;
-	}
-
-    usb_init ();
-    usb_find_busses ();
-    usb_find_devices ();
-    for (bus = usb_get_busses(); bus; bus = bus->next) {
-        for (dev = bus->devices; dev; dev = dev->next) {
-            if (dev->descriptor.idVendor == 0x0547 &&
-                dev->descriptor.idProduct == 0x1002)
-                goto found;
-        }
+    dev = adapter_usb_find (0x0547, 0x1002, id);
+    if (! dev) {
+/*      fprintf (stderr, "USB-JTAG Multicore adapter not found.\n");*/
+        return 0;
     }
-/*  fprintf (stderr, "USB-JTAG Multicore adapter not found.\n");*/
-    return 0;
-found:
     a = calloc (1, sizeof (*a));
     if (! a) {
         fprintf (stderr, "Out of memory\n");
         return 0;
     }
+    if (disable_block_op) {
+        a->h_wr = H_SNGLWR;
+        a->h_rd = H_SNGLRD;
+        a->h_end = H_SNGLEND;
+    } else {
+        a->h_wr = H_BLKWR;
+        a->h_rd = H_BLKRD;
+        a->h_end = H_BLKEND;
+    }
     a->usbdev = usb_open (dev);
     if (! a->usbdev) {
         fprintf (stderr, "usb_open() failed.\n");
@@ -844,24 +1000,32 @@ found:
         return 0;
     }
     usb_set_configuration (a->usbdev, 1);
-    usb_claim_interface (a->usbdev, 0);
+    if (usb_claim_interface (a->usbdev, 0) != 0) {
+        /* Адаптер уже занят другим процессом или потоком. */
+        fprintf (stderr, "usb_claim_interface() failed.\n");
+        usb_close (a->usbdev);
+        free (a);
+        return 0;
+    }
     usb_clear_halt (a->usbdev, BULK_WRITE_ENDPOINT);
     usb_clear_halt (a->usbdev, BULK_READ_ENDPOINT);
 
-    bulk_cmd (a->usbdev, ADAPTER_PLL_12MHZ);
-/*  bulk_cmd (a->usbdev, ADAPTER_PLL_48MHZ);*/
+    /* Начинаем с безопасной частоты. Более высокую можно
+     * выбрать позже, через set_clock(). */
+    bulk_cmd (a, ADAPTER_PLL_12MHZ);
+    a->clock_khz = 12000;
     mdelay (1);
 
     if (need_reset) {
         /* Делаем reset только для mcprog. */
-        bulk_cmd (a->usbdev, ADAPTER_ACTIVE_RESET);
+        bulk_cmd (a, ADAPTER_ACTIVE_RESET);
         mdelay (1);
-        bulk_cmd (a->usbdev, ADAPTER_DEACTIVE_RESET);
+        bulk_cmd (a, ADAPTER_DEACTIVE_RESET);
         mdelay (1);
     }
 
     /* Сброс OnCD. */
-    bulk_write_read (a->usbdev, pkt_reset, 2, rb, 2);
+    bulk_write_read (a, pkt_reset, 2, rb, 2);
 
     /* Получить версию прошивки. */
     unsigned short version;
@@ -869,7 +1033,7 @@ found:
         HIR (H_DEBUG | H_TRST | H_SYSRST),
         IR_BYPASS
     };
-    if (bulk_write_read (a->usbdev, pkt_getver, 2,
+    if (bulk_write_read (a, pkt_getver, 2,
         (unsigned char*) &version, 2) != 2) {
         fprintf (stderr, "Failed to get adapter version.\n");
         free (a);
@@ -900,6 +1064,10 @@ found:
     a->adapter.program_block32_protect = usb_program_block32_protect;
     a->adapter.program_block64 = usb_program_block64;
     a->adapter.program_block32_micron = usb_program_block32_micron;
+    a->adapter.oncd_queue_write = usb_oncd_queue_write;
+    a->adapter.oncd_queue_read = usb_oncd_queue_read;
+    a->adapter.oncd_flush = usb_oncd_flush;
+    a->adapter.set_clock = usb_set_clock;
 
     return &a->adapter;
 }
@@ -17,12 +17,29 @@
 
 typedef struct _adapter_t adapter_t;
 
+/*
+ * Счётчики обменов, ведутся каждым адаптером.
+ * По ним видно, чем ограничена скорость: числом обменов,
+ * пропускной способностью или ожиданием flash-памяти.
+ */
+typedef struct {
+    unsigned long round_trips;          /* обмены с ожиданием ответа */
+    unsigned long long bytes_out;       /* передано байт */
+    unsigned long long bytes_in;        /* принято байт */
+    unsigned long oncd_reads;           /* чтения регистров OnCD */
+    unsigned long oncd_writes;          /* записи регистров OnCD */
+    unsigned long rdym_polls;           /* проверки готовности RDYm */
+} adapter_stats_t;
+
 struct _adapter_t {
     const char *name;
 
     /* Регистр управления блоком отладки. */
     unsigned oscr;
 
+    /* Счётчики обменов. */
+    adapter_stats_t stats;
+
     /*
      * Обязательные функции.
      */
@@ -47,6 +64,12 @@ struct _adapter_t {
     void (*write_block) (adapter_t *adapter,
         unsigned nwords, unsigned addr, unsigned *data);
     void (*write_nwords) (adapter_t *adapter, unsigned nwords, va_list args);
+
+    /*
+     * Запись flash по словам командами AA/55/A0.
+     * При cmd_aa=0 микросхемы уже в режиме unlock bypass:
+     * перед каждым словом подаётся только команда A0.
+     */
     void (*program_block32) (adapter_t *adapter,
         unsigned nwords, unsigned base, unsigned addr, unsigned *data,
         unsigned addr_odd, unsigned addr_even,
@@ -65,12 +88,53 @@ struct _adapter_t {
         unsigned cmd_aa, unsigned cmd_55, unsigned cmd_a0);
     void (*program_block32_micron) (adapter_t *adapter,
         unsigned n_minus_1, unsigned addr, unsigned *data);
+
+    /*
+     * Очередь транзакций OnCD.
+     * Запись и чтение регистров накапливаются и выполняются
+     * одним обменом с адаптером при вызове oncd_flush().
+     * Результат чтения помещается по указанному адресу
+     * только после oncd_flush(). Перед любым другим
+     * обращением к адаптеру очередь надо вытолкнуть.
+     */
+    void (*oncd_queue_write) (adapter_t *a, unsigned val, int reg, int nbits);
+    void (*oncd_queue_read) (adapter_t *a, int reg, int nbits, unsigned *result);
+    void (*oncd_flush) (adapter_t *a);
+
+    /*
+     * Установка частоты JTAG в килогерцах.
+     * Адаптер выбирает ближайшую поддерживаемую частоту не выше
+     * заданной и возвращает её.
+     */
+    unsigned (*set_clock) (adapter_t *a, unsigned khz);
 };
 
-adapter_t *adapter_open_usb (int need_reset, int disable_block_op);
+/*
+ * Параметр id выбирает конкретный адаптер USB: серийный номер
+ * или путь "шина/устройство". Если id=0, берётся первый найденный.
+ */
+adapter_t *adapter_open_usb (int need_reset, int disable_block_op, const char *id);
 adapter_t *adapter_open_lpt (void);
-adapter_t *adapter_open_bitbang (void);
-adapter_t *adapter_open_mpsse (void);
+adapter_t *adapter_open_bitbang (const char *id);
+adapter_t *adapter_open_mpsse (const char *id);
+
+/*
+ * Программная модель процессора и flash-памяти для отладки без аппаратуры.
+ * Параметры задаются строкой вида "flash=sst,latency=125".
+ */
+adapter_t *adapter_open_sim (const char *options);
+
+/*
+ * Обёртка для учёта времени вызовов адаптера и, если задано
+ * имя файла, записи обменов. Воспроизведение записи.
+ */
+adapter_t *adapter_monitor (adapter_t *a, const char *filename);
+adapter_t *adapter_open_replay (const char *filename);
+void adapter_report (adapter_t *a,
+    void (*print) (void *arg, const char *line), void *arg);
+
+struct usb_device;
+struct usb_device *adapter_usb_find (unsigned vid, unsigned pid, const char *id);
 
 void mdelay (unsigned msec);
 extern int debug_level;
@@ -284,3 +284,146 @@ void conf_parse (const char *filename, void (*pfunc) (char*, char*, char*))
     bufr = 0;
     bsize = 0;
 }
+
+/*
+ * Space or tab: unlike isspace(), does not step over the end of line.
+ */
+#define IS_BLANK(c) ((c) == ' ' || (c) == '\t')
+
+/*
+ * Compare parameter name at the start of line with given name.
+ * Case and amount of whitespace between words are ignored.
+ */
+static int match_parameter (const char *line, const char *name)
+{
+    while (IS_BLANK (*line))
+        line++;
+    while (*name) {
+        if (isspace (*name)) {
+            if (! IS_BLANK (*line))
+                return 0;
+            while (isspace (*name))
+                name++;
+            while (IS_BLANK (*line))
+                line++;
+            continue;
+        }
+        if (tolower (*line) != tolower (*name))
+            return 0;
+        line++;
+        name++;
+    }
+    while (IS_BLANK (*line))
+        line++;
+    return *line == '=';
+}
+
+/*
+ * Check whether the line is a header of given section.
+ * Return -1 when the line is not a section header at all.
+ */
+static int match_section (const char *line, const char *section)
+{
+    const char *end;
+    int len;
+
+    while (IS_BLANK (*line))
+        line++;
+    if (*line != '[')
+        return -1;
+    line++;
+    while (IS_BLANK (*line))
+        line++;
+    end = line + strcspn (line, "]\n");
+    if (*end != ']')
+        return -1;
+    while (end > line && IS_BLANK (end[-1]))
+        end--;
+    len = strlen (section);
+    return (end - line == len && strncasecmp (line, section, len) == 0);
+}
+
+/*
+ * Store a parameter into the given section of configuration file.
+ * Previous values of the parameter in this section are removed,
+ * new value is placed right after the section header.
+ * When the section is absent, it is appended to the end of file.
+ */
+void conf_store (const char *filename, const char *section,
+    const char *param, const char *value)
+{
+    FILE *fp;
+    char *text, *line, *next, *tmpname;
+    long len;
+    int in_section = 0, stored = 0, m;
+
+    fp = fopen (filename, "rb");
+    if (! fp) {
+        fprintf (stderr, "%s: unable to open config file\n", filename);
+        exit (-1);
+    }
+    fseek (fp, 0L, SEEK_END);
+    len = ftell (fp);
+    rewind (fp);
+    text = malloc (len + 1);
+    if (! text) {
+        fprintf (stderr, "%s: malloc failed\n", filename);
+        fclose (fp);
+        exit (-1);
+    }
+    len = fread (text, 1, len, fp);
+    text [len] = '\0';
+    fclose (fp);
+
+    /* Write a new copy and replace the file only when it is complete. */
+    tmpname = malloc (strlen (filename) + 5);
+    if (! tmpname) {
+        fprintf (stderr, "%s: malloc failed\n", filename);
+        exit (-1);
+    }
+    strcpy (tmpname, filename);
+    strcat (tmpname, ".tmp");
+    fp = fopen (tmpname, "wb");
+    if (! fp) {
+        fprintf (stderr, "%s: unable to write config file\n", tmpname);
+        exit (-1);
+    }
+    for (line=text; *line; line=next) {
+        next = strchr (line, '\n');
+        next = next ? next+1 : line + strlen (line);
+
+        m = match_section (line, section);
+        if (m >= 0)
+            in_section = m;
+        else if (in_section && match_parameter (line, param))
+            continue;
+
+        fwrite (line, 1, next - line, fp);
+        if (m > 0 && ! stored) {
+            if (next[-1] != '\n')
+                fputc ('\n', fp);
+            fprintf (fp, "        %s = %s\n", param, value);
+            stored = 1;
+        }
+    }
+    if (! stored) {
+        if (len > 0 && text [len-1] != '\n')
+            fputc ('\n', fp);
+        fprintf (fp, "\n[%s]\n        %s = %s\n", section, param, value);
+    }
+    if (ferror (fp) | fclose (fp)) {
+        fprintf (stderr, "%s: write error\n", tmpname);
+        remove (tmpname);
+        exit (-1);
+    }
+    if (rename (tmpname, filename) < 0) {
+        /* Windows does not replace an existing file. */
+        remove (filename);
+        if (rename (tmpname, filename) < 0) {
+            fprintf (stderr, "%s: unable to rename to %s\n", tmpname, filename);
+            exit (-1);
+        }
+    }
+    free (tmpname);
+    free (text);
+}
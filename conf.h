@@ -2,3 +2,9 @@
  * Parse configuration file.
  */
 void conf_parse (const char *filename, void (*pfunc) (char*, char*, char*));
+
+/*
+ * Store parameter value into a section of configuration file.
+ */
+void conf_store (const char *filename, const char *section,
+    const char *param, const char *value);
@@ -31,14 +31,17 @@
 #include <time.h>
 #include <libgen.h>
 #include <locale.h>
+#include <pthread.h>
 
 #include "target.h"
+#include "adapter.h"
 #include "conf.h"
 #include "swinfo.h"
 #include "localize.h"
 
 #define VERSION         "1.92"
 #define BLOCKSZ         1024
+#define CRC_CHUNK       (4*BLOCKSZ)     /* часть памяти с отдельной суммой */
 #define DEFAULT_ADDR    0xBFC00000
 
 /* Macros for converting between hex and binary. */
@@ -54,14 +57,39 @@ int disable_block = 0;
 int erase_mode = -1;
 int check_erase;
 int verify_only;
+int tune_clock;
+int show_stats;
+int crc_verify;
 int debug_level;
 target_t *target;
 char *progname;
 char *confname;
 char *board;
 char *board_serial = 0;
+char *adapter_spec = 0;
 const char *copyright;
 
+/*
+ * Групповое программирование: несколько плат через разные адаптеры,
+ * по одному потоку на адаптер. Образ памяти общий, только для чтения.
+ */
+typedef struct {
+    char        *spec;          /* описание адаптера */
+    target_t    *target;
+    pthread_t   thread;
+    int         failed;         /* ошибка проверки */
+    unsigned    error_addr;     /* где обнаружена ошибка */
+    unsigned    error_mem;      /* прочитанное значение */
+    unsigned    msec;           /* время работы */
+} gang_t;
+
+#define MAX_GANG        32
+
+gang_t gang [MAX_GANG];
+int gang_count;
+volatile int gang_running;
+char *record_file;              /* -R: запись обменов с адаптером */
+
 /*
  * Check heximal string
  */
@@ -429,6 +457,63 @@ void verify_block (target_t *mc, unsigned addr, int len)
     }
 }
 
+/*
+ * Проверка по контрольным суммам: процессор считает CRC32 каждой
+ * части записанной области, хост сравнивает их с суммами образа.
+ * В массиве bad отмечаются блоки, которые надо прочитать полностью.
+ * Если подсчёт на процессоре не удался, отмечаются все блоки.
+ */
+static unsigned char *crc_find_bad (target_t *mc)
+{
+    unsigned nbytes = (memory_len + 3) & ~3;
+    unsigned nchunks = (nbytes + CRC_CHUNK - 1) / CRC_CHUNK;
+    unsigned nblocks = (memory_len + BLOCKSZ - 1) / BLOCKSZ;
+    unsigned *crc, i, addr, len;
+    unsigned char *bad;
+
+    crc = malloc (nchunks * sizeof (unsigned));
+    bad = calloc (nblocks + 1, 1);
+    if (! crc || ! bad) {
+        fprintf (stderr, _("Out of memory\n"));
+        exit (-1);
+    }
+    if (! target_checksum (mc, memory_base, nbytes, CRC_CHUNK, crc)) {
+        memset (bad, 1, nblocks);
+    } else {
+        for (i=0; i<nchunks; i++) {
+            addr = i * CRC_CHUNK;
+            len = nbytes - addr;
+            if (len > CRC_CHUNK)
+                len = CRC_CHUNK;
+            if (target_crc32 (memory_data + addr, len) != crc[i])
+                memset (bad + addr / BLOCKSZ, 1, (len + BLOCKSZ - 1) / BLOCKSZ);
+        }
+    }
+    free (crc);
+    return bad;
+}
+
+/*
+ * Проверка всей записанной области: по контрольным суммам
+ * или чтением каждого блока.
+ */
+static void verify_all (target_t *mc)
+{
+    unsigned char *bad = crc_find_bad (mc);
+    unsigned addr;
+    int len;
+
+    for (addr=0; (int)addr<memory_len; addr+=BLOCKSZ) {
+        if (! bad [addr / BLOCKSZ])
+            continue;
+        len = BLOCKSZ;
+        if (memory_len - addr < len)
+            len = memory_len - addr;
+        verify_block (mc, addr, len);
+    }
+    free (bad);
+}
+
 void probe_flash (target_t *mc, unsigned base)
 {
     unsigned mfcode, devcode, bytes, width;
@@ -451,11 +536,38 @@ void probe_flash (target_t *mc, unsigned base)
         printf (_(", %d kbytes, %d bit wide\n"), bytes / 1024, width);
 }
 
+/*
+ * Печать строки статистики адаптера.
+ */
+static void print_stats_line (void *arg, const char *line)
+{
+    printf ("%s\n", line);
+}
+
 void quit (void)
 {
+    int i;
+
+    /* Пока работают потоки, платы не трогаем. */
+    if (! gang_running) {
+        for (i=0; i<gang_count; i++) {
+            if (gang[i].target) {
+                if (show_stats) {
+                    printf ("Board %d (%s):\n", i+1, gang[i].spec);
+                    target_report_stats (gang[i].target, print_stats_line, 0);
+                }
+                target_run (gang[i].target, start_addr);
+                target_close (gang[i].target);
+                free (gang[i].target);
+                gang[i].target = 0;
+            }
+        }
+    }
     if (target != 0) {
         if (start_addr != DEFAULT_ADDR)
             printf (_("Start: %08X\n"), start_addr);
+        if (show_stats)
+            target_report_stats (target, print_stats_line, 0);
         target_run (target, start_addr);
         target_close (target);
         free (target);
@@ -556,6 +668,15 @@ void configure_parameter (char *section, char *param, char *value)
         target_write_word (target, 0x182F900C, word);
         if (debug_level > 1)
             printf("GPIO_DR_MFBSP1=%08x (%s)(%08x)\n",word,value,target_read_word(target,0x182F900C));
+    } else if (strcasecmp (param, "jtag clock") == 0) {
+        /* Частота JTAG в МГц, либо auto для автоматического подбора. */
+        if (strcasecmp (value, "auto") == 0)
+            word = 0;
+        else
+            word = strtod (value, 0) * 1000 + 0.5;
+        word = target_set_clock (target, word);
+        if (word)
+            printf (_("JTAG clock: %g MHz\n"), word / 1000.0);
     } else if (strncasecmp (param, "flash ", 6) == 0) {
         if (sscanf (value, "%i-%i", &first, &last) != 2) {
             fprintf (stderr, _("%s: incorrect value for parameter `%s'\n"),
@@ -602,6 +723,24 @@ void configure ()
 #endif
     }
     conf_parse (confname, configure_parameter);
+
+    if (tune_clock) {
+        /* Подбираем частоту JTAG и запоминаем её для данной платы. */
+        unsigned khz = target_set_clock (target, 0);
+        char value [32];
+
+        if (! khz) {
+            printf (_("JTAG clock of this adapter is fixed\n"));
+            return;
+        }
+        if (! board) {
+            fprintf (stderr, _("%s: parameter 'default' missing\n"), confname);
+            exit (-1);
+        }
+        sprintf (value, "%g", khz / 1000.0);
+        printf (_("JTAG clock: %s MHz, saved to %s\n"), value, confname);
+        conf_store (confname, board, "jtag clock", value);
+    }
 }
 
 void do_probe ()
@@ -610,7 +749,7 @@ void do_probe ()
 
     /* Open and detect the device. */
     atexit (quit);
-    target = target_open (1, disable_block);
+    target = target_open_adapter (adapter_spec, 1, disable_block);
     if (! target) {
         fprintf (stderr, _("Error detecting device -- check cable!\n"));
         exit (1);
@@ -682,24 +821,17 @@ static int check_clean (target_t *t, unsigned addr)
     return 1;
 };
 
-void do_program (char *filename, int store_info)
+/*
+ * Запись длины, контрольной суммы и прочей информации
+ * о программе в образ памяти.
+ */
+void store_software_info (char *filename)
 {
-    unsigned addr;
-    unsigned mfcode, devcode, bytes, width;
-    char mfname[40], devname[40];
-    int len;
-    void *t0;
     sw_info *pinfo;
     sw_info zero_sw_info;
     struct stat file_stat;
+    int len;
 
-    if (erase_mode < 0)
-        erase_mode = 1; // default erase mode
-
-    printf (_("Memory: %08X-%08X, total %d bytes\n"), memory_base,
-        memory_base + memory_len, memory_len);
-
-    if (store_info) {
         /* Store length and checksum. */
     len = (memory_len < AREA_SIZE) ? (memory_len) : (AREA_SIZE);
         pinfo = find_info ((char *)memory_data, len);
@@ -728,11 +860,305 @@ void do_program (char *filename, int store_info)
 
     printf (_("\nLoaded software information:\n----------------------------\n"));
         print_board_info (pinfo);
+}
+
+/*
+ * Отличается ли часть памяти от образа. Сравниваются суммы CRC32,
+ * а если подсчёт на процессоре не удался - прочитанные данные.
+ */
+static int area_differs (target_t *mc, unsigned addr, unsigned nbytes)
+{
+    unsigned crc, n, block [BLOCKSZ/4];
+
+    if (target_checksum (mc, memory_base + addr, nbytes, nbytes, &crc))
+        return crc != target_crc32 (memory_data + addr, nbytes);
+
+    for (; nbytes > 0; addr += n, nbytes -= n) {
+        n = (nbytes < BLOCKSZ) ? nbytes : BLOCKSZ;
+        target_read_block (mc, memory_base + addr, n/4, block);
+        if (memcmp (block, memory_data + addr, n) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Инкрементальная запись (-e3): сектор стирается и записывается,
+ * только если его содержимое отличается от образа.
+ * Сектор, частично занятый образом, сначала читается целиком,
+ * чтобы сохранить данные вне образа.
+ */
+static void program_changed_sectors (target_t *mc)
+{
+    unsigned sector, bufsize = 0;
+    unsigned end = (memory_len + 3) & ~3;
+    unsigned saddr, lo, hi, addr, *buf = 0;
+    int len, nchanged = 0, nsectors = 0;
+    void *t0;
+
+    t0 = fix_time ();
+    for (saddr = memory_base; saddr < memory_base + end; saddr += sector) {
+        /* Секторы могут быть разного размера. */
+        sector = target_sector_size (mc, saddr);
+        saddr &= ~(sector - 1);
+        if (sector > bufsize) {
+            bufsize = sector;
+            buf = realloc (buf, bufsize);
+            if (! buf) {
+                fprintf (stderr, _("Out of memory\n"));
+                exit (-1);
+            }
+        }
+        /* Часть образа в этом секторе. */
+        lo = (saddr > memory_base) ? saddr - memory_base : 0;
+        hi = saddr + sector - memory_base;
+        if (hi > end)
+            hi = end;
+        nsectors++;
+        if (! area_differs (mc, lo, hi - lo))
+            continue;
+        nchanged++;
+
+        if (hi - lo < sector) {
+            target_read_block (mc, saddr, sector/4, buf);
+            memcpy ((char*) buf + (memory_base + lo - saddr),
+                memory_data + lo, hi - lo);
+            target_erase_sector (mc, saddr);
+            target_program_block (mc, saddr, sector/4, buf);
+        } else {
+            target_erase_sector (mc, saddr);
+            for (addr=lo; addr<hi; addr+=BLOCKSZ) {
+                len = (hi - addr < BLOCKSZ) ? hi - addr : BLOCKSZ;
+                program_block (mc, addr, len);
+            }
+        }
+        for (addr=lo; addr<hi; addr+=BLOCKSZ) {
+            len = (hi - addr < BLOCKSZ) ? hi - addr : BLOCKSZ;
+            verify_block (mc, addr, len);
+        }
+    }
+    free (buf);
+    printf (_("Changed: %d of %d sectors\n"), nchanged, nsectors);
+    printf (_("Rate: %ld bytes per second\n"),
+        memory_len * 1000L / mseconds_elapsed (t0));
+}
+
+/*
+ * Часть образа в одной области flash-памяти при одновременной
+ * записи нескольких областей.
+ */
+typedef struct {
+    target_t *ctx;              /* контекст со своей микросхемой */
+    unsigned lo, hi;            /* смещения части образа */
+    unsigned erase;             /* смещение стираемого сектора (-e2) */
+    unsigned addr;              /* смещение следующего блока записи */
+    int state;
+} region_job_t;
+
+enum {
+    JOB_ERASE,                  /* идёт стирание */
+    JOB_PROGRAM,                /* запись и проверка */
+    JOB_DONE,
+};
+
+/*
+ * Разбиение образа по областям flash-памяти.
+ * Возвращает число частей, или 0, если образ не покрыт
+ * областями целиком.
+ */
+static int split_regions (region_job_t *job)
+{
+    unsigned base, last, start, end, lo, hi, covered = 0;
+    int njobs = 0;
+
+    start = memory_base;
+    if (start >= 0xA0000000)
+        start -= 0xA0000000;
+    else if (start >= 0x80000000)
+        start -= 0x80000000;
+    end = start + memory_len;
+
+    base = ~0;
+    for (;;) {
+        base = target_flash_next (target, base, &last);
+        if (! ~base)
+            break;
+        lo = (start > base) ? start : base;
+        hi = (end < last + 1) ? end : last + 1;
+        if (lo >= hi)
+            continue;
+        job[njobs].lo = lo - start;
+        job[njobs].hi = hi - start;
+        covered += hi - lo;
+        njobs++;
+    }
+    if (covered != memory_len)
+        return 0;
+    return njobs;
+}
+
+/*
+ * Образ занимает несколько областей flash-памяти (например, boot
+ * и param на pkbi): стирание одной области идёт, пока записывается
+ * другая. Области обслуживаются по кругу, каждая через свой контекст.
+ * Возвращает 0, если образ в одной области.
+ */
+static int program_regions (void)
+{
+    region_job_t job [NFLASH];
+    unsigned mfcode, devcode, bytes, width, addr, size;
+    unsigned char *bad;
+    char mfname[40], devname[40];
+    int njobs, i, len, busy, worked, ready;
+    region_job_t *j;
+    void *t0;
+
+    njobs = split_regions (job);
+    if (njobs < 2)
+        return 0;
+
+    for (i=0; i<njobs; i++) {
+        j = &job[i];
+        j->ctx = target_flash_context (target);
+        if (! target_flash_detect (j->ctx, memory_base + j->lo,
+            &mfcode, &devcode, mfname, devname, &bytes, &width)) {
+            printf (_("No flash memory detected at %08X.\n"),
+                memory_base + j->lo);
+            exit (1);
+        }
+        printf (_("Flash at %08X: %s %s"), memory_base + j->lo,
+            mfname, devname);
+        if (bytes % (1024*1024) == 0)
+            printf (_(", size %d Mbytes, %d bit wide\n"), bytes / 1024 / 1024, width);
+        else
+            printf (_(", size %d kbytes, %d bit wide\n"), bytes / 1024, width);
+    }
+
+    /* Запускаем стирание всех областей сразу. */
+    for (i=0; i<njobs; i++) {
+        j = &job[i];
+        j->addr = j->lo;
+        j->erase = j->lo;
+        j->state = JOB_PROGRAM;
+        if (erase_mode == 0 ||
+            (check_erase && check_clean (j->ctx, memory_base + j->lo)))
+            continue;
+        if (! target_erase_start (j->ctx, memory_base + j->lo,
+            erase_mode == 2)) {
+            /* Micron: стирание только с ожиданием. */
+            if (erase_mode == 1)
+                target_erase (j->ctx, memory_base + j->lo);
+            else
+                target_erase_area (j->ctx, memory_base + j->lo, j->hi - j->lo);
+            continue;
+        }
+        printf (_("Erase: %08X started\n"), memory_base + j->lo);
+        j->state = JOB_ERASE;
+    }
+
+    for (progress_step=1; ; progress_step<<=1) {
+        len = 1 + memory_len / progress_step / BLOCKSZ;
+        if (len < 64)
+            break;
+    }
+    printf (_("Program: "));
+    print_symbols ('.', len);
+    print_symbols ('\b', len);
+    fflush (stdout);
+
+    progress_count = 0;
+    t0 = fix_time ();
+    do {
+        busy = worked = 0;
+        for (i=0; i<njobs; i++) {
+            j = &job[i];
+            switch (j->state) {
+            case JOB_ERASE:
+                busy = 1;
+                ready = target_erase_poll (j->ctx);
+                if (ready < 0)
+                    exit (1);
+                if (! ready)
+                    break;
+                worked = 1;
+                if (erase_mode == 2) {
+                    /* Следующий сектор этой области. */
+                    addr = memory_base + j->erase;
+                    size = target_sector_size (j->ctx, addr);
+                    j->erase += size - (addr & (size - 1));
+                    if (j->erase < j->hi) {
+                        target_erase_start (j->ctx, memory_base + j->erase, 1);
+                        break;
+                    }
+                }
+                j->state = JOB_PROGRAM;
+                break;
+
+            case JOB_PROGRAM:
+                busy = worked = 1;
+                len = BLOCKSZ;
+                if (j->hi - j->addr < len)
+                    len = j->hi - j->addr;
+                program_block (j->ctx, j->addr, len);
+                progress ();
+                if (! crc_verify)
+                    verify_block (j->ctx, j->addr, len);
+                j->addr += len;
+                if (j->addr >= j->hi)
+                    j->state = JOB_DONE;
+                break;
+            }
+        }
+        if (busy && ! worked) {
+            /* Все области заняты стиранием. */
+            mdelay (1);
+        }
+    } while (busy);
+
+    if (crc_verify) {
+        /* Суммы считаются по всему образу, а блоки с ошибкой
+         * читаются и переписываются через контекст своей области. */
+        bad = crc_find_bad (target);
+        for (i=0; i<njobs; i++) {
+            j = &job[i];
+            for (addr=j->lo; addr<j->hi; addr+=len) {
+                len = BLOCKSZ;
+                if (j->hi - addr < len)
+                    len = j->hi - addr;
+                if (bad [addr / BLOCKSZ] || bad [(addr + len - 1) / BLOCKSZ])
+                    verify_block (j->ctx, addr, len);
+            }
+        }
+        free (bad);
     }
+    for (i=0; i<njobs; i++)
+        target_flash_context_free (target, job[i].ctx);
+    printf (_("# done\n"));
+    printf (_("Rate: %ld bytes per second\n"),
+        memory_len * 1000L / mseconds_elapsed (t0));
+    return 1;
+}
+
+void do_program (char *filename, int store_info)
+{
+    unsigned addr;
+    unsigned mfcode, devcode, bytes, width;
+    char mfname[40], devname[40];
+    int len;
+    void *t0;
+
+    if (erase_mode < 0)
+        erase_mode = 1; // default erase mode
+
+    printf (_("Memory: %08X-%08X, total %d bytes\n"), memory_base,
+        memory_base + memory_len, memory_len);
+
+    if (store_info)
+        store_software_info (filename);
 
     /* Open and detect the device. */
     atexit (quit);
-    target = target_open (1, disable_block);
+    target = target_open_adapter (adapter_spec, 1, disable_block);
     if (! target) {
         fprintf (stderr, _("Error detecting device -- check cable!\n"));
         exit (1);
@@ -741,6 +1167,9 @@ void do_program (char *filename, int store_info)
     printf (_("Processor: %s\n"), target_cpu_name (target));
 
     configure ();
+    if (! verify_only && erase_mode != 3 && program_regions ())
+        return;
+
     if (! target_flash_detect (target, memory_base,
         &mfcode, &devcode, mfname, devname, &bytes, &width)) {
         printf (_("No flash memory detected.\n"));
@@ -752,6 +1181,10 @@ void do_program (char *filename, int store_info)
     else
         printf (_(", size %d kbytes, %d bit wide\n"), bytes / 1024, width);
 
+    if (erase_mode == 3 && ! verify_only) {
+        program_changed_sectors (target);
+        return;
+    }
     if (! verify_only) {
         /* Erase flash. */
         if (! check_erase || ! check_clean (target, memory_base)) {
@@ -780,13 +1213,175 @@ void do_program (char *filename, int store_info)
         if (! verify_only)
             program_block (target, addr, len);
         progress ();
-        verify_block (target, addr, len);
+        if (! crc_verify)
+            verify_block (target, addr, len);
     }
+    if (crc_verify)
+        verify_all (target);
     printf (_("# done\n"));
     printf (_("Rate: %ld bytes per second\n"),
         memory_len * 1000L / mseconds_elapsed (t0));
 }
 
+/*
+ * Проверка блока без вывода на экран. При ошибке возвращаем 0.
+ */
+static int gang_verify_block (gang_t *g, unsigned addr, int len)
+{
+    unsigned i, word, expected, block [BLOCKSZ/4];
+    int try;
+
+    target_read_block (g->target, memory_base + addr, (len+3)/4, block);
+    for (i=0; i<len; i+=4) {
+        expected = *(unsigned*) (memory_data + addr + i);
+        word = block [i/4];
+        for (try=0; word != expected; try++) {
+            if (verify_only || try > 3 || ! target_flash_rewrite (g->target,
+                memory_base + addr + i, word, expected)) {
+                g->error_addr = memory_base + addr + i;
+                g->error_mem = word;
+                return 0;
+            }
+            word = target_read_word (g->target, memory_base + addr + i);
+        }
+    }
+    return 1;
+}
+
+static void *gang_worker (void *arg)
+{
+    gang_t *g = arg;
+    struct timeval t0, t1;
+    unsigned addr;
+    int len;
+
+    gettimeofday (&t0, 0);
+    if (! verify_only) {
+        if (erase_mode == 1)
+            target_erase (g->target, memory_base);
+        else if (erase_mode == 2)
+            target_erase_area (g->target, memory_base, memory_len);
+    }
+    for (addr=0; (int)addr<memory_len; addr+=BLOCKSZ) {
+        len = BLOCKSZ;
+        if (memory_len - addr < len)
+            len = memory_len - addr;
+        if (! verify_only)
+            program_block (g->target, addr, len);
+        if (! crc_verify && ! gang_verify_block (g, addr, len)) {
+            g->failed = 1;
+            break;
+        }
+    }
+    if (crc_verify) {
+        unsigned char *bad = crc_find_bad (g->target);
+
+        for (addr=0; (int)addr<memory_len; addr+=BLOCKSZ) {
+            len = BLOCKSZ;
+            if (memory_len - addr < len)
+                len = memory_len - addr;
+            if (bad [addr / BLOCKSZ] && ! gang_verify_block (g, addr, len)) {
+                g->failed = 1;
+                break;
+            }
+        }
+        free (bad);
+    }
+    gettimeofday (&t1, 0);
+    g->msec = (t1.tv_sec - t0.tv_sec) * 1000 +
+        (t1.tv_usec - t0.tv_usec) / 1000;
+    return 0;
+}
+
+void do_gang_program (char *filename, int store_info)
+{
+    unsigned mfcode, devcode, bytes, width;
+    char mfname[40], devname[40];
+    gang_t *g;
+    int nfailed;
+
+    if (erase_mode < 0)
+        erase_mode = 1; // default erase mode
+    if (erase_mode == 3) {
+        fprintf (stderr, _("Mode -e3 is not supported for several adapters\n"));
+        exit (1);
+    }
+
+    printf (_("Memory: %08X-%08X, total %d bytes\n"), memory_base,
+        memory_base + memory_len, memory_len);
+
+    if (store_info)
+        store_software_info (filename);
+
+    /* Открываем и настраиваем все адаптеры по очереди. */
+    atexit (quit);
+    for (g=gang; g<gang+gang_count; g++) {
+        printf (_("\nAdapter %s:\n"), g->spec);
+        if (record_file) {
+            /* Каждой плате свой файл записи: имя.1, имя.2 и т.д. */
+            char *name = malloc (strlen (record_file) + 8);
+            if (! name) {
+                fprintf (stderr, _("Out of memory\n"));
+                exit (-1);
+            }
+            sprintf (name, "%s.%d", record_file, (int) (g - gang) + 1);
+            target_record (name);
+            printf (_("Recording to %s\n"), name);
+        }
+        g->target = target_open_adapter (g->spec, 1, disable_block);
+        if (! g->target) {
+            fprintf (stderr, _("Error detecting device -- check cable!\n"));
+            exit (1);
+        }
+        target_stop (g->target);
+        printf (_("Processor: %s\n"), target_cpu_name (g->target));
+
+        target = g->target;
+        configure ();
+        target = 0;
+        if (! target_flash_detect (g->target, memory_base,
+            &mfcode, &devcode, mfname, devname, &bytes, &width)) {
+            printf (_("No flash memory detected.\n"));
+            exit (1);
+        }
+        printf (_("Flash: %s %s"), mfname, devname);
+        if (bytes % (1024*1024) == 0)
+            printf (_(", size %d Mbytes, %d bit wide\n"), bytes / 1024 / 1024, width);
+        else
+            printf (_(", size %d kbytes, %d bit wide\n"), bytes / 1024, width);
+    }
+
+    printf (verify_only ? _("\nVerify %d boards...\n") :
+        _("\nProgram %d boards...\n"), gang_count);
+    gang_running = 1;
+    for (g=gang; g<gang+gang_count; g++) {
+        if (pthread_create (&g->thread, 0, gang_worker, g) != 0) {
+            fprintf (stderr, _("%s: cannot create thread\n"), g->spec);
+            exit (1);
+        }
+    }
+    for (g=gang; g<gang+gang_count; g++)
+        pthread_join (g->thread, 0);
+    gang_running = 0;
+
+    nfailed = 0;
+    for (g=gang; g<gang+gang_count; g++) {
+        if (g->failed) {
+            nfailed++;
+            printf (_("%s: error at address %08X: file=%08X, mem=%08X\n"),
+                g->spec, g->error_addr,
+                *(unsigned*) (memory_data + g->error_addr - memory_base),
+                g->error_mem);
+        } else
+            printf (_("%s: done, rate %ld bytes per second\n"), g->spec,
+                memory_len * 1000L / (g->msec ? g->msec : 1));
+    }
+    if (nfailed) {
+        printf (_("%d of %d boards failed\n"), nfailed, gang_count);
+        exit (1);
+    }
+}
+
 void do_write ()
 {
     unsigned addr;
@@ -798,7 +1393,7 @@ void do_write ()
 
     /* Open and detect the device. */
     atexit (quit);
-    target = target_open (1, disable_block);
+    target = target_open_adapter (adapter_spec, 1, disable_block);
     if (! target) {
         fprintf (stderr, _("Error detecting device -- check cable!\n"));
         exit (1);
@@ -826,8 +1421,11 @@ void do_write ()
         if (! verify_only)
             write_block (target, addr, len);
         progress ();
-        verify_block (target, addr, len);
+        if (! crc_verify)
+            verify_block (target, addr, len);
     }
+    if (crc_verify)
+        verify_all (target);
     printf (_("# done\n"));
     printf (_("Rate: %ld bytes per second\n"),
         memory_len * 1000L / mseconds_elapsed (t0));
@@ -851,7 +1449,7 @@ void do_read (char *filename)
 
     /* Open and detect the device. */
     atexit (quit);
-    target = target_open (1, disable_block);
+    target = target_open_adapter (adapter_spec, 1, disable_block);
     if (! target) {
         fprintf (stderr, _("Error detecting device -- check cable!\n"));
         exit (1);
@@ -908,7 +1506,7 @@ void do_erase ()
 
     /* Open and detect the device. */
     atexit (quit);
-    target = target_open (1, disable_block);
+    target = target_open_adapter (adapter_spec, 1, disable_block);
     if (! target) {
         fprintf (stderr, _("Error detecting device -- check cable!\n"));
         exit (1);
@@ -938,7 +1536,7 @@ void do_check_clean ()
 
     /* Open and detect the device. */
     atexit (quit);
-    target = target_open (1, disable_block);
+    target = target_open_adapter (adapter_spec, 1, disable_block);
     if (! target) {
         fprintf (stderr, _("Error detecting device -- check cable!\n"));
         exit (1);
@@ -965,7 +1563,7 @@ void do_info()
 {
     sw_info *pinfo;
 
-    target = target_open (1, disable_block);
+    target = target_open_adapter (adapter_spec, 1, disable_block);
     if (! target) {
         fprintf (stderr, _("Error detecting device -- check cable!\n"));
         exit (1);
@@ -1035,6 +1633,39 @@ static void gpl_show_warranty (void)
     printf("\n");
 }
 
+/*
+ * Адаптеры для групповой записи должны быть разными: описание
+ * без id или повторённое описание открыло бы одно и то же
+ * устройство из нескольких потоков. Модели (sim, replay)
+ * независимы и проверки не требуют.
+ */
+static int gang_check_specs (void)
+{
+    const char *id;
+    int i, k, len;
+
+    for (i=0; i<gang_count; i++) {
+        id = strchr (gang[i].spec, ':');
+        len = id ? id - gang[i].spec : strlen (gang[i].spec);
+        if ((len == 3 && strncasecmp (gang[i].spec, "sim", 3) == 0) ||
+            (len == 6 && strncasecmp (gang[i].spec, "replay", 6) == 0))
+            continue;
+        if ((! id || ! id[1]) &&
+            ! (len == 3 && strncasecmp (gang[i].spec, "lpt", 3) == 0)) {
+            fprintf (stderr, _("Adapter `%s': serial number or USB path needed for several adapters\n"),
+                gang[i].spec);
+            return 0;
+        }
+        for (k=0; k<i; k++) {
+            if (strcasecmp (gang[k].spec, gang[i].spec) == 0) {
+                fprintf (stderr, _("Adapter `%s' is given twice\n"), gang[i].spec);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
 int main (int argc, char **argv)
 {
     int ch, read_mode = 0, memory_write_mode = 0, info_mode = 0, store_info = 0;
@@ -1044,6 +1675,9 @@ int main (int argc, char **argv)
         { "warranty",    0, 0, 'W' },
         { "copying",     0, 0, 'C' },
         { "version",     0, 0, 'V' },
+        { "stats",       0, 0, 'S' },
+        { "loader",      0, 0, 'L' },
+        { "crc",         0, 0, 'K' },
         { NULL,          0, 0, 0 },
     };
 
@@ -1072,7 +1706,7 @@ int main (int argc, char **argv)
 #endif
     signal (SIGTERM, interrupted);
 
-    while ((ch = getopt_long (argc, argv, "vDhriwb:sn:cg:CVWe:d",
+    while ((ch = getopt_long (argc, argv, "vDhriwb:sn:cg:CVWe:dTa:R:",
       long_options, 0)) != -1) {
         switch (ch) {
         case 'E':
@@ -1080,7 +1714,7 @@ int main (int argc, char **argv)
             continue;
         case 'e':
             erase_mode=strtoul (optarg, 0, 0);
-            if (erase_mode < 0 || erase_mode > 2)
+            if (erase_mode < 0 || erase_mode > 3)
                 break;
             continue;
         case 'c':
@@ -1116,6 +1750,29 @@ int main (int argc, char **argv)
         case 'd':
             ++disable_block;
             continue;
+        case 'T':
+            ++tune_clock;
+            continue;
+        case 'a':
+            if (gang_count >= MAX_GANG) {
+                fprintf (stderr, _("Too many adapters, max %d\n"), MAX_GANG);
+                return -1;
+            }
+            gang[gang_count++].spec = optarg;
+            continue;
+        case 'R':
+            record_file = optarg;
+            target_record (optarg);
+            continue;
+        case 'S':
+            ++show_stats;
+            continue;
+        case 'L':
+            target_flash_loader (1);
+            continue;
+        case 'K':
+            ++crc_verify;
+            continue;
         case 'h':
             break;
         case 'V':
@@ -1137,9 +1794,9 @@ usage:
         printf ("Probe:\n");
         printf ("       mcprog\n");
         printf ("\nWrite flash memory:\n");
-        printf ("       mcprog [-v][-e0,-e1,-e2] file.srec\n");
-        printf ("       mcprog [-v][-e0,-e1,-e2] file.hex\n");
-        printf ("       mcprog [-v][-e0,-e1,-e2] file.bin [address]\n");
+        printf ("       mcprog [-v][-e0,-e1,-e2,-e3] file.srec\n");
+        printf ("       mcprog [-v][-e0,-e1,-e2,-e3] file.hex\n");
+        printf ("       mcprog [-v][-e0,-e1,-e2,-e3] file.bin [address]\n");
         printf ("\nWrite static memory:\n");
         printf ("       mcprog -w [-v] [-g address] file.srec\n");
         printf ("       mcprog -w [-v] [-g address] file.hex\n");
@@ -1159,16 +1816,27 @@ usage:
         printf ("       -c                  Check clean\n");
         printf ("       -e erase            Erase mode\n");
         printf ("                           (0 - do not erase, 1 (default) - erase chip,\n");
-        printf ("                            2 - erase only place for programmed file)\n");
+        printf ("                            2 - erase only place for programmed file,\n");
+        printf ("                            3 - rewrite only sectors that differ from file)\n");
         printf ("       -v                  Verify only\n");
         printf ("       -w                  Memory write mode\n");
         printf ("       -r                  Read mode\n");
         printf ("       -i                  Read software information\n");
         printf ("       -b type             Specify board type\n");
+        printf ("       -a type[:id]        Select adapter: usb, mpsse, bitbang, lpt, sim or replay,\n");
+        printf ("                           id is serial number or bus/device path;\n");
+        printf ("                           repeat to program several boards at once\n");
+        printf ("       -R file             Record adapter traffic to file,\n");
+        printf ("                           play it back with -a replay:file\n");
+        printf ("       --stats             Print adapter statistics and timing\n");
+        printf ("       --loader            Program flash by a routine running from CRAM\n");
+        printf ("       --crc               Verify by CRC32 computed on the target,\n");
+        printf ("                           read back only mismatching blocks\n");
         printf ("       -s                  Compute and store software information\n");
         printf ("       -n serial           Specify board serial number\n");
         printf ("       -g addr             Start execution from address\n");
         printf ("       -d                  Disable block mode (only for Elvees USB JTAG adapter)\n");
+        printf ("       -T                  Tune JTAG clock and save it for the board\n");
         printf ("       -D                  Debug mode\n");
         printf ("       -h, --help          Print this help message\n");
         printf ("       -V, --version       Print version\n");
@@ -1181,6 +1849,19 @@ usage:
     argc -= optind;
     argv += optind;
 
+    if (gang_count == 1) {
+        /* Один адаптер - обычный режим. */
+        adapter_spec = gang[0].spec;
+        gang_count = 0;
+    } else if (gang_count > 1 && (argc < 1 || argc > 2 || read_mode ||
+        info_mode || memory_write_mode || (erase_mode == 1 && argc == 1) ||
+        check_erase)) {
+        fprintf (stderr, _("Several adapters are allowed only for flash programming\n"));
+        return -1;
+    } else if (gang_count > 1 && ! gang_check_specs ()) {
+        return -1;
+    }
+
     switch (argc) {
     case 0:
         if (info_mode) {
@@ -1218,6 +1899,8 @@ usage:
                 do_info();
             else if (memory_write_mode)
                 do_write ();
+            else if (gang_count > 1)
+                do_gang_program (argv[0], store_info);
             else
                 do_program (argv[0], store_info);
         }
@@ -1227,6 +1910,8 @@ usage:
         memory_len = read_bin (argv[0], memory_data);
         if (memory_write_mode)
             do_write ();
+        else if (gang_count > 1)
+            do_gang_program (argv[0], store_info);
         else
             do_program (argv[0], store_info);
         break;
@@ -21,15 +21,21 @@
 #define	MIPS_JAL	(0x3 << 26)	/* jal 0; jump and link */
 #define	MIPS_ADD	0x20		/* add rd, rs, rt */
 #define	MIPS_ADDI	(0x8 << 26)	/* addi rt << 16, rs << 21, imed */
-#define	MIPS_ADDIU	(0x8 << 26)	/* addiu rt << 16, rs << 21, imed */
+#define	MIPS_ADDIU	(0x9 << 26)	/* addiu rt << 16, rs << 21, imed */
+#define	MIPS_ADDU	0x21		/* addu rd << 11, rs << 21, rt << 16 */
+#define	MIPS_BEQ	(0x4 << 26)	/* beq rs << 21, rt << 16, offset */
+#define	MIPS_BNE	(0x5 << 26)	/* bne rs << 21, rt << 16, offset */
 #define MIPS_MFHI	0x10		/* mfhi, (rd << 11) */
 #define MIPS_MFLO	0x12		/* mflo, (rd << 11) */
 #define MIPS_MTHI	0x11		/* mthi, (rd << 21) */
 #define MIPS_MTLO	0x13		/* mtlo, (rd << 21) */
 #define MIPS_SLL	0x0		/* sll dest << 11, src << 16, sa << 6 */
-#define MIPS_SRL	(0x0 | 0x3)	/* srl dest << 11, src << 16, sa << 6 */
+#define MIPS_SRL	0x2		/* srl dest << 11, src << 16, sa << 6 */
 #define MIPS_NOP	MIPS_SLL	/* nop (SLL, r0, r0, 0) */
 #define	MIPS_OR		37		/* add rd, rs, rt */
+#define	MIPS_XOR	0x26		/* xor rd, rs, rt */
+#define	MIPS_NOR	0x27		/* nor rd, rs, rt */
+#define	MIPS_ANDI	(0xc << 26)	/* andi rt << 16, rs << 21, imed */
 #define MIPS_ORI	(0xd << 26)	/* ori rt << 16, rs << 21, imed */
 #define MIPS_MFC0	(0x10 << 26)	/* mfc0 rt << 16, rd << 11, sel */
 #define MIPS_MTC0	((0x10<<26)|(4<<21))/* mtc0 rt << 16, rd << 11, sel */
@@ -183,8 +183,11 @@ static int elvees_open(int argc,
     static struct option long_options[] =
     {
         /* Options setting flag */
+        {"adapter", 1, 0, 'a'},
+        {"record", 1, 0, 'R'},
         {NULL, 0, 0, 0}
     };
+    static const char *adapter_spec;
 
     assert (prog_name != NULL);
     assert (log_fn != NULL);
@@ -201,13 +204,21 @@ static int elvees_open(int argc,
         int c;
         int option_index;
 
-        c = getopt_long(argc, argv, "+", long_options, &option_index);
+        c = getopt_long(argc, argv, "+a:R:", long_options, &option_index);
         if (c == EOF)
             break;
         switch (c) {
         case 0:
             /* Long option which just sets a flag */
             break;
+        case 'a':
+            /* Adapter selection: type[:serial or bus/device] */
+            adapter_spec = optarg;
+            break;
+        case 'R':
+            /* Record adapter traffic to file */
+            target_record (optarg);
+            break;
         default:
             target.log(RP_VAL_LOGLEVEL_NOTICE,
                                 "%s: Use `%s --help' to see a complete list of options",
@@ -226,7 +237,7 @@ static int elvees_open(int argc,
     if (! target.device) {
         /* Если первый раз - соединяемся с адаптером.
          * Не надо давать SYSRST процессору! */
-        target.device = target_open (0, 0);
+        target.device = target_open_adapter (adapter_spec, 0, 0);
         if (! target.device) {
             target.log(RP_VAL_LOGLEVEL_ERR,
                             "%s: failed to initialize JTAG adapter",
@@ -873,12 +884,39 @@ static int elvees_rcmd_erase(int argc, char *argv[], out_func of, data_func df)
     return RP_VAL_TARGETRET_OK;
 }
 
+/* Output one line of adapter statistics */
+static void stats_line (void *arg, const char *line)
+{
+    out_func of = *(out_func*) arg;
+    char buf[2*256 + 2 + 1];
+    char str[256 + 1 + 1];
+
+    snprintf(str, sizeof(str), "%s\n", line);
+    tohex(buf, str);
+    of(buf);
+}
+
+/* command: adapter statistics */
+static int elvees_rcmd_stats(int argc, char *argv[], out_func of, data_func df)
+{
+    char buf[1000 + 1];
+
+    if (! target.device) {
+        tohex(buf, "Target not connected\n");
+        of(buf);
+        return RP_VAL_TARGETRET_OK;
+    }
+    target_report_stats (target.device, stats_line, &of);
+    return RP_VAL_TARGETRET_OK;
+}
+
 /* Table of commands */
 static const RCMD_TABLE remote_commands[] =
 {
     RCMD(help,      "This help text"),
 
     RCMD(erase,     "Erase target flash memory"),
+    RCMD(stats,     "Print JTAG adapter statistics and timing"),
     {0,0,0}     //sentinel, end of table marker
 };
 
@@ -20,6 +20,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/time.h>
 
 #include "target.h"
 #include "adapter.h"
@@ -27,6 +28,29 @@
 #include "mips.h"
 #include "localize.h"
 
+/*
+ * Виды ожидания готовности, для статистики и тайм-аутов.
+ */
+enum {
+    WAIT_MEMORY,            /* RDYm при работающем процессоре */
+    WAIT_PROGRAM,           /* запись во flash */
+    WAIT_ERASE_SECTOR,      /* стирание сектора */
+    WAIT_ERASE_CHIP,        /* стирание микросхемы */
+    WAIT_CHECKSUM,          /* подсчёт контрольной суммы */
+    WAIT_NKINDS
+};
+
+/* Областей секторов в таблице CFI, не больше. */
+#define CFI_MAX_REGIONS 4
+
+typedef struct {
+    unsigned long count;
+    unsigned long timeouts;
+    unsigned long errors;
+    unsigned long long total_us;
+    unsigned max_us;
+} wait_stats_t;
+
 struct _target_t {
     adapter_t   *adapter;
     const char  *cpu_name;
@@ -43,6 +67,8 @@ struct _target_t {
     unsigned    flash_cmd_55;
     unsigned    flash_cmd_10;
     unsigned    flash_cmd_20;
+    unsigned    flash_cmd_25;
+    unsigned    flash_cmd_29;
 	unsigned    flash_cmd_30;
     unsigned    flash_cmd_80;
     unsigned    flash_cmd_90;
@@ -53,6 +79,33 @@ struct _target_t {
     unsigned    flash_last [NFLASH];
     unsigned    flash_delay;
     int         micron_com_set;
+    int         flash_bypass;   /* поддерживается unlock bypass */
+    int         flash_dq5;      /* DQ5 сообщает о превышении времени */
+    unsigned    nb_rewrites;
+    int         use_loader;     /* запись flash программой из CRAM */
+
+    /* Максимальные времена операций flash по документации. */
+    unsigned    program_us;
+    unsigned    erase_sector_ms;
+    unsigned    erase_chip_ms;
+    wait_stats_t wait [WAIT_NKINDS];
+
+    /* Первая пауза опроса по типичному времени из CFI, мксек. */
+    unsigned    poll_start_us [WAIT_NKINDS];
+
+    /* Карта секторов по CFI: области одинаковых секторов,
+     * от младших адресов. Размеры с учётом ширины шины. */
+    int         nregions;
+    struct {
+        unsigned count;
+        unsigned size;
+    } region [CFI_MAX_REGIONS];
+    unsigned    write_buffer_words;     /* буфер записи, слов; 0 - нет */
+
+    /* Стирание, запущенное target_erase_start(). */
+    unsigned    erase_addr;
+    int         erase_kind;
+    unsigned long long erase_t0;
 
     unsigned    pc_fetch, pc_dec, ir_dec, pc_exec;
     unsigned    mem0;
@@ -102,6 +155,10 @@ struct _target_t {
 #define FLASH_CMD8_10   0x10101010
 #define FLASH_CMD16_20  0x00200020  /* Unlock bypass */
 #define FLASH_CMD8_20   0x20202020
+#define FLASH_CMD16_25  0x00250025  /* Write to buffer */
+#define FLASH_CMD8_25   0x25252525
+#define FLASH_CMD16_29  0x00290029  /* Program buffer to flash */
+#define FLASH_CMD8_29   0x29292929
 #define FLASH_CMD16_30	0x00300030	/* Sector erase */
 #define FLASH_CMD8_30	0x30303030
 #define FLASH_CMD16_80  0x00800080  /* Chip erase 1/2 */
@@ -123,6 +180,9 @@ struct _target_t {
 
 #define CRAM_ADDR   0xb8000000
 #define BOOT_ADDR   0xbfc00000
+
+/* Слов в пачке чтения без блочной операции адаптера. */
+#define READ_BATCH_WORDS 64
 #define GP          28
 #define FP          30
 
@@ -147,25 +207,333 @@ void mdelay (unsigned msec)
 #endif
 
 /*
- * Выполнение одной инструкции MIPS32.
+ * Задержка в микросекундах.
  */
-static void target_exec (target_t *t, unsigned instr)
+static void udelay (unsigned usec)
+{
+#if defined (__CYGWIN32__) || defined (MINGW32)
+    Sleep ((usec + 999) / 1000);
+#else
+    usleep (usec);
+#endif
+}
+
+static unsigned long long time_usec (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, 0);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/*
+ * Ожидание готовности с опросом.
+ * Пауза между опросами начинается с POLL_START_US (или с половины
+ * типичного времени операции по CFI) и растёт в полтора раза,
+ * до POLL_MAX_US. Так быстрые операции не ждут лишнего,
+ * а долгие не загружают адаптер опросами.
+ * Время ожидания учитывается в статистике.
+ * Функция проверки возвращает 1 при готовности, 0 - ещё занято,
+ * -1 - устройство сообщило об ошибке, ждать дальше бесполезно.
+ * Возвращает 0 при тайм-ауте или ошибке.
+ */
+#define POLL_START_US   20
+#define POLL_MAX_US     20000
+#define POLL_MARGIN_US  10000   /* запас на задержки в системе */
+#define POLL_DOT_US     250000  /* точка на экране при стирании */
+
+/*
+ * Отложенные обращения к регистрам OnCD.
+ * Если адаптер не поддерживает очередь транзакций,
+ * обращение выполняется сразу.
+ */
+static void oncd_queue_write (target_t *t, unsigned val, int reg, int nbits)
+{
+    if (t->adapter->oncd_queue_write)
+        t->adapter->oncd_queue_write (t->adapter, val, reg, nbits);
+    else
+        t->adapter->oncd_write (t->adapter, val, reg, nbits);
+}
+
+static void oncd_queue_read (target_t *t, int reg, int nbits, unsigned *result)
+{
+    if (t->adapter->oncd_queue_read)
+        t->adapter->oncd_queue_read (t->adapter, reg, nbits, result);
+    else
+        *result = t->adapter->oncd_read (t->adapter, reg, nbits);
+}
+
+static void oncd_flush (target_t *t)
+{
+    if (t->adapter->oncd_flush)
+        t->adapter->oncd_flush (t->adapter);
+}
+
+typedef int (*poll_check_t) (target_t *t, void *arg);
+
+static int poll_account (target_t *t, int kind, unsigned elapsed, int ready);
+
+static int target_poll (target_t *t, int kind, unsigned timeout_us,
+    poll_check_t check, void *arg, int dots)
+{
+    unsigned long long t0 = time_usec ();
+    unsigned delay, elapsed, next_dot = POLL_DOT_US;
+    int ready;
+
+    delay = t->poll_start_us[kind] ? t->poll_start_us[kind] : POLL_START_US;
+
+    timeout_us += POLL_MARGIN_US;
+    for (;;) {
+        ready = check (t, arg);
+        elapsed = time_usec () - t0;
+        if (ready || elapsed >= timeout_us)
+            break;
+        if (dots && elapsed >= next_dot) {
+            printf (".");
+            fflush (stdout);
+            next_dot += POLL_DOT_US;
+        }
+        udelay (delay);
+        delay += delay / 2;
+        if (delay > POLL_MAX_US)
+            delay = POLL_MAX_US;
+    }
+    return poll_account (t, kind, elapsed, ready);
+}
+
+/*
+ * Учёт законченного ожидания в статистике.
+ */
+static int poll_account (target_t *t, int kind, unsigned elapsed, int ready)
+{
+    wait_stats_t *ws = &t->wait[kind];
+
+    ws->count++;
+    ws->total_us += elapsed;
+    if (elapsed > ws->max_us)
+        ws->max_us = elapsed;
+    if (ready < 0) {
+        ws->errors++;
+        return 0;
+    }
+    if (! ready)
+        ws->timeouts++;
+    return ready;
+}
+
+/*
+ * Проверка бита RDYm в регистре OSCR.
+ */
+static int check_rdym (target_t *t, void *arg)
+{
+    t->adapter->oscr = t->adapter->oncd_read (t->adapter, OnCD_OSCR, 32);
+    t->adapter->stats.rdym_polls++;
+    return (t->adapter->oscr & OSCR_RDYm) != 0;
+}
+
+/*
+ * Ожидание готовности flash: при необходимости записываем команду
+ * (например, чтение статуса) и сравниваем прочитанное слово с образцом.
+ */
+typedef struct {
+    unsigned addr;
+    unsigned cmd;
+    unsigned value;
+    int write_cmd;
+} flash_poll_t;
+
+static int check_flash (target_t *t, void *arg)
+{
+    flash_poll_t *p = arg;
+
+    if (p->write_cmd)
+        target_write_word (t, p->addr, p->cmd);
+    return target_read_word (t, p->addr) == p->value;
+}
+
+/*
+ * Состояние встроенного алгоритма микросхем AMD/SST.
+ * Пока идёт запись или стирание, бит DQ6 меняется при каждом
+ * чтении, а DQ7 инверсен записываемым данным. Когда DQ6 перестал
+ * меняться, операция закончена: если данные не совпали, запись
+ * не удалась. У AMD DQ5=1 при меняющемся DQ6 означает превышение
+ * внутреннего времени, микросхему надо сбросить; у SST бит DQ5
+ * не определён.
+ * Оба чтения - из одного и того же слова: DQ6 соседних слов
+ * после окончания операции - просто данные массива.
+ */
+static void read_status_twice (target_t *t, unsigned addr, unsigned *r)
+{
+    unsigned oscr [2], mode = t->adapter->oscr;
+
+    if (! t->is_running) {
+        /* Процессор остановлен: оба чтения одним обменом,
+         * готовность проверяется для каждого до чтения OMDR.
+         * Режим чтения включается только на время обмена,
+         * чтобы следующая запись команды не меняла OSCR. */
+        if (addr >= 0xA0000000)
+            addr -= 0xA0000000;
+        else if (addr >= 0x80000000)
+            addr -= 0x80000000;
+        if (! (mode & OSCR_RO) || ! (mode & OSCR_SlctMEM))
+            oncd_queue_write (t, mode | OSCR_SlctMEM | OSCR_RO, OnCD_OSCR, 32);
+        oncd_queue_write (t, addr, OnCD_OMAR, 32);
+        oncd_queue_write (t, 0, OnCD_MEM, 0);
+        oncd_queue_read (t, OnCD_OSCR, 32, &oscr[0]);
+        oncd_queue_read (t, OnCD_OMDR, 32, &r[0]);
+        oncd_queue_write (t, 0, OnCD_MEM, 0);
+        oncd_queue_read (t, OnCD_OSCR, 32, &oscr[1]);
+        oncd_queue_read (t, OnCD_OMDR, 32, &r[1]);
+        if (! (mode & OSCR_RO) || ! (mode & OSCR_SlctMEM))
+            oncd_queue_write (t, mode, OnCD_OSCR, 32);
+        oncd_flush (t);
+        t->adapter->stats.rdym_polls += 2;
+        if (oscr[0] & oscr[1] & OSCR_RDYm)
+            return;
+    }
+    target_read_start (t);
+    r[0] = target_read_next (t, addr);
+    r[1] = target_read_next (t, addr);
+}
+
+static int check_flash_status (target_t *t, void *arg)
+{
+    flash_poll_t *p = arg;
+    unsigned lanes = (t->chip_width == 8) ? 0x01010101 : 0x00010001;
+    unsigned r [2], toggle;
+
+    read_status_twice (t, p->addr, r);
+    if (r[1] == p->value)
+        return 1;
+    toggle = (r[0] ^ r[1]) & (0x40 * lanes);
+    if (toggle && t->flash_dq5 && (r[1] & (toggle >> 1))) {
+        /* DQ5: проверяем ещё раз, операция могла как раз закончиться. */
+        read_status_twice (t, p->addr, r);
+        if (r[1] == p->value)
+            return 1;
+        toggle = (r[0] ^ r[1]) & (0x40 * lanes);
+        if (toggle) {
+            fprintf (stderr, _("\nFlash at %08X: internal timeout (DQ5), status %08X\n"),
+                p->addr, r[1]);
+            target_write_word (t, p->addr, t->flash_cmd_f0);
+            return -1;
+        }
+    }
+    if (toggle)
+        return 0;
+
+    /* Операция закончена. */
+    r[0] = target_read_word (t, p->addr);
+    if (r[0] == p->value)
+        return 1;
+    fprintf (stderr, _("\nFlash at %08X: operation failed, read %08X, expected %08X\n"),
+        p->addr, r[0], p->value);
+    return -1;
+}
+
+/*
+ * Проверка окончания записи или стирания: для AMD/SST на 32- и
+ * 64-разрядной шине - по битам состояния, иначе сравнением с образцом.
+ */
+static poll_check_t flash_check (target_t *t)
+{
+    if (t->flash_width != 8 && ! t->flash_delay && ! t->micron_com_set)
+        return check_flash_status;
+    return check_flash;
+}
+
+static int target_flash_wait (target_t *t, int kind, unsigned timeout_us,
+    unsigned addr, unsigned value, int dots)
+{
+    flash_poll_t p = { addr, 0, value, 0 };
+
+    return target_poll (t, kind, timeout_us, flash_check (t), &p, dots);
+}
+
+static int target_flash_wait_cmd (target_t *t, int kind, unsigned timeout_us,
+    unsigned addr, unsigned cmd, unsigned value)
+{
+    flash_poll_t p = { addr, cmd, value, 1 };
+
+    return target_poll (t, kind, timeout_us, check_flash, &p, 0);
+}
+
+/*
+ * Максимальные времена записи и стирания по документации на микросхемы.
+ * Для неизвестных микросхем берём значения с запасом.
+ */
+static void flash_set_timing (target_t *t, unsigned dev)
+{
+    switch (dev) {
+    case ID_29LV800_B:
+    case ID_29LV800_T:
+        t->program_us = 360;
+        t->erase_sector_ms = 15000;
+        t->erase_chip_ms = 60000;
+        break;
+    case ID_39VF800_A:
+    case ID_39VF6401_B:
+    case ID_39VF6402_B:
+        t->program_us = 20;
+        t->erase_sector_ms = 25;
+        t->erase_chip_ms = 50;
+        break;
+    case ID_S29AL032D:
+        t->program_us = 360;
+        t->erase_sector_ms = 15000;
+        t->erase_chip_ms = 200000;
+        break;
+    case ID_S29GL256P:
+        /* Запись буфера из 32 байт. */
+        t->program_us = 750;
+        t->erase_sector_ms = 3500;
+        t->erase_chip_ms = 512000;
+        break;
+    case ID_MT28F320:
+    case ID_MT28F640:
+    case ID_MT28F128:
+        /* Стирание микросхемы выполняется по секторам. */
+        t->program_us = 654;
+        t->erase_sector_ms = 5000;
+        t->erase_chip_ms = 5000;
+        break;
+    default:
+        t->program_us = 1000;
+        t->erase_sector_ms = 20000;
+        t->erase_chip_ms = 300000;
+        break;
+    }
+}
+
+/*
+ * Постановка в очередь выполнения одной инструкции MIPS32.
+ */
+static void target_queue_exec (target_t *t, unsigned instr)
 {
     /* Restore PCfetch to right address or
      * we can go in exception. */
-    t->adapter->oncd_write (t->adapter, BOOT_ADDR, OnCD_PCfetch, 32);
+    oncd_queue_write (t, BOOT_ADDR, OnCD_PCfetch, 32);
 
     /* Supply instruction to pipeline and do step */
-    t->adapter->oncd_write (t->adapter, instr, OnCD_IRdec, 32);
-    t->adapter->oncd_write (t->adapter, 0,
-        OnCD_GO | IRd_FLUSH_PIPE | IRd_STEP_1CLK, 0);
+    oncd_queue_write (t, instr, OnCD_IRdec, 32);
+    oncd_queue_write (t, 0, OnCD_GO | IRd_FLUSH_PIPE | IRd_STEP_1CLK, 0);
+}
+
+/*
+ * Выполнение одной инструкции MIPS32.
+ */
+static void target_exec (target_t *t, unsigned instr)
+{
+    target_queue_exec (t, instr);
+    oncd_flush (t);
 }
 
 /*
  * Прочитать неадресуемый объект с помощью нового
  * механизма доступа OnCD через RegF.
  */
-static unsigned regf_read (target_t *t, unsigned group, unsigned n)
+static void regf_queue_read (target_t *t, unsigned group, unsigned n,
+    unsigned *result)
 {
     unsigned irdec = group;
     if (group < 2)
@@ -173,8 +541,16 @@ static unsigned regf_read (target_t *t, unsigned group, unsigned n)
     else
         irdec |= n << 3;
 
-    t->adapter->oncd_write (t->adapter, irdec, OnCD_IRdec, 32);
-    unsigned val = t->adapter->oncd_read (t->adapter, OnCD_REGF, 32);
+    oncd_queue_write (t, irdec, OnCD_IRdec, 32);
+    oncd_queue_read (t, OnCD_REGF, 32, result);
+}
+
+static unsigned regf_read (target_t *t, unsigned group, unsigned n)
+{
+    unsigned val;
+
+    regf_queue_read (t, group, n, &val);
+    oncd_flush (t);
     return val;
 }
 
@@ -185,8 +561,24 @@ static unsigned regf_read (target_t *t, unsigned group, unsigned n)
 static void regf_write (target_t *t, unsigned group, unsigned n, unsigned val)
 {
     unsigned irdec = group | (n << 3);
-    t->adapter->oncd_write (t->adapter, irdec, OnCD_IRdec, 32);
-    t->adapter->oncd_write (t->adapter, val, OnCD_REGF, 32);
+    oncd_queue_write (t, irdec, OnCD_IRdec, 32);
+    oncd_queue_write (t, val, OnCD_REGF, 32);
+    oncd_flush (t);
+}
+
+/*
+ * Прочитать группу регистров через RegF за один обмен с адаптером.
+ */
+static void regf_read_group (target_t *t, unsigned group, unsigned count,
+    unsigned *val, unsigned *valid)
+{
+    unsigned n;
+
+    for (n=0; n<count; n++)
+        regf_queue_read (t, group, n, &val[n]);
+    oncd_flush (t);
+    for (n=0; n<count; n++)
+        valid[n] = 1;
 }
 
 /*
@@ -262,10 +654,12 @@ static void target_save_state (target_t *t)
     int i;
 
     /* Сохраняем конвейер. */
-    t->pc_fetch = t->adapter->oncd_read (t->adapter, OnCD_PCfetch, 32);
-    t->pc_dec = t->adapter->oncd_read (t->adapter, OnCD_PCdec, 32);
-    t->ir_dec = t->adapter->oncd_read (t->adapter, OnCD_IRdec, 32);
-    t->pc_exec = t->adapter->oncd_read (t->adapter, OnCD_PCexec, 32);
+    oncd_queue_read (t, OnCD_PCfetch, 32, &t->pc_fetch);
+    oncd_queue_read (t, OnCD_PCdec, 32, &t->pc_dec);
+    oncd_queue_read (t, OnCD_IRdec, 32, &t->ir_dec);
+    oncd_queue_read (t, OnCD_PCexec, 32, &t->pc_exec);
+    oncd_queue_read (t, OnCD_OSCR, 32, &t->adapter->oscr);
+    oncd_flush (t);
 #if 0
     unsigned pc_mem = t->adapter->oncd_read (t->adapter, OnCD_PCmem, 32);
     unsigned pc_wb = t->adapter->oncd_read (t->adapter, OnCD_PCwb, 32);
@@ -276,29 +670,32 @@ fprintf (stderr, "PC mem   = %08x\n", pc_mem);
 fprintf (stderr, "PC wb    = %08x\n", pc_wb);
 #endif
     /* Снимаем запрет останова в Delay Slot. */
-    t->adapter->oscr = t->adapter->oncd_read (t->adapter, OnCD_OSCR, 32);
     t->adapter->oscr &= ~OSCR_NDS;
 
     /* Отменяем исключение по адресу PC. */
     t->adapter->oscr |= OSCR_NFEXP;
-    t->adapter->oncd_write (t->adapter, t->adapter->oscr, OnCD_OSCR, 32);
+    oncd_queue_write (t, t->adapter->oscr, OnCD_OSCR, 32);
 
     t->exception = NO_EXCEPTION;
     if (t->pc_exec) {
-        /* Завершаем выполнение конвейера: стадии 'exec', 'mem' и 'wb'. */
+        /* Завершаем выполнение конвейера: стадии 'exec', 'mem' и 'wb'.
+         * Поскольку target_exec() устанавливает PCfetch равным 0xbfc00000,
+         * после выполнения одного шага мы должны получить 0xbfc00004. */
+        unsigned pc [3];
+
         for (i=0; i<3; i++) {
-            target_exec (t, MIPS_NOP);
+            target_queue_exec (t, MIPS_NOP);
+            oncd_queue_read (t, OnCD_PCfetch, 32, &pc[i]);
+        }
+        oncd_flush (t);
 
-            /* Проверяем, не произошло ли исключение.
-             * Их может быть несколько, нам важно только первое. */
-            if (t->exception == NO_EXCEPTION) {
-                /* Поскольку target_exec() устанавливает PCfetch равным 0xbfc00000,
-                 * после выполнения одного шага мы должны получить 0xbfc00004. */
-                unsigned pc = t->adapter->oncd_read (t->adapter, OnCD_PCfetch, 32);
-                if (pc != BOOT_ADDR + 4) {
-                    /* Имеем исключение на стадиях 'exec' или 'mem'. */
-                    t->exception = pc;
-                }
+        /* Проверяем, не произошло ли исключение.
+         * Их может быть несколько, нам важно только первое. */
+        for (i=0; i<3; i++) {
+            if (pc[i] != BOOT_ADDR + 4) {
+                /* Имеем исключение на стадиях 'exec' или 'mem'. */
+                t->exception = pc[i];
+                break;
             }
         }
     }
@@ -309,7 +706,8 @@ fprintf (stderr, "PC wb    = %08x\n", pc_wb);
      * Он останавливает счётчики, блокирует прерывания и исключения TLB,
      * и разрешает доступ к привилегированным ресурсам. */
     t->adapter->oscr |= OSCR_DBM;
-    t->adapter->oncd_write (t->adapter, t->adapter->oscr, OnCD_OSCR, 32);
+    oncd_queue_write (t, t->adapter->oscr, OnCD_OSCR, 32);
+    oncd_flush (t);
 
     /* Забываем старые значения регистров. */
     for (i=0; i<32; i++) {
@@ -362,25 +760,23 @@ static void target_restore_state (target_t *t)
 
     /* Очищаем конвейер. */
     for (i=0; i<3; i++) {
-        target_exec (t, MIPS_NOP);
+        target_queue_exec (t, MIPS_NOP);
     }
 
     if (t->exception == NO_EXCEPTION) {
         /* Если нет исключения - восстанавливаем стадию 'dec' конвейера. */
-        t->adapter->oncd_write (t->adapter, t->pc_dec, OnCD_PCfetch, 32);
-        t->adapter->oncd_write (t->adapter, MIPS_NOP, OnCD_IRdec, 32);
-        t->adapter->oncd_write (t->adapter,
-            0, OnCD_GO | IRd_FLUSH_PIPE | IRd_STEP_1CLK, 0);
-        t->adapter->oncd_write (t->adapter, t->ir_dec, OnCD_IRdec, 32);
+        oncd_queue_write (t, t->pc_dec, OnCD_PCfetch, 32);
+        oncd_queue_write (t, MIPS_NOP, OnCD_IRdec, 32);
+        oncd_queue_write (t, 0, OnCD_GO | IRd_FLUSH_PIPE | IRd_STEP_1CLK, 0);
+        oncd_queue_write (t, t->ir_dec, OnCD_IRdec, 32);
 
         /* Восстанавливаем стадию 'fetch'. */
-        t->adapter->oncd_write (t->adapter, t->pc_fetch, OnCD_PCfetch, 32);
+        oncd_queue_write (t, t->pc_fetch, OnCD_PCfetch, 32);
     } else {
         /* Переходим на обработчик исключения. */
-        t->adapter->oncd_write (t->adapter, t->exception, OnCD_PCfetch, 32);
-        t->adapter->oncd_write (t->adapter, MIPS_NOP, OnCD_IRdec, 32);
-        t->adapter->oncd_write (t->adapter,
-            0, OnCD_GO | IRd_FLUSH_PIPE | IRd_STEP_1CLK, 0);
+        oncd_queue_write (t, t->exception, OnCD_PCfetch, 32);
+        oncd_queue_write (t, MIPS_NOP, OnCD_IRdec, 32);
+        oncd_queue_write (t, 0, OnCD_GO | IRd_FLUSH_PIPE | IRd_STEP_1CLK, 0);
     }
 
     /* Запрещаем останов в Delay Slot. */
@@ -388,7 +784,8 @@ static void target_restore_state (target_t *t)
 
     /* Снимаем бит отладки. */
     t->adapter->oscr &= ~OSCR_DBM;
-    t->adapter->oncd_write (t->adapter, t->adapter->oscr, OnCD_OSCR, 32);
+    oncd_queue_write (t, t->adapter->oscr, OnCD_OSCR, 32);
+    oncd_flush (t);
 }
 
 /*
@@ -470,8 +867,13 @@ unsigned target_read_register (target_t *t, unsigned regno)
     switch (regno) {
     case 0 ... 31:              /* регистры процессора MIPS */
         if (! t->valid [regno]) {
-            t->reg [regno] = target_read_reg (t, regno);
-            t->valid [regno] = 1;
+            if (t->idcode != MC12_ID) {
+                /* Читаем сразу все регистры. */
+                regf_read_group (t, GROUP_RFCPU, 32, t->reg, t->valid);
+            } else {
+                t->reg [regno] = target_read_reg (t, regno);
+                t->valid [regno] = 1;
+            }
         }
         return t->reg [regno];
 
@@ -529,6 +931,11 @@ unsigned target_read_register (target_t *t, unsigned regno)
 
     case 38 ... 69:             /* регистры FPU */
         if (! t->valid_fpu [regno-38]) {
+            if (t->idcode != MC12_ID) {
+                /* Читаем сразу все регистры. */
+                regf_read_group (t, GROUP_RFFPU, 32, t->reg_fpu, t->valid_fpu);
+                return t->reg_fpu [regno-38];
+            }
             t->reg_fpu [regno-38] = target_read_fpu (t, regno-38);
 //fprintf (stderr, "f%d = %08x\n", regno-38, t->reg_fpu [regno-38]);
             t->valid_fpu [regno-38] = 1;
@@ -624,7 +1031,6 @@ void target_write_register (target_t *t, unsigned regno, unsigned val)
  */
 void target_write_next (target_t *t, unsigned phys_addr, unsigned data)
 {
-    unsigned count;
 
     if (phys_addr >= 0xA0000000)
         phys_addr -= 0xA0000000;
@@ -641,13 +1047,7 @@ void target_write_next (target_t *t, unsigned phys_addr, unsigned data)
     if (t->is_running) {
         /* Если процессор запущен, обращение к памяти произойдёт не сразу.
          * Надо ждать появления бита RDYm в регистре OSCR. */
-        for (count = 100; count != 0; count--) {
-            t->adapter->oscr = t->adapter->oncd_read (t->adapter, OnCD_OSCR, 32);
-            if (t->adapter->oscr & OSCR_RDYm)
-                break;
-            mdelay (1);
-        }
-        if (count == 0) {
+        if (! target_poll (t, WAIT_MEMORY, 100000, check_rdym, 0, 0)) {
             fprintf (stderr, _("Timeout writing memory, aborted. OSCR=%#x\n"),
                 t->adapter->oscr);
             exit (1);
@@ -685,13 +1085,30 @@ void target_read_start (target_t *t)
 
 unsigned target_read_next (target_t *t, unsigned phys_addr)
 {
-    unsigned count, data;
+    unsigned data;
 
     if (phys_addr >= 0xA0000000)
         phys_addr -= 0xA0000000;
     else if (phys_addr >= 0x80000000)
         phys_addr -= 0x80000000;
 
+    if (! t->is_running) {
+        /* Процессор остановлен: обращение к памяти успевает
+         * завершиться за время сдвига регистров JTAG.
+         * Адрес, запуск чтения, OSCR и данные - одним обменом.
+         * OSCR читается до OMDR: RDYm подтверждает, что данные
+         * уже были готовы, когда OMDR сдвигался наружу. */
+        oncd_queue_write (t, phys_addr, OnCD_OMAR, 32);
+        oncd_queue_write (t, 0, OnCD_MEM, 0);
+        oncd_queue_read (t, OnCD_OSCR, 32, &t->adapter->oscr);
+        oncd_queue_read (t, OnCD_OMDR, 32, &data);
+        oncd_flush (t);
+        t->adapter->stats.rdym_polls++;
+        if (t->adapter->oscr & OSCR_RDYm)
+            goto done;
+
+        /* Не успело - повторяем с ожиданием готовности. */
+    }
     t->adapter->oncd_write (t->adapter, phys_addr, OnCD_OMAR, 32);
     t->adapter->oncd_write (t->adapter, 0, OnCD_MEM, 0);
 
@@ -699,25 +1116,54 @@ unsigned target_read_next (target_t *t, unsigned phys_addr)
 //    if (t->is_running) {
         /* Если процессор запущен, обращение к памяти произойдёт не сразу.
          * Надо ждать появления бита RDYm в регистре OSCR. */
-        for (count = 1000; count != 0; count--) {
-            t->adapter->oscr = t->adapter->oncd_read (t->adapter, OnCD_OSCR, 32);
-            if (t->adapter->oscr & OSCR_RDYm)
-                break;
-            mdelay (1);
-        }
-        if (count == 0) {
+        if (! target_poll (t, WAIT_MEMORY, 1000000, check_rdym, 0, 0)) {
             fprintf (stderr, _("Timeout reading memory, aborted. OSCR=%#x\n"),
                 t->adapter->oscr);
             exit (1);
         }
 //    }
     data = t->adapter->oncd_read (t->adapter, OnCD_OMDR, 32);
-
+done:
     if (debug_level)
         fprintf (stderr, _("read %08x from     %08x\n"), data, phys_addr);
     return data;
 }
 
+/*
+ * Чтение пачки слов при остановленном процессоре,
+ * для адаптеров без блочного чтения.
+ * Адрес, запуск чтения, OSCR и OMDR выдаются подряд, одним
+ * обменом; RDYm проверяется для каждого слова, до чтения его
+ * данных. Если готовности нет, пачка перечитывается
+ * с ожиданием на каждом слове.
+ */
+static void target_read_batch (target_t *t, unsigned addr,
+    unsigned nwords, unsigned *data)
+{
+    unsigned i, ready, oscr [READ_BATCH_WORDS];
+
+    for (i=0; i<nwords; i++) {
+        oncd_queue_write (t, addr + i*4, OnCD_OMAR, 32);
+        oncd_queue_write (t, 0, OnCD_MEM, 0);
+        oncd_queue_read (t, OnCD_OSCR, 32, &oscr[i]);
+        oncd_queue_read (t, OnCD_OMDR, 32, &data[i]);
+    }
+    oncd_flush (t);
+    t->adapter->stats.rdym_polls += nwords;
+    ready = OSCR_RDYm;
+    for (i=0; i<nwords; i++)
+        ready &= oscr[i];
+    t->adapter->oscr = oscr[nwords-1];
+    if (ready)
+        return;
+
+    if (debug_level)
+        fprintf (stderr, "read batch at %08x: not ready, OSCR=%#x\n",
+            addr, t->adapter->oscr);
+    for (i=0; i<nwords; i++)
+        data[i] = target_read_next (t, addr + i*4);
+}
+
 unsigned target_read_word (target_t *t, unsigned phys_addr)
 {
     target_read_start (t);
@@ -775,8 +1221,116 @@ void target_write_2bytes (target_t *t, unsigned addr1, unsigned data1,
     target_write_next (t, addr2, data2);
 }
 
-#define RESET_RETRY     100
-#define RESET_DELAY     100
+#define IDCODE_TIMEOUT  10000   /* мсек */
+#define IDCODE_DELAY    256     /* наибольшая пауза между попытками, мсек */
+
+/*
+ * Открытие адаптера по описанию вида "тип" или "тип:id",
+ * где тип - usb, mpsse, bitbang или lpt, а id - серийный номер
+ * или путь "шина/устройство" адаптера USB.
+ * Если описание не задано, пробуем все типы по очереди.
+ */
+static adapter_t *open_adapter (const char *spec, int need_reset, int disable_block)
+{
+    char type [16];
+    const char *id;
+    int len;
+
+    if (! spec) {
+        /* Ищем адаптер JTAG: USB, bitbang, MPSSE или LPT. */
+        adapter_t *a = adapter_open_usb (need_reset, disable_block, 0);
+        if (! a)
+            a = adapter_open_mpsse (0);
+        if (! a)
+            a = adapter_open_bitbang (0);
+#ifndef __APPLE__
+        if (! a)
+            a = adapter_open_lpt ();
+#endif
+        return a;
+    }
+    id = strchr (spec, ':');
+    len = id ? id - spec : strlen (spec);
+    if (id)
+        id++;
+    if (len >= sizeof (type))
+        len = sizeof (type) - 1;
+    strncpy (type, spec, len);
+    type [len] = 0;
+
+    if (strcasecmp (type, "usb") == 0)
+        return adapter_open_usb (need_reset, disable_block, id);
+    if (strcasecmp (type, "mpsse") == 0)
+        return adapter_open_mpsse (id);
+    if (strcasecmp (type, "bitbang") == 0)
+        return adapter_open_bitbang (id);
+    if (strcasecmp (type, "sim") == 0)
+        return adapter_open_sim (id);
+    if (strcasecmp (type, "replay") == 0)
+        return adapter_open_replay (id);
+#ifndef __APPLE__
+    if (strcasecmp (type, "lpt") == 0)
+        return adapter_open_lpt ();
+#endif
+    fprintf (stderr, _("Unknown adapter type `%s', must be usb, mpsse, bitbang, lpt, sim or replay.\n"),
+        type);
+    exit (-1);
+}
+
+/*
+ * Файл для записи обменов с адаптером.
+ */
+static const char *record_filename;
+
+void target_record (const char *filename)
+{
+    record_filename = filename;
+}
+
+/*
+ * Запись flash с помощью программы, выполняемой процессором.
+ */
+static int loader_enable;
+
+void target_flash_loader (int enable)
+{
+    loader_enable = enable;
+}
+
+/*
+ * Печать статистики обменов с адаптером, по строке.
+ */
+void target_report_stats (target_t *t,
+    void (*print) (void *arg, const char *line), void *arg)
+{
+    static const char *wait_name [WAIT_NKINDS] = {
+        "memory ready", "flash program", "sector erase", "chip erase",
+        "checksum",
+    };
+    wait_stats_t *ws;
+    char line [256];
+    int kind, title = 0;
+
+    adapter_report (t->adapter, print, arg);
+    for (kind=0; kind<WAIT_NKINDS; kind++) {
+        ws = &t->wait[kind];
+        if (! ws->count)
+            continue;
+        if (! title) {
+            snprintf (line, sizeof (line), "  %-26s %8s %10s %8s %8s %8s %8s",
+                "wait", "calls", "total ms", "avg us", "max us", "timeouts",
+                "errors");
+            print (arg, line);
+            title = 1;
+        }
+        snprintf (line, sizeof (line), "  %-26s %8lu %10.1f %8.1f %8u %8lu %8lu",
+            wait_name[kind], ws->count, ws->total_us / 1000.0,
+            (double) ws->total_us / ws->count, ws->max_us, ws->timeouts,
+            ws->errors);
+        print (arg, line);
+    }
+}
+
 /*
  * Устанавливаем соединение с адаптером JTAG.
  * Не надо сбрасывать процессор!
@@ -784,7 +1338,15 @@ void target_write_2bytes (target_t *t, unsigned addr1, unsigned data1,
  */
 target_t *target_open (int need_reset, int disable_block)
 {
-    int i;
+    return target_open_adapter (0, need_reset, disable_block);
+}
+
+/*
+ * То же, но с явным выбором адаптера.
+ */
+target_t *target_open_adapter (const char *spec, int need_reset, int disable_block)
+{
+    unsigned delay, waited;
     target_t *t;
 
     t = calloc (1, sizeof (target_t));
@@ -793,35 +1355,37 @@ target_t *target_open (int need_reset, int disable_block)
         exit (-1);
     }
     t->cpu_name = "Unknown";
+    t->use_loader = loader_enable;
     t->flash_base[0] = ~0;
     t->flash_last[0] = ~0;
 
-    /* Ищем адаптер JTAG: USB, bitbang, MPSSE или LPT. */
-    t->adapter = adapter_open_usb (need_reset, disable_block);
-    if (! t->adapter)
-	t->adapter = adapter_open_mpsse ();
-    if (! t->adapter)
-        t->adapter = adapter_open_bitbang ();
-#ifndef __APPLE__
-    if (! t->adapter)
-        t->adapter = adapter_open_lpt ();
-#endif
+    t->adapter = open_adapter (spec, need_reset, disable_block);
     if (! t->adapter) {
-        fprintf (stderr, _("No JTAG adapter found.\n"));
+        if (spec)
+            fprintf (stderr, _("JTAG adapter %s not found.\n"), spec);
+        else
+            fprintf (stderr, _("No JTAG adapter found.\n"));
         exit (-1);
     }
+    t->adapter = adapter_monitor (t->adapter, record_filename);
 
     /* Проверяем идентификатор процессора. */
-    /* Повторы делаются, если на плате "затянутый" SYSRST JTAG */
-    for (i=0;i<RESET_RETRY;i++) {
-        mdelay(RESET_DELAY);
+    /* Повторы делаются, если на плате "затянутый" SYSRST JTAG.
+     * Паузы между попытками удваиваются. */
+    delay = 1;
+    waited = 0;
+    for (;;) {
         t->idcode = t->adapter->get_idcode (t->adapter);
-        if (t->idcode == 0xffffffff || t->idcode == 0) {
-		t->adapter->reset_cpu(t->adapter);
-		continue;
-        }
-        break;
-    };
+        if (t->idcode != 0xffffffff && t->idcode != 0)
+            break;
+        if (waited >= IDCODE_TIMEOUT)
+            break;
+        t->adapter->reset_cpu (t->adapter);
+        mdelay (delay);
+        waited += delay;
+        if (delay < IDCODE_DELAY)
+            delay <<= 1;
+    }
     if (debug_level)
         fprintf (stderr, "idcode %08X\n", t->idcode);
 
@@ -849,51 +1413,217 @@ target_t *target_open (int need_reset, int disable_block)
     return t;
 }
 
+/* Ниже этой частоты автоматический подбор не спускается, кГц. */
+#define CLOCK_MIN_KHZ   100
+
+#define LINK_TEST_WORDS 64
+#define LINK_TEST_PASSES 4
+
 /*
- * Close the device.
+ * Обращение к памяти для проверки связи: только простые операции
+ * с регистрами OnCD и своя проверка RDYm. Блочные функции адаптеров
+ * при сбое завершают программу, а здесь сбой - обычный результат.
+ * Возвращает 0, если обращение не завершилось.
  */
-void target_close (target_t *t)
+static int link_access (target_t *t, unsigned addr, unsigned *data, int write)
 {
-    if (! t->is_running)
-        target_resume (t);
-    t->adapter->close (t->adapter);
+    adapter_t *a = t->adapter;
+    unsigned oscr_new = (a->oscr & ~OSCR_RO) | OSCR_SlctMEM |
+        (write ? 0 : OSCR_RO);
+
+    if (oscr_new != a->oscr) {
+        a->oscr = oscr_new;
+        a->oncd_write (a, a->oscr, OnCD_OSCR, 32);
+    }
+    a->oncd_write (a, addr - 0xA0000000, OnCD_OMAR, 32);
+    if (write)
+        a->oncd_write (a, *data, OnCD_OMDR, 32);
+    a->oncd_write (a, 0, OnCD_MEM, 0);
+    if (! (a->oncd_read (a, OnCD_OSCR, 32) & OSCR_RDYm))
+        return 0;
+    if (! write)
+        *data = a->oncd_read (a, OnCD_OMDR, 32);
+    return 1;
 }
 
 /*
- * Add a flash region.
+ * Проверка надёжности связи на текущей частоте JTAG:
+ * идентификатор процессора, запись-чтение регистра OMDR
+ * и тест памяти CRAM. Содержимое CRAM портится,
+ * его надо сохранить заранее.
  */
-void target_flash_configure (target_t *t, unsigned first, unsigned last)
+static int target_check_link (target_t *t)
 {
-    int i;
+    static const unsigned pattern[] = {
+        0x00000000, 0xffffffff, 0x55555555, 0xaaaaaaaa,
+        0x33333333, 0xcccccccc, 0x0f0f0f0f, 0xf0f0f0f0,
+    };
+    unsigned buf [LINK_TEST_WORDS], data [LINK_TEST_WORDS];
+    unsigned i, pass, stopped;
 
-    for (i=0; i<NFLASH-1; ++i) {
-        if (t->flash_last [i] == ~0) {
-            t->flash_base [i] = first;
-            t->flash_last [i] = last;
-            t->flash_base [i+1] = ~0;
-            t->flash_last [i+1] = ~0;
-            return;
+    for (pass=0; pass<LINK_TEST_PASSES; pass++) {
+        if (t->adapter->get_idcode (t->adapter) != t->idcode)
+            return 0;
+
+        /* Заново выбираем регистр отладки после сброса TAP. */
+        stopped = (t->adapter->cpu_stopped (t->adapter) != 0);
+        if (stopped == t->is_running)
+            return 0;
+
+        for (i=0; i<sizeof(pattern)/sizeof(pattern[0]); i++) {
+            t->adapter->oncd_write (t->adapter, pattern[i], OnCD_OMDR, 32);
+            if (t->adapter->oncd_read (t->adapter, OnCD_OMDR, 32) != pattern[i])
+                return 0;
+        }
+        t->adapter->oncd_write (t->adapter, t->adapter->oscr, OnCD_OSCR, 32);
+
+        /* Бегущая единица, шахматка и адрес в данных. */
+        for (i=0; i<LINK_TEST_WORDS; i++) {
+            switch (i % 3) {
+            case 0:  buf[i] = 1 << ((i + pass) & 31);         break;
+            case 1:  buf[i] = pattern [(i + pass) & 7];       break;
+            default: buf[i] = ~(CRAM_ADDR + i*4) ^ pass;     break;
+            }
         }
+        for (i=0; i<LINK_TEST_WORDS; i++)
+            if (! link_access (t, CRAM_ADDR + i*4, &buf[i], 1))
+                return 0;
+        for (i=0; i<LINK_TEST_WORDS; i++)
+            if (! link_access (t, CRAM_ADDR + i*4, &data[i], 0))
+                return 0;
+        if (memcmp (buf, data, sizeof (buf)) != 0)
+            return 0;
     }
-    fprintf (stderr, _("target_flash_configure: too many flash regions.\n"));
-    exit (1);
+    return 1;
 }
 
 /*
- * Iterate through all flash regions.
+ * Установка частоты JTAG, кГц.
+ * Если khz=0, подбираем автоматически: начинаем с самой
+ * высокой частоты и понижаем, пока связь не станет надёжной.
+ * Возвращаем установленную частоту или 0, если адаптер
+ * не позволяет её менять.
  */
-unsigned target_flash_next (target_t *t, unsigned prev, unsigned *last)
+unsigned target_set_clock (target_t *t, unsigned khz)
 {
-    int i;
+    unsigned save [LINK_TEST_WORDS], actual, prev;
 
-    if (prev == ~0 && t->flash_base [0] != ~0) {
-        *last = t->flash_last [0];
-        return t->flash_base [0];
-    }
-    for (i=1; i<NFLASH-1 && t->flash_last[i] != ~0; ++i) {
-        if (prev >= t->flash_base [i-1] &&
-            prev <= t->flash_last [i-1]) {
-            *last = t->flash_last [i];
+    if (! t->adapter->set_clock)
+        return 0;
+    if (khz != 0)
+        return t->adapter->set_clock (t->adapter, khz);
+
+    /* Сохраняем CRAM на исходной, заведомо рабочей частоте. */
+    target_read_block (t, CRAM_ADDR, LINK_TEST_WORDS, save);
+
+    /* Перебираем частоты, которые умеет адаптер, от самой высокой. */
+    actual = t->adapter->set_clock (t->adapter, ~0u);
+    for (;;) {
+        if (debug_level)
+            fprintf (stderr, "Trying JTAG clock %u kHz\n", actual);
+        if (target_check_link (t))
+            break;
+        if (debug_level)
+            fprintf (stderr, "JTAG clock %u kHz is unreliable\n", actual);
+
+        prev = actual;
+        actual = t->adapter->set_clock (t->adapter, prev - 1);
+        if (actual >= prev || actual < CLOCK_MIN_KHZ) {
+            fprintf (stderr, _("No reliable JTAG clock found -- check cable!\n"));
+            exit (1);
+        }
+    }
+    target_write_block (t, CRAM_ADDR, LINK_TEST_WORDS, save);
+    return actual;
+}
+
+/*
+ * Отдельный контекст для другой области flash-памяти: копия
+ * состояния со своими параметрами микросхемы и статистикой
+ * ожиданий, адаптер общий. Процессор должен быть остановлен.
+ */
+target_t *target_flash_context (target_t *t)
+{
+    target_t *c;
+
+    c = malloc (sizeof (*c));
+    if (! c) {
+        fprintf (stderr, _("Out of memory\n"));
+        exit (-1);
+    }
+    *c = *t;
+    memset (c->wait, 0, sizeof (c->wait));
+    c->nb_rewrites = 0;
+
+    /* Программа записи в CRAM одна на все контексты. */
+    c->use_loader = 0;
+    return c;
+}
+
+/*
+ * Освобождение контекста, статистика добавляется к основному.
+ */
+void target_flash_context_free (target_t *t, target_t *c)
+{
+    int kind;
+
+    for (kind=0; kind<WAIT_NKINDS; kind++) {
+        t->wait[kind].count += c->wait[kind].count;
+        t->wait[kind].timeouts += c->wait[kind].timeouts;
+        t->wait[kind].errors += c->wait[kind].errors;
+        t->wait[kind].total_us += c->wait[kind].total_us;
+        if (c->wait[kind].max_us > t->wait[kind].max_us)
+            t->wait[kind].max_us = c->wait[kind].max_us;
+    }
+    t->nb_rewrites += c->nb_rewrites;
+    free (c);
+}
+
+/*
+ * Close the device.
+ */
+void target_close (target_t *t)
+{
+    if (! t->is_running)
+        target_resume (t);
+    t->adapter->close (t->adapter);
+}
+
+/*
+ * Add a flash region.
+ */
+void target_flash_configure (target_t *t, unsigned first, unsigned last)
+{
+    int i;
+
+    for (i=0; i<NFLASH-1; ++i) {
+        if (t->flash_last [i] == ~0) {
+            t->flash_base [i] = first;
+            t->flash_last [i] = last;
+            t->flash_base [i+1] = ~0;
+            t->flash_last [i+1] = ~0;
+            return;
+        }
+    }
+    fprintf (stderr, _("target_flash_configure: too many flash regions.\n"));
+    exit (1);
+}
+
+/*
+ * Iterate through all flash regions.
+ */
+unsigned target_flash_next (target_t *t, unsigned prev, unsigned *last)
+{
+    int i;
+
+    if (prev == ~0 && t->flash_base [0] != ~0) {
+        *last = t->flash_last [0];
+        return t->flash_base [0];
+    }
+    for (i=1; i<NFLASH-1 && t->flash_last[i] != ~0; ++i) {
+        if (prev >= t->flash_base [i-1] &&
+            prev <= t->flash_last [i-1]) {
+            *last = t->flash_last [i];
             return t->flash_base [i];
         }
     }
@@ -942,17 +1672,239 @@ static unsigned compute_base (target_t *t, unsigned addr)
     return 0;
 }
 
+/*
+ * Размер сектора по смещению от начала flash-памяти.
+ * Без карты CFI все секторы считаются одинаковыми.
+ */
+static unsigned sector_size_at (target_t *t, unsigned offset)
+{
+    unsigned start, i;
+
+    if (t->nregions == 0)
+        return t->sector_size;
+    if (t->flash_bytes)
+        offset %= t->flash_bytes;
+    start = 0;
+    for (i=0; i<t->nregions; i++) {
+        start += t->region[i].count * t->region[i].size;
+        if (offset < start)
+            return t->region[i].size;
+    }
+    return t->sector_size;
+}
+
+/*
+ * Размер сектора, содержащего заданный адрес.
+ */
+unsigned target_sector_size (target_t *t, unsigned addr)
+{
+    if (t->nregions == 0)
+        return t->sector_size;
+    return sector_size_at (t, (addr - compute_base (t, addr)) & 0x1FFFFFFF);
+}
+
+/*
+ * Параметры из таблицы CFI одной микросхемы.
+ */
+typedef struct {
+    unsigned cmdset;                    /* основной набор команд */
+    unsigned chip_bytes;                /* объём микросхемы */
+    unsigned buffer_bytes;              /* буфер записи, 0 - нет */
+    unsigned typ_program_us, max_program_us;
+    unsigned typ_sector_ms, max_sector_ms;
+    unsigned typ_chip_ms, max_chip_ms;  /* 0 - нет стирания микросхемы */
+    int nregions;
+    struct {
+        unsigned count;
+        unsigned size;
+    } region [CFI_MAX_REGIONS];
+} cfi_info_t;
+
+#define CFI_QUERY_ADDR  0x55            /* адрес команды запроса */
+#define CFI_WORDS       0x50            /* читаем таблицу до этого адреса */
+
+#define CFI_CMDSET_INTEL    0x0001      /* Intel/Sharp расширенный */
+#define CFI_CMDSET_AMD      0x0002      /* AMD/Fujitsu стандартный */
+#define CFI_CMDSET_INTEL_STD 0x0003     /* Intel стандартный */
+
+/*
+ * Максимальное время по CFI: типичное 2^typ, умноженное на 2^mult.
+ * Если множитель не указан, берём восьмикратный запас.
+ */
+static unsigned cfi_max_time (unsigned typ, unsigned mult)
+{
+    if (typ == 0)
+        return 0;
+    return (1 << typ) << (mult ? mult : 3);
+}
+
+/*
+ * Запрос CFI для одной раскладки шины: 0 - две 16-разрядные микросхемы
+ * на 32-разрядной шине, 1 - четыре на 64-разрядной, 2 - четыре
+ * 8-разрядные на 32-разрядной. Таблица читается одной блочной операцией.
+ * Возвращает 0, если микросхемы не ответили строкой "QRY".
+ */
+static int flash_query_cfi (target_t *t, unsigned base, int layout,
+    cfi_info_t *cfi)
+{
+    unsigned buf [2*CFI_WORDS], q [CFI_WORDS], rep, cmd, stride, i, ext;
+    unsigned typ;
+    int ok;
+
+    switch (layout) {
+    case 0:  stride = 4; rep = 0x00010001; break;
+    case 1:  stride = 8; rep = 0x00010001; break;
+    default: stride = 4; rep = 0x01010101; break;
+    }
+    target_write_word (t, base + CFI_QUERY_ADDR * stride, 0x98 * rep);
+    target_read_block (t, base, CFI_WORDS * stride / 4, buf);
+
+    /* Младшая микросхема на шине; у 64-разрядной шины
+     * команду получила только младшая половина. */
+    for (i=0; i<CFI_WORDS; i++)
+        q[i] = buf [i * stride / 4];
+    ok = (q[0x10] == 'Q' * rep && q[0x11] == 'R' * rep &&
+        q[0x12] == 'Y' * rep);
+    for (i=0; i<CFI_WORDS; i++)
+        q[i] &= 0xff;
+
+    cmd = ok ? (q[0x13] | q[0x14] << 8) : 0;
+    if (cmd == CFI_CMDSET_INTEL || cmd == CFI_CMDSET_INTEL_STD)
+        target_write_word (t, base, 0xff * rep);
+    else {
+        target_write_word (t, base, 0xf0 * rep);
+        if (! ok)
+            target_write_word (t, base, 0xff * rep);
+    }
+    if (! ok)
+        return 0;
+
+    memset (cfi, 0, sizeof (*cfi));
+    cfi->cmdset = cmd;
+    cfi->chip_bytes = 1 << q[0x27];
+    if (q[0x2A] | q[0x2B])
+        cfi->buffer_bytes = 1 << (q[0x2A] | q[0x2B] << 8);
+
+    typ = q[0x1F];
+    cfi->typ_program_us = typ ? 1 << typ : 0;
+    cfi->max_program_us = cfi_max_time (typ, q[0x23]);
+    if (cfi->buffer_bytes && q[0x20]) {
+        /* Запись идёт через буфер: считаем по его времени. */
+        typ = q[0x20];
+        cfi->typ_program_us = 1 << typ;
+        cfi->max_program_us = cfi_max_time (typ, q[0x24]);
+    }
+    typ = q[0x21];
+    cfi->typ_sector_ms = typ ? 1 << typ : 0;
+    cfi->max_sector_ms = cfi_max_time (typ, q[0x25]);
+    typ = q[0x22];
+    cfi->typ_chip_ms = typ ? 1 << typ : 0;
+    cfi->max_chip_ms = cfi_max_time (typ, q[0x26]);
+
+    cfi->nregions = q[0x2C];
+    if (cfi->nregions > CFI_MAX_REGIONS)
+        cfi->nregions = CFI_MAX_REGIONS;
+    for (i=0; i<cfi->nregions; i++) {
+        cfi->region[i].count = (q[0x2D + 4*i] | q[0x2E + 4*i] << 8) + 1;
+        cfi->region[i].size = (q[0x2F + 4*i] | q[0x30 + 4*i] << 8) * 256;
+        if (cfi->region[i].size == 0)
+            cfi->region[i].size = 128;
+    }
+
+    /* У микросхем AMD с верхним загрузочным блоком области
+     * в таблице перечислены от старших адресов. */
+    ext = q[0x15] | q[0x16] << 8;
+    if (cmd == CFI_CMDSET_AMD && ext && ext + 0xF < CFI_WORDS &&
+        q[ext] == 'P' && q[ext+1] == 'R' && q[ext+2] == 'I' &&
+        q[ext + 0xF] == 3 && cfi->nregions > 1) {
+        for (i=0; i<cfi->nregions/2; i++) {
+            unsigned j = cfi->nregions - 1 - i;
+            unsigned count = cfi->region[i].count;
+            unsigned size = cfi->region[i].size;
+
+            cfi->region[i] = cfi->region[j];
+            cfi->region[j].count = count;
+            cfi->region[j].size = size;
+        }
+    }
+    if (debug_level > 1)
+        fprintf (stderr, _("CFI: layout %d, command set %04X, %d bytes, %d regions\n"),
+            layout, cmd, cfi->chip_bytes, cfi->nregions);
+    return 1;
+}
+
+/*
+ * Геометрия и времена по CFI заменяют значения из таблицы
+ * идентификаторов.
+ */
+static void flash_apply_cfi (target_t *t, cfi_info_t *cfi)
+{
+    unsigned nchips = t->flash_width / t->chip_width;
+    unsigned nsectors = 0;
+    int i;
+
+    if (cfi->cmdset == CFI_CMDSET_INTEL || cfi->cmdset == CFI_CMDSET_INTEL_STD)
+        t->micron_com_set = 1;
+    if (cfi->cmdset == CFI_CMDSET_AMD) {
+        t->flash_bypass = 1;
+        t->flash_dq5 = 1;
+    }
+    t->flash_bytes = cfi->chip_bytes * nchips;
+    t->nregions = cfi->nregions;
+    t->sector_size = 0;
+    for (i=0; i<cfi->nregions; i++) {
+        t->region[i].count = cfi->region[i].count;
+        t->region[i].size = cfi->region[i].size * nchips;
+        if (t->region[i].size > t->sector_size)
+            t->sector_size = t->region[i].size;
+        nsectors += t->region[i].count;
+    }
+    if (t->sector_size == 0)
+        t->sector_size = 64*1024 * t->flash_width/8;
+    t->write_buffer_words = cfi->buffer_bytes / (t->chip_width / 8);
+
+    if (cfi->max_program_us)
+        t->program_us = cfi->max_program_us;
+    if (cfi->max_sector_ms)
+        t->erase_sector_ms = cfi->max_sector_ms;
+    if (cfi->max_chip_ms)
+        t->erase_chip_ms = cfi->max_chip_ms;
+    else if (cfi->max_sector_ms && nsectors)
+        t->erase_chip_ms = cfi->max_sector_ms * nsectors;
+
+    t->poll_start_us [WAIT_PROGRAM] = cfi->typ_program_us / 2;
+    t->poll_start_us [WAIT_ERASE_SECTOR] = cfi->typ_sector_ms * 500;
+    t->poll_start_us [WAIT_ERASE_CHIP] = cfi->typ_chip_ms * 500;
+}
+
 int target_flash_detect (target_t *t, unsigned addr,
     unsigned *mf, unsigned *dev, char *mfname, char *chipname,
     unsigned *bytes, unsigned *width)
 {
-    int count;
+    int count, cfi_layout;
     unsigned base;
+    cfi_info_t cfi;
 
     base = compute_base (t, addr);
+    t->nregions = 0;
+    t->write_buffer_words = 0;
+    t->flash_bypass = 0;
+    t->flash_dq5 = 0;
+    memset (t->poll_start_us, 0, sizeof (t->poll_start_us));
+
+    /* Сначала запрос CFI: по ответу сразу известна раскладка шины,
+     * перебирать команды чтения идентификатора не нужно. */
+    for (cfi_layout=0; cfi_layout<3; ++cfi_layout)
+        if (flash_query_cfi (t, base, cfi_layout, &cfi))
+            break;
+    if (cfi_layout >= 3)
+        cfi_layout = -1;
+
     for (count=0; count<4*6; ++count) {
+        if (cfi_layout >= 0 && count > 0)
+            break;
         /* Try both 32 and 64 bus width.*/
-        switch (count % 6) {
+        switch (cfi_layout >= 0 ? cfi_layout : count % 6) {
         case 0:
             /* Two 16-bit flash chips. */
             t->flash_width = 32;
@@ -963,6 +1915,8 @@ int target_flash_detect (target_t *t, unsigned addr,
             t->flash_cmd_55 = FLASH_CMD16_55;
             t->flash_cmd_10 = FLASH_CMD16_10;
             t->flash_cmd_20 = FLASH_CMD16_20;
+            t->flash_cmd_25 = FLASH_CMD16_25;
+            t->flash_cmd_29 = FLASH_CMD16_29;
             t->flash_cmd_30 = FLASH_CMD16_30;
             t->flash_cmd_80 = FLASH_CMD16_80;
             t->flash_cmd_90 = FLASH_CMD16_90;
@@ -980,6 +1934,8 @@ int target_flash_detect (target_t *t, unsigned addr,
             t->flash_cmd_55 = FLASH_CMD16_55;
             t->flash_cmd_10 = FLASH_CMD16_10;
             t->flash_cmd_20 = FLASH_CMD16_20;
+            t->flash_cmd_25 = FLASH_CMD16_25;
+            t->flash_cmd_29 = FLASH_CMD16_29;
             t->flash_cmd_30 = FLASH_CMD16_30;
             t->flash_cmd_80 = FLASH_CMD16_80;
             t->flash_cmd_90 = FLASH_CMD16_90;
@@ -997,6 +1953,8 @@ int target_flash_detect (target_t *t, unsigned addr,
             t->flash_cmd_55 = FLASH_CMD8_55;
             t->flash_cmd_10 = FLASH_CMD8_10;
             t->flash_cmd_20 = FLASH_CMD8_20;
+            t->flash_cmd_25 = FLASH_CMD8_25;
+            t->flash_cmd_29 = FLASH_CMD8_29;
             t->flash_cmd_30 = FLASH_CMD8_30;
             t->flash_cmd_80 = FLASH_CMD8_80;
             t->flash_cmd_90 = FLASH_CMD8_90;
@@ -1014,6 +1972,8 @@ int target_flash_detect (target_t *t, unsigned addr,
             t->flash_cmd_55 = FLASH_CMD8_55;
             t->flash_cmd_10 = FLASH_CMD8_10;
             t->flash_cmd_20 = FLASH_CMD8_20;
+            t->flash_cmd_25 = FLASH_CMD8_25;
+            t->flash_cmd_29 = FLASH_CMD8_29;
             t->flash_cmd_30 = FLASH_CMD8_30;
             t->flash_cmd_80 = FLASH_CMD8_80;
             t->flash_cmd_90 = FLASH_CMD8_90;
@@ -1031,6 +1991,8 @@ int target_flash_detect (target_t *t, unsigned addr,
             t->flash_cmd_55 = FLASH_CMD8_55;
             t->flash_cmd_10 = FLASH_CMD8_10;
             t->flash_cmd_20 = FLASH_CMD8_20;
+            t->flash_cmd_25 = FLASH_CMD8_25;
+            t->flash_cmd_29 = FLASH_CMD8_29;
             t->flash_cmd_30 = FLASH_CMD8_30;
             t->flash_cmd_80 = FLASH_CMD8_80;
             t->flash_cmd_90 = FLASH_CMD8_90;
@@ -1049,6 +2011,8 @@ int target_flash_detect (target_t *t, unsigned addr,
             t->flash_cmd_55 = FLASH_CMD8_55;
             t->flash_cmd_10 = FLASH_CMD8_10;
             t->flash_cmd_20 = FLASH_CMD8_20;
+            t->flash_cmd_25 = FLASH_CMD8_25;
+            t->flash_cmd_29 = FLASH_CMD8_29;
             t->flash_cmd_30 = FLASH_CMD8_30;
             t->flash_cmd_80 = FLASH_CMD8_80;
             t->flash_cmd_90 = FLASH_CMD8_90;
@@ -1127,11 +2091,15 @@ int target_flash_detect (target_t *t, unsigned addr,
             strcpy (chipname, "29LV800B");
             t->flash_bytes = 2*1024*1024 * t->flash_width / 32;
             t->sector_size = 32*1024 * t->flash_width/8;
+            t->flash_bypass = 1;
+            t->flash_dq5 = 1;
             goto success;
         case ID_29LV800_T:
             strcpy (chipname, "29LV800T");
             t->flash_bytes = 2*1024*1024 * t->flash_width / 32;
             t->sector_size = 32*1024 * t->flash_width/8;
+            t->flash_bypass = 1;
+            t->flash_dq5 = 1;
             goto success;
         case ID_39VF800_A:
             strcpy (chipname, "39VF800A");
@@ -1157,6 +2125,8 @@ int target_flash_detect (target_t *t, unsigned addr,
             strcpy (chipname, "1636PP2Y");
             t->flash_bytes = 4*2*1024*1024;
             t->sector_size = 64*1024 * t->flash_width/8;
+            t->flash_bypass = 1;
+            t->flash_dq5 = 1;
             goto success;
         case ID_1638PP1:
             strcpy (chipname, "1638PP1");
@@ -1174,11 +2144,16 @@ int target_flash_detect (target_t *t, unsigned addr,
             strcpy (chipname, "S29AL032D");
             t->flash_bytes = 4*1024*1024;
             t->sector_size = 32*1024 * t->flash_width/8;
+            t->flash_bypass = 1;
+            t->flash_dq5 = 1;
             goto success;
         case ID_S29GL256P:
             strcpy (chipname, "S29GL256P");
             t->flash_bytes = 64*1024*1024;
             t->sector_size = 64*1024 * t->flash_width/8;
+            t->write_buffer_words = 16;
+            t->flash_bypass = 1;
+            t->flash_dq5 = 1;
             goto success;
         case ID_MT28F320:
             strcpy (chipname, "MT28F320");
@@ -1200,10 +2175,21 @@ int target_flash_detect (target_t *t, unsigned addr,
             goto success;
         }
     }
+    if (cfi_layout >= 0) {
+        /* Микросхемы нет в таблице, но CFI описывает её полностью. */
+        sprintf (chipname, "CFI <%08X>", *dev);
+        goto success;
+    }
     if (debug_level > 1)
         fprintf (stderr, _("Unknown flash id = %08X\n"), *dev);
     return 0;
 success:
+    flash_set_timing (t, *dev);
+    if (cfi_layout >= 0)
+        flash_apply_cfi (t, &cfi);
+    if (t->micron_com_set && ! t->write_buffer_words)
+        t->write_buffer_words = 16;
+
     /* Read MFR code. */
     switch (*mf) {
     case ID_ALLIANCE:
@@ -1253,9 +2239,52 @@ unknown_mfr:
     return 1;
 }
 
+/*
+ * Команда стирания AMD/SST: addr и cmd - адрес и код последнего
+ * цикла, для всей микросхемы или для сектора.
+ */
+static void flash_erase_cmd (target_t *t, unsigned base,
+    unsigned addr, unsigned cmd)
+{
+    if (t->flash_width == 8) {
+        /* 8-разрядная шина. */
+        target_write_byte (t, base + t->flash_addr_odd, t->flash_cmd_aa);
+        target_write_byte (t, base + t->flash_addr_even, t->flash_cmd_55);
+        target_write_byte (t, base + t->flash_addr_odd, t->flash_cmd_80);
+        target_write_byte (t, base + t->flash_addr_odd, t->flash_cmd_aa);
+        target_write_byte (t, base + t->flash_addr_even, t->flash_cmd_55);
+        target_write_byte (t, addr, cmd);
+
+    } else if (t->flash_delay) {
+        target_write_nwords (t, 6,
+            base + t->flash_addr_odd, t->flash_cmd_aa,
+            base + t->flash_addr_even, t->flash_cmd_55,
+            base + t->flash_addr_odd, t->flash_cmd_80,
+            base + t->flash_addr_odd, t->flash_cmd_aa,
+            base + t->flash_addr_even, t->flash_cmd_55,
+            addr, cmd);
+    } else {
+        target_write_word (t, base + t->flash_addr_odd, t->flash_cmd_aa);
+        target_write_word (t, base + t->flash_addr_even, t->flash_cmd_55);
+        target_write_word (t, base + t->flash_addr_odd, t->flash_cmd_80);
+        target_write_word (t, base + t->flash_addr_odd, t->flash_cmd_aa);
+        target_write_word (t, base + t->flash_addr_even, t->flash_cmd_55);
+        target_write_word (t, addr, cmd);
+        if (t->flash_width == 64) {
+            /* Старшая половина 64-разрядной шины. */
+            target_write_word (t, base + t->flash_addr_odd + 4, t->flash_cmd_aa);
+            target_write_word (t, base + t->flash_addr_even + 4, t->flash_cmd_55);
+            target_write_word (t, base + t->flash_addr_odd + 4, t->flash_cmd_80);
+            target_write_word (t, base + t->flash_addr_odd + 4, t->flash_cmd_aa);
+            target_write_word (t, base + t->flash_addr_even + 4, t->flash_cmd_55);
+            target_write_word (t, addr + 4, cmd);
+        }
+    }
+}
+
 int target_erase (target_t *t, unsigned addr)
 {
-    unsigned word, base;
+    unsigned base;
 
     /* Chip erase. */
     base = compute_base (t, addr);
@@ -1263,72 +2292,32 @@ int target_erase (target_t *t, unsigned addr)
     if (t->micron_com_set) {
 		/* Доступно только поблочное стирание. */
 		unsigned offset = 0;
-		unsigned status;
 		unsigned status_mask = 0;
-		unsigned timeout;
 		unsigned i;
 		for (i = 0; i < t->flash_width / t->chip_width; ++i)
 			status_mask = (status_mask << t->chip_width) | 0x80;
 		while (offset < t->flash_bytes) {
 			target_write_word (t, base + offset, 0x20202020);
 			target_write_word (t, base + offset, 0xd0d0d0d0);
-			timeout = 10000;
-			do {
-				status = target_read_word (t, base + offset);
-				if (timeout-- == 0) {
-					fprintf(stderr, "Timeout while erasing block at offset 0x%08X\n", offset);
-					return 0;
-				}
-			} while (status != status_mask);
+			if (! target_flash_wait (t, WAIT_ERASE_SECTOR,
+			    t->erase_sector_ms * 1000, base + offset, status_mask, 0)) {
+				fprintf(stderr, "Timeout while erasing block at offset 0x%08X\n", offset);
+				return 0;
+			}
 			printf (".");
 			fflush (stdout);
-			offset += t->sector_size;
+			offset += sector_size_at (t, offset);
 		}
 		target_write_word (t, base, 0xffffffff);
     } else {
-        if (t->flash_width == 8) {
-            /* 8-разрядная шина. */
-            target_write_byte (t, base + t->flash_addr_odd, t->flash_cmd_aa);
-            target_write_byte (t, base + t->flash_addr_even, t->flash_cmd_55);
-            target_write_byte (t, base + t->flash_addr_odd, t->flash_cmd_80);
-            target_write_byte (t, base + t->flash_addr_odd, t->flash_cmd_aa);
-            target_write_byte (t, base + t->flash_addr_even, t->flash_cmd_55);
-            target_write_byte (t, base + t->flash_addr_odd, t->flash_cmd_10);
-
-        } else if (t->flash_delay) {
-            target_write_nwords (t, 6,
-                base + t->flash_addr_odd, t->flash_cmd_aa,
-                base + t->flash_addr_even, t->flash_cmd_55,
-                base + t->flash_addr_odd, t->flash_cmd_80,
-                base + t->flash_addr_odd, t->flash_cmd_aa,
-                base + t->flash_addr_even, t->flash_cmd_55,
-                base + t->flash_addr_odd, t->flash_cmd_10);
-        } else {
-            target_write_word (t, base + t->flash_addr_odd, t->flash_cmd_aa);
-            target_write_word (t, base + t->flash_addr_even, t->flash_cmd_55);
-            target_write_word (t, base + t->flash_addr_odd, t->flash_cmd_80);
-            target_write_word (t, base + t->flash_addr_odd, t->flash_cmd_aa);
-            target_write_word (t, base + t->flash_addr_even, t->flash_cmd_55);
-            target_write_word (t, base + t->flash_addr_odd, t->flash_cmd_10);
-            if (t->flash_width == 64) {
-                /* Старшая половина 64-разрядной шины. */
-                target_write_word (t, base + t->flash_addr_odd + 4, t->flash_cmd_aa);
-                target_write_word (t, base + t->flash_addr_even + 4, t->flash_cmd_55);
-                target_write_word (t, base + t->flash_addr_odd + 4, t->flash_cmd_80);
-                target_write_word (t, base + t->flash_addr_odd + 4, t->flash_cmd_aa);
-                target_write_word (t, base + t->flash_addr_even + 4, t->flash_cmd_55);
-                target_write_word (t, base + t->flash_addr_odd + 4, t->flash_cmd_10);
-            }
-        }
+        flash_erase_cmd (t, base, base + t->flash_addr_odd, t->flash_cmd_10);
     }
 
-    for (;;) {
-        word = target_read_word (t, base);
-        if (word == 0xffffffff)
-            break;
-        fflush (stdout);
-        mdelay (250);
-        printf (".");
+    if (! t->micron_com_set &&
+        ! target_flash_wait (t, WAIT_ERASE_CHIP, t->erase_chip_ms * 1000,
+        base, 0xffffffff, 1)) {
+        fprintf (stderr, _("\nTimeout while erasing flash at %08X\n"), base);
+        return 0;
     }
     printf (_(" done\n"));
     return 1;
@@ -1336,7 +2325,7 @@ int target_erase (target_t *t, unsigned addr)
 
 int target_erase_sector (target_t *t, unsigned addr)
 {
-    unsigned word, base;
+    unsigned base;
 
     base = compute_base (t, addr);
 
@@ -1346,87 +2335,106 @@ int target_erase_sector (target_t *t, unsigned addr)
     printf (_("Erase: %08X"), addr);
 
     if (t->micron_com_set) {
-		unsigned status;
 		unsigned status_mask = 0;
-		unsigned timeout;
 		unsigned i;
 		for (i = 0; i < t->flash_width / t->chip_width; ++i)
 			status_mask = (status_mask << t->chip_width) | 0x80;
 
 		target_write_word (t, addr, 0x20202020);
 		target_write_word (t, addr, 0xd0d0d0d0);
-		timeout = 10000;
-		do {
-			status = target_read_word (t, addr);
-			if (timeout-- == 0) {
-				fprintf(stderr, "Timeout while erasing block at address 0x%08X\n", addr);
-				return 0;
-			}
-		} while (status != status_mask);
+		if (! target_flash_wait (t, WAIT_ERASE_SECTOR,
+		    t->erase_sector_ms * 1000, addr, status_mask, 0)) {
+			fprintf(stderr, "Timeout while erasing block at address 0x%08X\n", addr);
+			return 0;
+		}
 		printf (".");
         fflush (stdout);
         target_write_word (t, addr, 0xffffffff);
     } else {
-		if (t->flash_width == 8) {
-			/* 8-разрядная шина. */
-			target_write_byte (t, base + t->flash_addr_odd, t->flash_cmd_aa);
-			target_write_byte (t, base + t->flash_addr_even, t->flash_cmd_55);
-			target_write_byte (t, base + t->flash_addr_odd, t->flash_cmd_80);
-			target_write_byte (t, base + t->flash_addr_odd, t->flash_cmd_aa);
-			target_write_byte (t, base + t->flash_addr_even, t->flash_cmd_55);
-			target_write_byte (t, addr, t->flash_cmd_30);
-		} else if (t->flash_delay) {
-			target_write_nwords (t, 6,
-				base + t->flash_addr_odd, t->flash_cmd_aa,
-				base + t->flash_addr_even, t->flash_cmd_55,
-				base + t->flash_addr_odd, t->flash_cmd_80,
-				base + t->flash_addr_odd, t->flash_cmd_aa,
-				base + t->flash_addr_even, t->flash_cmd_55,
-				addr, t->flash_cmd_30);
-		} else {
-			target_write_word (t, base + t->flash_addr_odd, t->flash_cmd_aa);
-			target_write_word (t, base + t->flash_addr_even, t->flash_cmd_55);
-			target_write_word (t, base + t->flash_addr_odd, t->flash_cmd_80);
-			target_write_word (t, base + t->flash_addr_odd, t->flash_cmd_aa);
-			target_write_word (t, base + t->flash_addr_even, t->flash_cmd_55);
-			target_write_word (t, addr, t->flash_cmd_30);
-			if (t->flash_width == 64) {
-				/* Старшая половина 64-разрядной шины. */
-				target_write_word (t, base + t->flash_addr_odd + 4, t->flash_cmd_aa);
-				target_write_word (t, base + t->flash_addr_even + 4, t->flash_cmd_55);
-				target_write_word (t, base + t->flash_addr_odd + 4, t->flash_cmd_80);
-				target_write_word (t, base + t->flash_addr_odd + 4, t->flash_cmd_aa);
-				target_write_word (t, base + t->flash_addr_even + 4, t->flash_cmd_55);
-				target_write_word (t, addr + 4, t->flash_cmd_30);
-			}
-		}
-	}
+        flash_erase_cmd (t, base, addr, t->flash_cmd_30);
+    }
 
-    for (;;) {
-        word = target_read_word (t, addr);
-        if (word == 0xffffffff) {
-            target_read_word(t, MC_CSCON3); // Холостое чтение из другого адреса,
-                                            // чтобы сбросить какой-то кэш.
-            break;
+    if (! t->micron_com_set) {
+        if (! target_flash_wait (t, WAIT_ERASE_SECTOR, t->erase_sector_ms * 1000,
+            addr, 0xffffffff, 1)) {
+            fprintf (stderr, _("\nTimeout while erasing sector at %08X\n"), addr);
+            return 0;
         }
-        fflush (stdout);
-        mdelay (250);
-        printf (".");
+        target_read_word(t, MC_CSCON3); // Холостое чтение из другого адреса,
+                                        // чтобы сбросить какой-то кэш.
     }
     printf (_(" done\n"));
     return 1;
 }
 
+/*
+ * Запуск стирания микросхемы (sector=0) или сектора без ожидания:
+ * пока оно идёт, можно работать с другими областями flash-памяти.
+ * Окончание проверяется вызовами target_erase_poll().
+ * Для Micron возвращает 0: стирать надо обычным target_erase().
+ */
+int target_erase_start (target_t *t, unsigned addr, int sector)
+{
+    unsigned base;
+
+    if (t->micron_com_set)
+        return 0;
+    base = compute_base (t, addr);
+    if (sector) {
+        addr &= 0x0FFFFFFF;
+        addr |= (base & 0xF0000000);
+        flash_erase_cmd (t, base, addr, t->flash_cmd_30);
+        t->erase_kind = WAIT_ERASE_SECTOR;
+    } else {
+        addr = base;
+        flash_erase_cmd (t, base, base + t->flash_addr_odd, t->flash_cmd_10);
+        t->erase_kind = WAIT_ERASE_CHIP;
+    }
+    t->erase_addr = addr;
+    t->erase_t0 = time_usec ();
+    return 1;
+}
+
+/*
+ * Одна проверка готовности стирания, без задержки.
+ * Возвращает 1, если стирание закончено, 0 - если ещё идёт,
+ * -1 при ошибке или превышении времени.
+ */
+int target_erase_poll (target_t *t)
+{
+    flash_poll_t p = { t->erase_addr, 0, 0xffffffff, 0 };
+    unsigned elapsed, timeout_us;
+    int ready;
+
+    timeout_us = (t->erase_kind == WAIT_ERASE_CHIP) ?
+        t->erase_chip_ms * 1000 : t->erase_sector_ms * 1000;
+    ready = flash_check (t) (t, &p);
+    elapsed = time_usec () - t->erase_t0;
+    if (ready == 0 && elapsed < timeout_us + POLL_MARGIN_US)
+        return 0;
+
+    if (ready == 0)
+        fprintf (stderr, _("\nTimeout while erasing flash at %08X\n"),
+            t->erase_addr);
+    if (! poll_account (t, t->erase_kind, elapsed, ready))
+        return -1;
+    if (t->erase_kind == WAIT_ERASE_SECTOR)
+        target_read_word (t, MC_CSCON3);    /* холостое чтение, как в target_erase_sector() */
+    return 1;
+}
+
 int target_erase_area (target_t *t, unsigned addr, unsigned len)
 {
-	unsigned cur_len = 0;
+	unsigned cur_len = 0, size;
 	int ret = 1;
 
 	while (cur_len < len) {
 		ret = target_erase_sector(t, addr + cur_len);
 		if (ret == 0) return ret;
 
-		cur_len += t->sector_size;
+		/* Переходим на начало следующего сектора. */
+		size = target_sector_size (t, addr + cur_len);
+		cur_len += size - ((addr + cur_len) & (size - 1));
 	}
 
 	return ret;
@@ -1436,12 +2444,11 @@ int target_flash_rewrite (target_t *t, unsigned addr, unsigned bad, unsigned exp
 {
     unsigned base;
     unsigned char byte;
-    static unsigned nb_rewrites = 0;
 
 //fprintf (stderr, "\ntarget_flash_rewrite, bad = %08x, expected = %08x, addr=%08x ", bad, expected, addr); fflush (stderr);
 
-    nb_rewrites++;
-    //printf("nb_rewrites = %d\n", nb_rewrites);
+    t->nb_rewrites++;
+    //printf("nb_rewrites = %d\n", t->nb_rewrites);
 
     base = compute_base (t, addr);
     if (addr >= 0xA0000000)
@@ -1508,9 +2515,20 @@ void target_read_block (target_t *t, unsigned addr,
         return;
     }
     target_read_start (t);
+    if (! t->is_running) {
+        while (nwords > 0) {
+            unsigned n = nwords;
+            if (n > READ_BATCH_WORDS)
+                n = READ_BATCH_WORDS;
+            target_read_batch (t, addr, n, data);
+            data += n;
+            addr += n*4;
+            nwords -= n;
+        }
+        return;
+    }
     for (i=0; i<nwords; i++, addr+=4)
         *data++ = target_read_next (t, addr);
-fprintf (stderr, "    done (addr = %x)\n", addr);
 }
 
 void target_write_block (target_t *t, unsigned addr,
@@ -1523,7 +2541,9 @@ void target_write_block (target_t *t, unsigned addr,
     else if (addr >= 0x80000000)
         addr -= 0x80000000;
 
-    if (t->adapter->write_block) {
+    /* Блочная запись адаптера не ждёт RDYm на каждом слове:
+     * при работающем процессоре пишем по слову с ожиданием. */
+    if (t->adapter->write_block && ! t->is_running) {
         while (nwords > 0) {
             unsigned n = nwords;
             if (n > t->adapter->block_words)
@@ -1588,9 +2608,44 @@ static void target_program_block8 (target_t *t, unsigned addr,
 #endif
 }
 
+/*
+ * Режим unlock bypass: после входа в него каждое слово записывается
+ * командой A0 без двух циклов разблокировки. Для старшей половины
+ * 64-разрядной шины команды подаются по адресу half = base+4.
+ */
+static void flash_bypass_enter (target_t *t, unsigned half)
+{
+    target_write_nwords (t, 3,
+        half + t->flash_addr_odd, t->flash_cmd_aa,
+        half + t->flash_addr_even, t->flash_cmd_55,
+        half + t->flash_addr_odd, t->flash_cmd_20);
+}
+
+/*
+ * Выход из режима bypass возможен только после окончания записи
+ * последнего слова: команды во время записи не принимаются.
+ */
+static void flash_bypass_exit (target_t *t, unsigned half,
+    unsigned last_addr, unsigned last_data)
+{
+    if (! target_flash_wait (t, WAIT_PROGRAM, t->program_us,
+        last_addr, last_data, 0)) {
+        fprintf (stderr, _("Timeout while programming at %08X\n"),
+            last_addr);
+    }
+    target_write_nwords (t, 2, half, t->flash_cmd_90, half, 0);
+}
+
 static void target_program_block32 (target_t *t, unsigned addr,
     unsigned base, unsigned nwords, unsigned *data)
 {
+    unsigned cmd_aa = t->flash_cmd_aa, cmd_55 = t->flash_cmd_55;
+    unsigned last_addr = addr + (nwords-1)*4, last_data = data [nwords-1];
+
+    if (t->flash_bypass) {
+        flash_bypass_enter (t, base);
+        cmd_aa = cmd_55 = 0;
+    }
     if (t->adapter->program_block32) {
         while (nwords > 0) {
             unsigned n = nwords;
@@ -1599,28 +2654,82 @@ static void target_program_block32 (target_t *t, unsigned addr,
             t->adapter->program_block32 (t->adapter,
                 n, base, addr, data,
                 t->flash_addr_odd, t->flash_addr_even,
-                t->flash_cmd_aa, t->flash_cmd_55, t->flash_cmd_a0);
+                cmd_aa, cmd_55, t->flash_cmd_a0);
             data += n;
             addr += n*4;
             nwords -= n;
         }
-        return;
+    } else if (t->flash_bypass) {
+        while (nwords-- > 0) {
+            target_write_nwords (t, 2,
+                base + t->flash_addr_odd, t->flash_cmd_a0,
+                addr, *data++);
+            addr += 4;
+        }
+    } else {
+        while (nwords-- > 0) {
+            target_write_nwords (t, 4,
+                base + t->flash_addr_odd, t->flash_cmd_aa,
+                base + t->flash_addr_even, t->flash_cmd_55,
+                base + t->flash_addr_odd, t->flash_cmd_a0,
+                addr, *data++);
+            addr += 4;
+        }
     }
-    while (nwords-- > 0) {
+    if (t->flash_bypass)
+        flash_bypass_exit (t, base, last_addr, last_data);
+}
+
+/*
+ * Запись через буфер микросхем AMD/Spansion (команды 25h и 29h):
+ * страница буфера записывается одной операцией, и готовность
+ * опрашивается один раз на страницу, а не на каждое слово.
+ * Загрузка буфера не должна пересекать границу страницы.
+ */
+static void target_program_block32_buffer (target_t *t, unsigned addr,
+    unsigned base, unsigned nwords, unsigned *data)
+{
+    unsigned nbuf = t->write_buffer_words;
+    unsigned rep = t->flash_cmd_25 / 0x25;  /* по единице на микросхему */
+    unsigned sector_addr, n;
+
+    while (nwords > 0) {
+        n = nbuf - ((addr >> 2) & (nbuf - 1));
+        if (n > nwords)
+            n = nwords;
+        sector_addr = addr & ~(target_sector_size (t, addr) - 1);
+
         target_write_nwords (t, 4,
             base + t->flash_addr_odd, t->flash_cmd_aa,
             base + t->flash_addr_even, t->flash_cmd_55,
-            base + t->flash_addr_odd, t->flash_cmd_a0,
-            addr, *data++);
-        addr += 4;
+            sector_addr, t->flash_cmd_25,
+            sector_addr, (n - 1) * rep);
+        target_write_block (t, addr, n, data);
+        target_write_word (t, sector_addr, t->flash_cmd_29);
+
+        /* Готовность по последнему слову буфера. */
+        if (! target_flash_wait (t, WAIT_PROGRAM, t->program_us,
+            addr + (n-1)*4, data [n-1], 0)) {
+            fprintf (stderr, _("Timeout while programming buffer at %08X\n"),
+                addr);
+            /* Сброс после прерванной записи буфера. */
+            target_write_nwords (t, 3,
+                base + t->flash_addr_odd, t->flash_cmd_aa,
+                base + t->flash_addr_even, t->flash_cmd_55,
+                base + t->flash_addr_odd, t->flash_cmd_f0);
+            return;
+        }
+        data += n;
+        addr += n*4;
+        nwords -= n;
     }
 }
 
 static void target_program_block32_micron (target_t *t, unsigned addr,
     unsigned base, unsigned nwords, unsigned *data)
 {
-    unsigned sector_addr = addr & ~(t->sector_size - 1);
-    unsigned status, timeout;
+    unsigned sector_addr = addr & ~(target_sector_size (t, addr) - 1);
+    unsigned nbuf = t->write_buffer_words;
     int i, n;
 	unsigned status_mask = 0;
 
@@ -1628,18 +2737,14 @@ static void target_program_block32_micron (target_t *t, unsigned addr,
 		status_mask = (status_mask << t->chip_width) | 0x80;
 
     while (nwords > 0) {
-        timeout = 10000;
-        do {
-			target_write_word (t, sector_addr, 0xe8e8e8e8);
-            status = target_read_word (t, sector_addr);
-            if (timeout-- == 0) {
-                fprintf(stderr, "Timeout while programming block\n");
-                target_write_word (t, sector_addr, 0xffffffff);
-                return;
-            }
-        } while (status != status_mask);
+        if (! target_flash_wait_cmd (t, WAIT_PROGRAM, t->program_us,
+            sector_addr, 0xe8e8e8e8, status_mask)) {
+            fprintf(stderr, "Timeout while programming block\n");
+            target_write_word (t, sector_addr, 0xffffffff);
+            return;
+        }
 
-        n = (nwords < 16) ? (nwords - 1) : (0x000F);
+        n = (nwords < nbuf) ? (nwords - 1) : (nbuf - 1);
 
 		if (t->adapter->program_block32_micron) {
             t->adapter->program_block32_micron(t->adapter,
@@ -1656,26 +2761,14 @@ static void target_program_block32_micron (target_t *t, unsigned addr,
         }
         nwords -= (n + 1);
     }
-    timeout = 10000;
-    do {
-        status = target_read_word (t, sector_addr);
-        if (timeout-- == 0) {
-            fprintf(stderr, "Timeout while programming block\n");
-            target_write_word (t, sector_addr, 0xffffffff);
-            return;
-        }
-    } while (status != status_mask);
-
-    timeout = 10000;
-    do {
-        target_write_word (t, sector_addr, 0x70707070);
-        status = target_read_word (t, sector_addr);
-        if (timeout-- == 0) {
-            fprintf(stderr, "Timeout while programming block\n");
-            target_write_word (t, sector_addr, 0xffffffff);
-            return;
-        }
-    } while (status != status_mask);
+    if (! target_flash_wait (t, WAIT_PROGRAM, t->program_us * 16,
+        sector_addr, status_mask, 0) ||
+        ! target_flash_wait_cmd (t, WAIT_PROGRAM, t->program_us,
+        sector_addr, 0x70707070, status_mask)) {
+        fprintf(stderr, "Timeout while programming block\n");
+        target_write_word (t, sector_addr, 0xffffffff);
+        return;
+    }
 
     target_write_word (t, sector_addr, 0xffffffff);
 }
@@ -1728,6 +2821,17 @@ static void target_program_block32_atmel (target_t *t, unsigned addr,
 static void target_program_block64 (target_t *t, unsigned addr,
     unsigned base, unsigned nwords, unsigned *data)
 {
+    unsigned cmd_aa = t->flash_cmd_aa, cmd_55 = t->flash_cmd_55;
+    unsigned last_addr = addr + (nwords-1)*4, last_data = data [nwords-1];
+    unsigned prev_data = (nwords > 1) ? data [nwords-2] : 0;
+    unsigned count = nwords;
+
+    if (t->flash_bypass) {
+        /* Обе половины шины. */
+        flash_bypass_enter (t, base);
+        flash_bypass_enter (t, base + 4);
+        cmd_aa = cmd_55 = 0;
+    }
     if (t->adapter->program_block64) {
         while (nwords > 0) {
             unsigned n = nwords;
@@ -1736,39 +2840,433 @@ static void target_program_block64 (target_t *t, unsigned addr,
             t->adapter->program_block64 (t->adapter,
                 n, base, addr, data,
                 t->flash_addr_odd, t->flash_addr_even,
-                t->flash_cmd_aa, t->flash_cmd_55, t->flash_cmd_a0);
+                cmd_aa, cmd_55, t->flash_cmd_a0);
             data += n;
             addr += n*4;
             nwords -= n;
         }
-        return;
+    } else {
+        while (nwords-- > 0) {
+            /* Для старшей половины 64-разрядной шины
+             * команды подаются по адресам base+4. */
+            unsigned half = base + (addr & 4);
+
+            if (t->flash_bypass)
+                target_write_nwords (t, 2,
+                    half + t->flash_addr_odd, t->flash_cmd_a0,
+                    addr, *data++);
+            else
+                target_write_nwords (t, 4,
+                    half + t->flash_addr_odd, t->flash_cmd_aa,
+                    half + t->flash_addr_even, t->flash_cmd_55,
+                    half + t->flash_addr_odd, t->flash_cmd_a0,
+                    addr, *data++);
+            addr += 4;
+        }
     }
-    if (addr & 4) {
-        /* Старшая половина 64-разрядной шины. */
-        base += 4;
+    if (t->flash_bypass) {
+        /* Каждая половина выходит из bypass после окончания
+         * записи своего последнего слова: предыдущего перед
+         * последним, если в блоке больше одного слова. */
+        flash_bypass_exit (t, base + (last_addr & 4), last_addr, last_data);
+        if (count > 1)
+            flash_bypass_exit (t, base + (~last_addr & 4),
+                last_addr - 4, prev_data);
+        else
+            target_write_nwords (t, 2,
+                base + (~last_addr & 4), t->flash_cmd_90,
+                base + (~last_addr & 4), 0);
     }
-    while (nwords-- > 0) {
-        target_write_nwords (t, 4,
-            base + t->flash_addr_odd, t->flash_cmd_aa,
-            base + t->flash_addr_even, t->flash_cmd_55,
-            base + t->flash_addr_odd, t->flash_cmd_a0,
-            addr, *data++);
-        addr += 4;
+}
+
+/*
+ * Программа записи flash, выполняемая процессором из CRAM.
+ * Хост передаёт данные в два буфера по очереди: пока процессор
+ * записывает один буфер, заполняется другой. Процессор сам выдаёт
+ * команды AA-55-A0 и ждёт окончания записи каждого слова,
+ * сравнивая прочитанное значение с записанным (опрос DQ7).
+ *
+ * Заголовок буфера: число слов (не ноль - буфер заполнен)
+ * и адрес flash. Записав буфер, процессор обнуляет число слов.
+ * При тайм-ауте адрес слова помещается в поле ошибки,
+ * и программа зацикливается.
+ */
+#define LOADER_CODE         (CRAM_ADDR + 0x100)
+#define LOADER_MBOX         (CRAM_ADDR + 0x200)
+#define LOADER_BUF0         (CRAM_ADDR + 0x400)
+#define LOADER_BUF_WORDS    128
+#define LOADER_BUF1         (LOADER_BUF0 + 8 + LOADER_BUF_WORDS*4)
+#define LOADER_POLLS_PER_US 100     /* оценка сверху: опросов flash за мксек */
+
+/* Поля блока параметров. */
+#define MBOX_ADDR_ODD       0
+#define MBOX_ADDR_EVEN      4
+#define MBOX_CMD_AA         8
+#define MBOX_CMD_55         12
+#define MBOX_CMD_A0         16
+#define MBOX_TIMEOUT        20
+#define MBOX_ERROR          24
+#define MBOX_BUF0           28
+#define MBOX_BUF1           32
+#define MBOX_WORDS          9
+
+/* Регистры процессора, используемые программой. */
+#define V0          2
+#define V1          3
+#define T0          8
+#define S0          16
+#define S1          17
+#define S2          18
+#define A0          4
+#define A1          5
+#define A2          6
+#define A3          7
+#define T8          24
+#define T9          25
+
+#define I_TYPE(op, rs, rt, imm) ((op) | (rs) << 21 | (rt) << 16 | ((imm) & 0xffff))
+#define R_TYPE(fn, rs, rt, rd)  ((fn) | (rs) << 21 | (rt) << 16 | (rd) << 11)
+
+static const unsigned loader_code[] = {
+    I_TYPE (MIPS_LUI,   0,    S0,   LOADER_MBOX >> 16),
+    I_TYPE (MIPS_ORI,   S0,   S0,   LOADER_MBOX),
+    I_TYPE (MIPS_LW,    S0,   T0,   MBOX_ADDR_ODD),     /* t0 = адрес AA и A0 */
+    I_TYPE (MIPS_LW,    S0,   T0+1, MBOX_ADDR_EVEN),    /* t1 = адрес 55 */
+    I_TYPE (MIPS_LW,    S0,   T0+2, MBOX_CMD_AA),
+    I_TYPE (MIPS_LW,    S0,   T0+3, MBOX_CMD_55),
+    I_TYPE (MIPS_LW,    S0,   T0+4, MBOX_CMD_A0),
+    I_TYPE (MIPS_LW,    S0,   S1,   MBOX_BUF0),         /* s1 = текущий буфер */
+    I_TYPE (MIPS_LW,    S0,   S2,   MBOX_BUF1),         /* s2 = следующий */
+/* 9: ждём заполнения буфера */
+    I_TYPE (MIPS_LW,    S1,   T0+5, 0),                 /* t5 = число слов */
+    I_TYPE (MIPS_BEQ,   T0+5, 0,    -2),
+    MIPS_NOP,
+    I_TYPE (MIPS_LW,    S1,   T0+6, 4),                 /* t6 = адрес flash */
+    I_TYPE (MIPS_ADDIU, S1,   T0+7, 8),                 /* t7 = данные */
+/* 14: запись слова */
+    I_TYPE (MIPS_LW,    T0+7, T8,   0),
+    I_TYPE (MIPS_SW,    T0,   T0+2, 0),
+    I_TYPE (MIPS_SW,    T0+1, T0+3, 0),
+    I_TYPE (MIPS_SW,    T0,   T0+4, 0),
+    I_TYPE (MIPS_SW,    T0+6, T8,   0),
+    I_TYPE (MIPS_LW,    S0,   T9,   MBOX_TIMEOUT),
+/* 20: ждём окончания записи */
+    I_TYPE (MIPS_LW,    T0+6, V0,   0),
+    I_TYPE (MIPS_BEQ,   V0,   T8,   6),
+    I_TYPE (MIPS_ADDIU, T9,   T9,   -1),
+    I_TYPE (MIPS_BNE,   T9,   0,    -4),
+    MIPS_NOP,
+    I_TYPE (MIPS_SW,    S0,   T0+6, MBOX_ERROR),        /* тайм-аут */
+    I_TYPE (MIPS_BEQ,   0,    0,    -1),
+    MIPS_NOP,
+/* 28: следующее слово */
+    I_TYPE (MIPS_ADDIU, T0+7, T0+7, 4),
+    I_TYPE (MIPS_ADDIU, T0+5, T0+5, -1),
+    I_TYPE (MIPS_BNE,   T0+5, 0,    -17),
+    I_TYPE (MIPS_ADDIU, T0+6, T0+6, 4),
+    I_TYPE (MIPS_SW,    S1,   0,    0),                 /* буфер свободен */
+    R_TYPE (MIPS_ADDU,  S1,   0,    V1),                /* меняем буферы */
+    R_TYPE (MIPS_ADDU,  S2,   0,    S1),
+    I_TYPE (MIPS_BEQ,   0,    0,    -27),
+    R_TYPE (MIPS_ADDU,  V1,   0,    S2),
+};
+
+static int check_loader_buf (target_t *t, void *arg)
+{
+    return target_read_word (t, *(unsigned*) arg) == 0;
+}
+
+/*
+ * Ожидание освобождения буфера. При ошибке останавливаем процессор.
+ */
+static int loader_wait (target_t *t, unsigned buf, unsigned nwords)
+{
+    unsigned err;
+
+    if (target_poll (t, WAIT_PROGRAM, nwords * t->program_us,
+        check_loader_buf, &buf, 0))
+        return 1;
+
+    err = target_read_word (t, LOADER_MBOX + MBOX_ERROR);
+    target_stop (t);
+    if (err)
+        fprintf (stderr, _("Timeout programming flash at %08X\n"), err);
+    else
+        fprintf (stderr, _("Flash loader is not responding\n"));
+    return 0;
+}
+
+static void target_program_loader (target_t *t, unsigned addr,
+    unsigned base, unsigned nwords, unsigned *data)
+{
+    unsigned mbox [MBOX_WORDS], hdr [2], buf [2] = { LOADER_BUF0, LOADER_BUF1 };
+    unsigned n, cur;
+
+    /* Программа и параметры загружаются при остановленном процессоре. */
+    target_stop (t);
+    mbox [MBOX_ADDR_ODD/4] = (base + t->flash_addr_odd) | 0xA0000000;
+    mbox [MBOX_ADDR_EVEN/4] = (base + t->flash_addr_even) | 0xA0000000;
+    mbox [MBOX_CMD_AA/4] = t->flash_cmd_aa;
+    mbox [MBOX_CMD_55/4] = t->flash_cmd_55;
+    mbox [MBOX_CMD_A0/4] = t->flash_cmd_a0;
+    mbox [MBOX_TIMEOUT/4] = t->program_us * LOADER_POLLS_PER_US;
+    mbox [MBOX_ERROR/4] = 0;
+    mbox [MBOX_BUF0/4] = LOADER_BUF0;
+    mbox [MBOX_BUF1/4] = LOADER_BUF1;
+    target_write_block (t, LOADER_CODE,
+        sizeof (loader_code) / sizeof (loader_code[0]), (unsigned*) loader_code);
+    target_write_block (t, LOADER_MBOX, MBOX_WORDS, mbox);
+
+    /* Оба буфера заполняем заранее, блочной записью. */
+    for (cur=0; cur<2; cur++) {
+        n = (nwords < LOADER_BUF_WORDS) ? nwords : LOADER_BUF_WORDS;
+        hdr[0] = n;
+        hdr[1] = addr | 0xA0000000;
+        target_write_block (t, buf[cur], 2, hdr);
+        if (n > 0)
+            target_write_block (t, buf[cur] + 8, n, data);
+        data += n;
+        addr += n*4;
+        nwords -= n;
+    }
+    target_run (t, LOADER_CODE);
+
+    /* Пока процессор пишет один буфер, заполняем другой.
+     * Число слов записывается последним: после него
+     * процессор может начать запись буфера. */
+    for (cur=0; nwords > 0; cur^=1) {
+        if (! loader_wait (t, buf[cur], LOADER_BUF_WORDS))
+            return;
+        n = (nwords < LOADER_BUF_WORDS) ? nwords : LOADER_BUF_WORDS;
+        target_write_block (t, buf[cur] + 8, n, data);
+        target_write_word (t, buf[cur] + 4, addr | 0xA0000000);
+        target_write_word (t, buf[cur], n);
+        data += n;
+        addr += n*4;
+        nwords -= n;
     }
+    if (! loader_wait (t, buf[cur], LOADER_BUF_WORDS) ||
+        ! loader_wait (t, buf[cur^1], LOADER_BUF_WORDS))
+        return;
+    target_stop (t);
 }
 
-void target_program_block (target_t *t, unsigned addr,
-    unsigned nwords, unsigned *data)
+/*
+ * Подсчёт CRC32 программой, выполняемой процессором из CRAM.
+ * Область памяти делится на части, для каждой части
+ * вычисляется своя сумма. Хост считывает только суммы.
+ * Таблица CRC передаётся в CRAM вместе с программой.
+ */
+#define CRC_TABLE           (CRAM_ADDR + 0x400)
+#define CRC_RESULT          (CRAM_ADDR + 0x800)
+#define CRC_MAX_CHUNKS      512
+#define CRC_US_PER_WORD     4       /* оценка сверху: мксек на слово */
+
+/* Поля блока параметров. */
+#define CMBOX_ADDR          0
+#define CMBOX_NWORDS        4
+#define CMBOX_CHUNK         8
+#define CMBOX_TABLE         12
+#define CMBOX_RESULT        16
+#define CMBOX_DONE          20
+#define CMBOX_WORDS         6
+
+static const unsigned crc_code[] = {
+    I_TYPE (MIPS_LUI,   0,    S0,   LOADER_MBOX >> 16),
+    I_TYPE (MIPS_ORI,   S0,   S0,   LOADER_MBOX),
+    I_TYPE (MIPS_LW,    S0,   A0,   CMBOX_ADDR),        /* a0 = адрес */
+    I_TYPE (MIPS_LW,    S0,   A1,   CMBOX_NWORDS),      /* a1 = всего слов */
+    I_TYPE (MIPS_LW,    S0,   A2,   CMBOX_CHUNK),       /* a2 = слов в части */
+    I_TYPE (MIPS_LW,    S0,   A3,   CMBOX_TABLE),       /* a3 = таблица */
+    I_TYPE (MIPS_LW,    S0,   S1,   CMBOX_RESULT),      /* s1 = суммы */
+/* 7: начало части */
+    I_TYPE (MIPS_ADDIU, 0,    V0,   -1),                /* v0 = CRC */
+    R_TYPE (MIPS_ADDU,  A2,   0,    T0),
+/* 9: очередное слово */
+    I_TYPE (MIPS_LW,    A0,   T0+1, 0),
+    I_TYPE (MIPS_ADDIU, 0,    T0+2, 4),
+/* 11: очередной байт */
+    R_TYPE (MIPS_XOR,   V0,   T0+1, T0+3),
+    I_TYPE (MIPS_ANDI,  T0+3, T0+3, 0xff),
+    R_TYPE (MIPS_SLL,   0,    T0+3, T0+3) | 2 << 6,
+    R_TYPE (MIPS_ADDU,  T0+3, A3,   T0+3),
+    I_TYPE (MIPS_LW,    T0+3, T0+3, 0),
+    R_TYPE (MIPS_SRL,   0,    V0,   V0) | 8 << 6,
+    R_TYPE (MIPS_XOR,   V0,   T0+3, V0),
+    I_TYPE (MIPS_ADDIU, T0+2, T0+2, -1),
+    I_TYPE (MIPS_BNE,   T0+2, 0,    -9),
+    R_TYPE (MIPS_SRL,   0,    T0+1, T0+1) | 8 << 6,
+/* 21: следующее слово */
+    I_TYPE (MIPS_ADDIU, A0,   A0,   4),
+    I_TYPE (MIPS_ADDIU, A1,   A1,   -1),
+    I_TYPE (MIPS_BEQ,   A1,   0,    7),
+    I_TYPE (MIPS_ADDIU, T0,   T0,   -1),
+    I_TYPE (MIPS_BNE,   T0,   0,    -17),
+    MIPS_NOP,
+/* 27: конец части */
+    R_TYPE (MIPS_NOR,   V0,   0,    V0),
+    I_TYPE (MIPS_SW,    S1,   V0,   0),
+    I_TYPE (MIPS_BEQ,   0,    0,    -23),
+    I_TYPE (MIPS_ADDIU, S1,   S1,   4),
+/* 31: конец области */
+    R_TYPE (MIPS_NOR,   V0,   0,    V0),
+    I_TYPE (MIPS_SW,    S1,   V0,   0),
+    I_TYPE (MIPS_ADDIU, 0,    T0,   1),
+    I_TYPE (MIPS_SW,    S0,   T0,   CMBOX_DONE),
+    I_TYPE (MIPS_BEQ,   0,    0,    -1),
+    MIPS_NOP,
+};
+
+/*
+ * Таблица CRC32, полином 0xEDB88320. Постоянная, чтобы потоки
+ * одновременной записи нескольких плат не заполняли её наперегонки.
+ */
+static const unsigned crc_table [256] = {
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba,
+    0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
+    0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
+    0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de,
+    0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec,
+    0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
+    0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
+    0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940,
+    0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116,
+    0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
+    0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
+    0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a,
+    0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818,
+    0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
+    0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
+    0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c,
+    0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2,
+    0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
+    0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
+    0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086,
+    0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4,
+    0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
+    0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
+    0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8,
+    0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe,
+    0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
+    0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
+    0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252,
+    0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60,
+    0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
+    0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
+    0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04,
+    0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a,
+    0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
+    0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
+    0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e,
+    0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c,
+    0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
+    0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
+    0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0,
+    0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6,
+    0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
+    0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
+};
+
+/*
+ * CRC32 блока данных на стороне хоста, для сравнения.
+ */
+unsigned target_crc32 (const unsigned char *data, unsigned nbytes)
 {
-    unsigned base;
+    unsigned crc = ~0;
+
+    while (nbytes-- > 0)
+        crc = crc_table [(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static int check_crc_done (target_t *t, void *arg)
+{
+    return target_read_word (t, LOADER_MBOX + CMBOX_DONE) != 0;
+}
+
+/*
+ * Суммы CRC32 частей области памяти по chunk байт.
+ * Длина области и части кратны 4. Возвращает 0, если
+ * программа на процессоре не отработала.
+ */
+int target_checksum (target_t *t, unsigned addr, unsigned nbytes,
+    unsigned chunk, unsigned *crc)
+{
+    unsigned mbox [CMBOX_WORDS], n, nchunks;
 
-    base = compute_base (t, addr);
     if (addr >= 0xA0000000)
         addr -= 0xA0000000;
     else if (addr >= 0x80000000)
         addr -= 0x80000000;
-//fprintf (stderr, "target_program_block (addr = %x, nwords = %d), flash_width = %d, base = %x\n", addr, nwords, t->flash_width, base);
 
+    /* Программа, таблица и суммы занимают часть CRAM: если
+     * проверяемая область с ней пересекается, считать нельзя. */
+    if (addr < (CRC_RESULT + CRC_MAX_CHUNKS*4 - 0xA0000000) &&
+        addr + nbytes > LOADER_CODE - 0xA0000000)
+        return 0;
+
+    target_stop (t);
+    target_write_block (t, LOADER_CODE,
+        sizeof (crc_code) / sizeof (crc_code[0]), (unsigned*) crc_code);
+    target_write_block (t, CRC_TABLE, 256, (unsigned*) crc_table);
+
+    while (nbytes > 0) {
+        n = nbytes;
+        if (n > chunk * CRC_MAX_CHUNKS)
+            n = chunk * CRC_MAX_CHUNKS;
+        nchunks = (n + chunk - 1) / chunk;
+
+        mbox [CMBOX_ADDR/4] = addr | 0xA0000000;
+        mbox [CMBOX_NWORDS/4] = n / 4;
+        mbox [CMBOX_CHUNK/4] = chunk / 4;
+        mbox [CMBOX_TABLE/4] = CRC_TABLE;
+        mbox [CMBOX_RESULT/4] = CRC_RESULT;
+        mbox [CMBOX_DONE/4] = 0;
+        target_write_block (t, LOADER_MBOX, CMBOX_WORDS, mbox);
+        target_run (t, LOADER_CODE);
+        if (! target_poll (t, WAIT_CHECKSUM, n / 4 * CRC_US_PER_WORD,
+            check_crc_done, 0, 0)) {
+            target_stop (t);
+            fprintf (stderr, _("Checksum routine is not responding\n"));
+            return 0;
+        }
+        target_stop (t);
+        target_read_block (t, CRC_RESULT, nchunks, crc);
+
+        crc += nchunks;
+        addr += n;
+        nbytes -= n;
+    }
+    return 1;
+}
+
+/*
+ * Запись непрерывного участка flash-памяти.
+ */
+static void target_program_run (target_t *t, unsigned addr,
+    unsigned base, unsigned nwords, unsigned *data)
+{
     switch (t->flash_width) {
     case 8:
         /* 8-разрядная шина. */
@@ -1777,9 +3275,13 @@ void target_program_block (target_t *t, unsigned addr,
     case 32:
         if (t->micron_com_set) {
             target_program_block32_micron (t, addr, base, nwords, data);
+        } else if (t->use_loader && ! t->flash_delay) {
+            target_program_loader (t, addr, base, nwords, data);
         } else if (t->flash_delay) {
             target_program_block32_atmel (t,
                 addr, base, nwords, data);
+        } else if (t->write_buffer_words) {
+            target_program_block32_buffer (t, addr, base, nwords, data);
         } else {
             target_program_block32 (t, addr, base, nwords, data);
         }
@@ -1791,6 +3293,95 @@ void target_program_block (target_t *t, unsigned addr,
     }
 }
 
+/*
+ * Слова 0xFFFFFFFF после стирания записывать не нужно.
+ * При пословной записи пропускается любое такое слово.
+ * Блочную запись адаптером, программой в CRAM или через буфер
+ * микросхемы выгодно прерывать только ради длинной серии. Буфер Micron пропускается
+ * только целиком, а страничную запись Atmel дробить нельзя.
+ * Возвращает минимальную длину пропускаемой серии, 0 - не пропускать.
+ */
+#define ERASED_RUN_MIN  8
+
+static unsigned erased_run_min (target_t *t, unsigned *unit)
+{
+    *unit = 1;
+    switch (t->flash_width) {
+    case 32:
+        if (t->flash_delay)
+            return 0;
+        if (t->micron_com_set) {
+            *unit = t->write_buffer_words;
+            return t->adapter->program_block32_micron ? *unit : 1;
+        }
+        if (t->use_loader)
+            return LOADER_BUF_WORDS;
+        if (t->write_buffer_words)
+            return t->write_buffer_words;
+        return t->adapter->program_block32 ? ERASED_RUN_MIN : 1;
+    case 64:
+        return t->adapter->program_block64 ? ERASED_RUN_MIN : 1;
+    }
+    return 1;
+}
+
+/*
+ * Число стёртых слов в начале участка, целыми группами по unit слов.
+ */
+static unsigned count_erased (unsigned *data, unsigned nwords, unsigned unit)
+{
+    unsigned n;
+
+    for (n=0; n<nwords; n++) {
+        if (data[n] != 0xffffffff)
+            break;
+    }
+    if (n < nwords)
+        n -= n % unit;
+    return n;
+}
+
+void target_program_block (target_t *t, unsigned addr,
+    unsigned nwords, unsigned *data)
+{
+    unsigned base, n, skip, unit, run_min;
+
+    base = compute_base (t, addr);
+    if (addr >= 0xA0000000)
+        addr -= 0xA0000000;
+    else if (addr >= 0x80000000)
+        addr -= 0x80000000;
+//fprintf (stderr, "target_program_block (addr = %x, nwords = %d), flash_width = %d, base = %x\n", addr, nwords, t->flash_width, base);
+
+    run_min = erased_run_min (t, &unit);
+    if (run_min == 0) {
+        target_program_run (t, addr, base, nwords, data);
+        return;
+    }
+    while (nwords > 0) {
+        /* Пропускаем стёртые слова. */
+        n = count_erased (data, nwords, unit);
+        data += n;
+        addr += n*4;
+        nwords -= n;
+
+        /* Участок до длинной серии стёртых слов или до конца. */
+        for (n=0; n<nwords; ) {
+            skip = count_erased (data + n, nwords - n, unit);
+            if (skip >= run_min || n + skip == nwords)
+                break;
+            n += skip ? skip : unit;
+            if (n > nwords)
+                n = nwords;
+        }
+        if (n > 0)
+            target_program_run (t, addr, base, n, data);
+        data += n;
+        addr += n*4;
+        nwords -= n;
+    }
+}
+
 /*
  * Проверка состояния процессора, не остановился ли.
  */
@@ -1896,12 +3487,14 @@ void target_add_break (target_t *t, unsigned addr, int type)
 {
     unsigned obcr, omlr0, omlr1;
 
-    obcr = t->adapter->oncd_read (t->adapter, OnCD_OBCR, 12);
+    oncd_queue_read (t, OnCD_OBCR, 12, &obcr);
+    oncd_queue_read (t, OnCD_OMLR0, 32, &omlr0);
+    oncd_flush (t);
     if (obcr & OBCR_RW0_RW) {
         /* Если одна точка уже есть - перемещаем её на место второй. */
         obcr = (obcr << 1 & OBCR_MBS1) |
             (obcr << 4 & (OBCR_RW1_MASK | OBCR_CC1_MASK));
-        omlr1 = t->adapter->oncd_read (t->adapter, OnCD_OMLR0, 32);
+        omlr1 = omlr0;
     } else {
         obcr = OBCR_ANY;
         omlr1 = 0;
@@ -1915,10 +3508,11 @@ void target_add_break (target_t *t, unsigned addr, int type)
     }
     omlr0 = addr;
 
-    t->adapter->oncd_write (t->adapter, omlr0, OnCD_OMLR0, 32);
-    t->adapter->oncd_write (t->adapter, omlr1, OnCD_OMLR1, 32);
-    t->adapter->oncd_write (t->adapter, obcr, OnCD_OBCR, 12);
-    t->adapter->oncd_write (t->adapter, 0, OnCD_OMBC, 16);
+    oncd_queue_write (t, omlr0, OnCD_OMLR0, 32);
+    oncd_queue_write (t, omlr1, OnCD_OMLR1, 32);
+    oncd_queue_write (t, obcr, OnCD_OBCR, 12);
+    oncd_queue_write (t, 0, OnCD_OMBC, 16);
+    oncd_flush (t);
 //fprintf (stderr, "target_add_break (%08x, '%c'), obcr = %03x, omlr0 = %08x, omlr1 = %08x\n", addr, type, obcr, omlr0, omlr1);
 }
 
@@ -1926,9 +3520,10 @@ void target_remove_break (target_t *t, unsigned addr)
 {
     unsigned obcr, omlr0, omlr1;
 
-    obcr = t->adapter->oncd_read (t->adapter, OnCD_OBCR, 12);
-    omlr0 = t->adapter->oncd_read (t->adapter, OnCD_OMLR0, 32);
-    omlr1 = t->adapter->oncd_read (t->adapter, OnCD_OMLR1, 32);
+    oncd_queue_read (t, OnCD_OBCR, 12, &obcr);
+    oncd_queue_read (t, OnCD_OMLR0, 32, &omlr0);
+    oncd_queue_read (t, OnCD_OMLR1, 32, &omlr1);
+    oncd_flush (t);
 
     if ((obcr & OBCR_RW0_RW) && omlr0 == addr) {
         if (obcr & OBCR_RW1_RW) {
@@ -1958,9 +3553,10 @@ void target_remove_break (target_t *t, unsigned addr)
 //fprintf (stderr, "target_remove_break (%08x) failed: obcr = %03x, omlr0 = %08x, omlr1 = %08x\n", addr, obcr, omlr0, omlr1);
         return;
     }
-    t->adapter->oncd_write (t->adapter, obcr, OnCD_OBCR, 12);
-    t->adapter->oncd_write (t->adapter, omlr0, OnCD_OMLR0, 32);
-    t->adapter->oncd_write (t->adapter, omlr1, OnCD_OMLR1, 32);
+    oncd_queue_write (t, obcr, OnCD_OBCR, 12);
+    oncd_queue_write (t, omlr0, OnCD_OMLR0, 32);
+    oncd_queue_write (t, omlr1, OnCD_OMLR1, 32);
+    oncd_flush (t);
 //fprintf (stderr, "target_remove_break (%08x), obcr = %03x, omlr0 = %08x, omlr1 = %08x\n", addr, obcr, omlr0, omlr1);
 }
 
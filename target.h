@@ -20,13 +20,21 @@
 typedef struct _target_t target_t;
 
 target_t *target_open (int need_reset, int disable_block);
+target_t *target_open_adapter (const char *spec, int need_reset, int disable_block);
+void target_record (const char *filename);
+void target_flash_loader (int enable);
+void target_report_stats (target_t *t,
+    void (*print) (void *arg, const char *line), void *arg);
 void target_close (target_t *mc);
+target_t *target_flash_context (target_t *mc);
+void target_flash_context_free (target_t *mc, target_t *ctx);
 
 unsigned target_idcode (target_t *mc);
 const char *target_cpu_name (target_t *mc);
 
 unsigned target_flash_width (target_t *mc);
 unsigned target_flash_bytes (target_t *mc);
+unsigned target_sector_size (target_t *mc, unsigned addr);
 void target_flash_configure (target_t *mc, unsigned first, unsigned last);
 int target_flash_detect (target_t *mc, unsigned base,
 	unsigned *mf, unsigned *dev, char *mfname, char *devname,
@@ -36,9 +44,14 @@ unsigned target_flash_next (target_t *mc, unsigned prev, unsigned *last);
 int target_erase (target_t *mc, unsigned addr);
 int target_erase_sector (target_t *mc, unsigned addr);
 int target_erase_area (target_t *mc, unsigned addr, unsigned len);
+int target_erase_start (target_t *mc, unsigned addr, int sector);
+int target_erase_poll (target_t *mc);
 void target_program_block (target_t *mc, unsigned addr,
 	unsigned nwords, unsigned *data);
 int target_flash_rewrite (target_t *mc, unsigned addr, unsigned bad, unsigned expected);
+int target_checksum (target_t *mc, unsigned addr, unsigned nbytes,
+	unsigned chunk, unsigned *crc);
+unsigned target_crc32 (const unsigned char *data, unsigned nbytes);
 
 void target_read_start (target_t *t);
 unsigned target_read_next (target_t *t, unsigned addr);
@@ -70,3 +83,4 @@ void target_remove_break (target_t *t, unsigned addr);
 
 unsigned target_flash_address (target_t *mc, unsigned flash_num);
 void target_set_cscon3 (target_t *t, unsigned value);
+unsigned target_set_clock (target_t *t, unsigned khz);
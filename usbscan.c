@@ -0,0 +1,79 @@
+/*
+ * Поиск адаптеров JTAG на шине USB.
+ * Шина сканируется один раз, результат используется всеми типами адаптеров.
+ *
+ * Этот файл распространяется в надежде, что он окажется полезным, но
+ * БЕЗ КАКИХ БЫ ТО НИ БЫЛО ГАРАНТИЙНЫХ ОБЯЗАТЕЛЬСТВ; в том числе без косвенных
+ * гарантийных обязательств, связанных с ПОТРЕБИТЕЛЬСКИМИ СВОЙСТВАМИ и
+ * ПРИГОДНОСТЬЮ ДЛЯ ОПРЕДЕЛЕННЫХ ЦЕЛЕЙ.
+ *
+ * Вы вправе распространять и/или изменять этот файл в соответствии
+ * с условиями Генеральной Общественной Лицензии GNU (GPL) в том виде,
+ * как она была опубликована Фондом Свободного ПО; либо версии 2 Лицензии
+ * либо (по вашему желанию) любой более поздней версии. Подробности
+ * смотрите в прилагаемом файле 'COPYING.txt'.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <usb.h>
+
+#include "adapter.h"
+
+static int usb_scanned;
+
+/*
+ * Сравнение устройства с заданным идентификатором:
+ * серийным номером или путём "шина/устройство".
+ */
+static int usb_match_id (struct usb_bus *bus, struct usb_device *dev,
+    const char *id)
+{
+    usb_dev_handle *h;
+    char serial [256];
+    int n;
+
+    n = strlen (bus->dirname);
+    if (strncmp (id, bus->dirname, n) == 0 && id[n] == '/' &&
+        strcmp (id + n + 1, dev->filename) == 0)
+        return 1;
+
+    if (! dev->descriptor.iSerialNumber)
+        return 0;
+    h = usb_open (dev);
+    if (! h)
+        return 0;
+    n = usb_get_string_simple (h, dev->descriptor.iSerialNumber,
+        serial, sizeof (serial));
+    usb_close (h);
+    return n > 0 && strcmp (serial, id) == 0;
+}
+
+/*
+ * Поиск устройства USB по идентификаторам производителя и продукта.
+ * Если задан id, выбираем устройство с таким серийным номером
+ * или путём "шина/устройство".
+ * Если устройство не найдено, возвращаем 0.
+ */
+struct usb_device *adapter_usb_find (unsigned vid, unsigned pid,
+    const char *id)
+{
+    struct usb_bus *bus;
+    struct usb_device *dev;
+
+    if (! usb_scanned) {
+        usb_init ();
+        usb_find_busses ();
+        usb_find_devices ();
+        usb_scanned = 1;
+    }
+    for (bus = usb_get_busses(); bus; bus = bus->next) {
+        for (dev = bus->devices; dev; dev = dev->next) {
+            if (dev->descriptor.idVendor != vid ||
+                dev->descriptor.idProduct != pid)
+                continue;
+            if (! id || usb_match_id (bus, dev, id))
+                return dev;
+        }
+    }
+    return 0;
+}